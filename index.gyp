@@ -3,22 +3,35 @@
     'variables': {
         'common_sources': [
             'src/config.cc',
+            'src/case_fold.cc',
+            'src/content_reader.cc',
             'src/context.cc',
             'src/mmap.cc',
+            'src/ngram_filter.cc',
             'src/util.cc',
             ],
         'reader_sources': [
             'src/file_util.cc',
             'src/integer_index_reader.cc',
+            'src/intersect.cc',
+            'src/lines_reader.cc',
             'src/ngram_index_reader.cc',
+            'src/ngram_query.cc',
             'src/ngram_table_reader.cc',
+            'src/posting_list.cc',
+            'src/query_plan.cc',
+            'src/regexp.cc',
             'src/search_results.cc',
             ],
         'writer_sources': [
+            'src/content_writer.cc',
             'src/file_util.cc',
             'src/index_writer.cc',
             'src/ngram_counter.cc',
+            'src/intersect.cc',
+            'src/lines_writer.cc',
             'src/ngram_index_writer.cc',
+            'src/posting_list.cc',
             'src/sstable_writer.cc',
             ],
         'rpc_sources': [
@@ -51,6 +64,7 @@
             '-lboost_program_options',
             '-lglog',
             '-lprotobuf',
+            '-lsnappy',
             ],
         'sources': [
             'src/index.pb.cc',
@@ -108,6 +122,14 @@
                 'src/bench.cc',
                 ],
             },
+        {
+            'type': 'executable',
+            'target_name': 'intersect_test',
+            'sources': [
+                'src/intersect.cc',
+                'src/intersect_test.cc',
+                ],
+            },
         {
             'type': 'executable',
             'target_name': 'cindex',
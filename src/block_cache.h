@@ -0,0 +1,53 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// A memory-bounded cache of the decompressed blocks of text of a
+// compressed "lines" index (see lines_reader.h), keyed by the number
+// of the table and the number of the block. The lines that queries
+// check are clustered in the files that have the query's ngrams, and
+// the same few blocks tend to be checked by query after query, so one
+// cache is shared by all of the readers of an index (see
+// Context::block_cache()). See clock_cache.h for how entries are
+// evicted.
+
+#ifndef SRC_BLOCK_CACHE_H_
+#define SRC_BLOCK_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "./clock_cache.h"
+
+namespace codesearch {
+class BlockCache : public ClockCache<std::string> {
+ public:
+  explicit BlockCache(std::size_t max_bytes, std::size_t num_shards = 16)
+      :ClockCache<std::string>(max_bytes, num_shards) {}
+
+  // The number of the "lines" table. Every reader of the table uses
+  // it, so that a block that one reader decompresses is found by the
+  // others.
+  static const std::size_t lines_table = 0;
+
+  // Look up a block of a table. Returns a null pointer on a miss.
+  std::shared_ptr<const std::string> Find(std::size_t table,
+                                          std::uint64_t block) {
+    return ClockCache<std::string>::Find(Key(table, block));
+  }
+
+  // Add a block to the cache, evicting other blocks to make room for
+  // it
+  void Insert(std::size_t table, std::uint64_t block,
+              const std::shared_ptr<const std::string> &data) {
+    ClockCache<std::string>::Insert(Key(table, block), data, data->size());
+  }
+
+ private:
+  inline std::uint64_t Key(std::size_t table, std::uint64_t block) const {
+    return static_cast<std::uint64_t>(table) << 40 | block;
+  }
+};
+}
+
+#endif  // SRC_BLOCK_CACHE_H_
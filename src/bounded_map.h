@@ -21,9 +21,16 @@ enum class BoundedMapInsertionResult : std::uint8_t {
   VAL_LIST_TOO_LONG = 2
 };
 
+// A mutex that doesn't lock anything, for a BoundedMap that only one
+// thread uses
+struct NullMutex {
+  void lock() {}
+  void unlock() {}
+};
+
 #define USE_ORDERED_MAP 1
 
-template <typename K, typename V>
+template <typename K, typename V, typename Mutex = std::mutex>
 class BoundedMap {
  public:
   BoundedMap(std::size_t max_keys, std::size_t max_vals)
@@ -39,7 +46,7 @@ class BoundedMap {
 
   // Insert a key/value to the map
   BoundedMapInsertionResult insert(const K &key, const V &val) {
-    std::lock_guard<std::mutex> guard(mut_);
+    std::lock_guard<Mutex> guard(mut_);
     if (map_.size() < max_keys_) {
       if (key > max_key_) {
         max_key_ = key;
@@ -86,20 +93,26 @@ class BoundedMap {
 
   // Get a copy of the map
   const map_type & map() const {
-    std::lock_guard<std::mutex> guard(mut_);
+    std::lock_guard<Mutex> guard(mut_);
     return map_;
   }
 
   bool IsFull() const {
-    std::lock_guard<std::mutex> guard(mut_);
+    std::lock_guard<Mutex> guard(mut_);
     return map_.size() >= max_keys_;
   }
 
   std::size_t max_keys() const { return max_keys_; }
   std::size_t max_vals() const { return max_vals_; }
 
+  // The largest key in the map, if it isn't empty
+  K max_key() const {
+    std::lock_guard<Mutex> guard(mut_);
+    return max_key_;
+  }
+
  protected:
-  mutable std::mutex mut_;
+  mutable Mutex mut_;
   map_type map_;
 
  private:
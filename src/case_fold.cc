@@ -0,0 +1,168 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./case_fold.h"
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+inline char FoldAscii(char c) {
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Compare size bytes of data, folding them, with the folded ASCII
+// string str
+inline bool EqualFolded(const char *data, const char *str, std::size_t size) {
+  for (std::size_t i = 0; i < size; i++) {
+    if (FoldAscii(data[i]) != str[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef __SSE2__
+// Fold the upper case ASCII letters in a vector of bytes. The compares
+// are signed, so bytes of 0x80 and up are never in the range.
+inline __m128i FoldBlock(__m128i block) {
+  const __m128i upper = _mm_and_si128(
+      _mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)),
+      _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+  return _mm_or_si128(block, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+}
+
+namespace codesearch {
+std::uint32_t FoldRune(std::uint32_t c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c + ('a' - 'A');
+  } else if (c >= 0xC0 && c <= 0xDE && c != 0xD7) {
+    // Latin-1, except for the multiplication sign
+    return c + 0x20;
+  } else if (c >= 0x100 && c <= 0x17F) {
+    // Latin Extended-A, which is mostly pairs of an upper case letter
+    // and its lower case letter, except for a few letters that don't
+    // have a lower case form of the same length
+    if (c == 0x130 || c == 0x131 || c == 0x138 || c == 0x149 ||
+        c == 0x17F) {
+      return c;
+    } else if (c == 0x178) {
+      return 0xFF;
+    }
+    const bool odd_pairs = ((c >= 0x139 && c <= 0x148) ||
+                            (c >= 0x179 && c <= 0x17E));
+    return (c % 2 == 1) == odd_pairs ? c + 1 : c;
+  } else if (c >= 0x391 && c <= 0x3A9 && c != 0x3A2) {
+    // Greek
+    return c + 0x20;
+  } else if (c >= 0x400 && c <= 0x40F) {
+    // Cyrillic
+    return c + 0x50;
+  } else if (c >= 0x410 && c <= 0x42F) {
+    return c + 0x20;
+  }
+  return c;
+}
+
+std::string FoldCase(const std::string &str) {
+  // Every code point that folds is encoded in one or two bytes, so
+  // only those sequences have to be decoded.
+  std::string folded(str);
+  std::size_t i = 0;
+  while (i < folded.size()) {
+    const std::uint8_t b = folded[i];
+    if (b < 0x80) {
+      folded[i++] = FoldAscii(b);
+      continue;
+    }
+    if ((b & 0xE0) == 0xC0 && i + 1 < folded.size() &&
+        (folded[i + 1] & 0xC0) == 0x80) {
+      const std::uint32_t c = ((b & 0x1F) << 6) | (folded[i + 1] & 0x3F);
+      if (c >= 0x80) {
+        const std::uint32_t f = FoldRune(c);
+        folded[i] = static_cast<char>(0xC0 | (f >> 6));
+        folded[i + 1] = static_cast<char>(0x80 | (f & 0x3F));
+      }
+      i += 2;
+      continue;
+    }
+    i++;
+  }
+  return folded;
+}
+
+std::vector<std::uint32_t> CaseVariants(std::uint32_t c) {
+  const std::uint32_t folded = FoldRune(c);
+  std::vector<std::uint32_t> variants{folded};
+  for (std::uint32_t u = 'A'; u <= 0x42F; u++) {
+    if (u != folded && FoldRune(u) == folded) {
+      variants.push_back(u);
+    }
+  }
+  std::sort(variants.begin(), variants.end());
+  return variants;
+}
+
+CaseInsensitiveMatcher::CaseInsensitiveMatcher(const std::string &str)
+    :folded_(FoldCase(str)), ascii_(true) {
+  for (const auto &c : folded_) {
+    if (static_cast<std::uint8_t>(c) >= 0x80) {
+      ascii_ = false;
+      break;
+    }
+  }
+}
+
+bool CaseInsensitiveMatcher::Match(boost::string_ref line) const {
+  if (folded_.empty()) {
+    return true;
+  } else if (ascii_) {
+    // An ASCII string can only match ASCII bytes, and those are folded
+    // the same way wherever they are.
+    return MatchAscii(line.data(), line.size());
+  }
+  return FoldCase(std::string(line)).find(folded_) != std::string::npos;
+}
+
+bool CaseInsensitiveMatcher::MatchAscii(const char *data,
+                                        std::size_t size) const {
+  const std::size_t n = folded_.size();
+  if (size < n) {
+    return false;
+  }
+  const char *str = folded_.data();
+  std::size_t i = 0;
+#ifdef __SSE2__
+  // Compare the 16 positions starting at i at once, by loading the
+  // bytes that the first and last bytes of the string would be at.
+  const __m128i first = _mm_set1_epi8(str[0]);
+  const __m128i last = _mm_set1_epi8(str[n - 1]);
+  for (; i + n - 1 + 16 <= size; i += 16) {
+    const __m128i starts = FoldBlock(_mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(data + i)));
+    const __m128i ends = FoldBlock(_mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(data + i + n - 1)));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(starts, first),
+                      _mm_cmpeq_epi8(ends, last)));
+    while (mask != 0) {
+      const std::size_t pos = i + __builtin_ctz(mask);
+      if (EqualFolded(data + pos, str, n)) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i + n <= size; i++) {
+    if (EqualFolded(data + i, str, n)) {
+      return true;
+    }
+  }
+  return false;
+}
+}
@@ -0,0 +1,57 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// Case folding for case-insensitive searches. The folding maps the
+// upper case ASCII letters, and the upper case letters of the Latin-1,
+// Latin Extended-A, Greek and Cyrillic blocks, to their lower case
+// forms. Each of these letters has the same UTF-8 length as its lower
+// case form, so a folded line is exactly as long as the line itself,
+// and any offset into one is an offset into the other.
+
+#ifndef SRC_CASE_FOLD_H_
+#define SRC_CASE_FOLD_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+namespace codesearch {
+
+// Fold the case of a code point
+std::uint32_t FoldRune(std::uint32_t c);
+
+// Fold the case of a UTF-8 string. Bytes that aren't part of a valid
+// UTF-8 sequence are left alone.
+std::string FoldCase(const std::string &str);
+
+// The code points that fold to the same code point as c (including c
+// itself), in increasing order
+std::vector<std::uint32_t> CaseVariants(std::uint32_t c);
+
+// Finds a string in lines, ignoring case. If the string is ASCII,
+// lines are checked 16 bytes at a time with SSE2: the bytes of the
+// line are folded in registers, and compared with the first and last
+// bytes of the string, so that the whole string is only compared where
+// both of them match. Otherwise each line is folded, and then
+// searched.
+class CaseInsensitiveMatcher {
+ public:
+  explicit CaseInsensitiveMatcher(const std::string &str);
+
+  // Returns true if the string is in the line, ignoring case
+  bool Match(boost::string_ref line) const;
+
+  // The folded string
+  const std::string& folded() const { return folded_; }
+
+ private:
+  const std::string folded_;
+  bool ascii_;
+
+  bool MatchAscii(const char *data, std::size_t size) const;
+};
+}
+
+#endif  // SRC_CASE_FOLD_H_
@@ -50,6 +50,16 @@ int main(int argc, char **argv) {
        "(positional) source directories")
       ("threads,t", po::value<std::size_t>()->default_value(
           std::thread::hardware_concurrency() + 1))
+      ("positions", "store the offsets of the ngrams within each line, "
+       "so searches can rule out lines without reading them")
+      ("file-postings", "store a posting list of files for each ngram, "
+       "with the lines in each file, rather than a list of lines")
+      ("fold-case", "also index the ngrams of the lines with their case "
+       "folded, so case-insensitive searches are as fast as exact ones")
+      ("compress-lines", "compress the text of the lines in blocks, which "
+       "makes the lines index a few times smaller")
+      ("store-contents", "store the contents of the files with the index, "
+       "so search results are shown without reading the source files")
       ;
 
   // all positional arguments are source dirs
@@ -91,6 +101,19 @@ int main(int argc, char **argv) {
   std::size_t shard_size = vm["shard-size"].as<std::size_t>();
   std::size_t num_threads = vm["threads"].as<std::size_t>();
 
+  if (vm.count("positions") && vm.count("file-postings")) {
+    std::cerr << "--positions stores line postings, not file postings" <<
+        std::endl;
+    return 1;
+  }
+  codesearch::SSTableHeader_ValueFormat value_format =
+      codesearch::SSTableHeader_ValueFormat_HYBRID_POSTINGS;
+  if (vm.count("positions")) {
+    value_format = codesearch::SSTableHeader_ValueFormat_POSITIONAL_POSTINGS;
+  } else if (vm.count("file-postings")) {
+    value_format = codesearch::SSTableHeader_ValueFormat_FILE_POSTINGS;
+  }
+
   if (vm.count("src-dir") != 1) {
     std::cerr << "Must specify exactly one src-dir/vestibule" << std::endl;
     return 1;
@@ -140,7 +163,9 @@ int main(int argc, char **argv) {
   {
     std::size_t filenum = 1;
     codesearch::NGramIndexWriter ngram_writer(
-        db_path_str, ngram_size, shard_size, num_threads);
+        db_path_str, ngram_size, shard_size, num_threads,
+        value_format, vm.count("fold-case") > 0,
+        vm.count("compress-lines") > 0, vm.count("store-contents") > 0);
     for (const FileTuple &tuple : to_index) {
       int pct = 100 * filenum / to_index.size();
       std::cout << "indexing " << filenum++ << "/" << to_index.size() <<
@@ -0,0 +1,184 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// A memory-bounded cache of immutable values, which is shared by the
+// threads of a process (see PostingCache and BlockCache). Values are
+// handed out as shared pointers, so an entry that's evicted stays
+// alive for as long as a reader is still using it.
+//
+// The cache is split into shards, each with its own lock, so that
+// concurrent queries don't all contend on one mutex. Each shard uses
+// the CLOCK algorithm: a hit sets an entry's referenced bit, and to
+// make room the clock hand sweeps over the entries, clearing set bits
+// and evicting the first entry whose bit is already clear.
+
+#ifndef SRC_CLOCK_CACHE_H_
+#define SRC_CLOCK_CACHE_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace codesearch {
+template <typename T>
+class ClockCache {
+ public:
+  explicit ClockCache(std::size_t max_bytes, std::size_t num_shards = 16)
+      :max_bytes_(max_bytes), shard_bytes_(max_bytes / num_shards),
+       max_entry_bytes_(shard_bytes_ / 4), shards_(num_shards), hits_(0),
+       misses_(0), evictions_(0) {
+    assert(num_shards > 0);
+  }
+
+  ClockCache(const ClockCache &other) = delete;
+  ClockCache& operator=(const ClockCache &other) = delete;
+
+  // Look up a value. Returns a null pointer on a miss.
+  std::shared_ptr<const T> Find(std::uint64_t key) {
+    Shard &shard = ShardFor(key);
+    {
+      std::lock_guard<std::mutex> guard(shard.mut);
+      auto it = shard.slots.find(key);
+      if (it != shard.slots.end()) {
+        Entry &entry = shard.entries[it->second];
+        entry.referenced = true;
+        hits_++;
+        return entry.value;
+      }
+    }
+    misses_++;
+    return nullptr;
+  }
+
+  // Returns true if a value that uses this many bytes may be cached.
+  // Values that would take up a large part of a cache shard aren't
+  // cached, so that one huge value can't flush everything else.
+  bool Admits(std::size_t bytes) const { return bytes <= max_entry_bytes_; }
+
+  // Add a value that uses this many bytes to the cache, evicting other
+  // values to make room for it. Values that aren't admitted are
+  // ignored.
+  void Insert(std::uint64_t key, const std::shared_ptr<const T> &value,
+              std::size_t bytes) {
+    if (!Admits(bytes)) {
+      return;
+    }
+    Shard &shard = ShardFor(key);
+    std::lock_guard<std::mutex> guard(shard.mut);
+    if (shard.slots.count(key)) {
+      // another reader made the same value at the same time
+      return;
+    }
+    while (!shard.entries.empty() && shard.bytes + bytes > shard_bytes_) {
+      Evict(&shard);
+    }
+
+    // New entries start out unreferenced, so that a value that's only
+    // ever looked at once is the first to go.
+    shard.slots.insert({key, shard.entries.size()});
+    shard.entries.push_back({key, value, bytes, false});
+    shard.bytes += bytes;
+  }
+
+  // Remove a value from the cache, if it's there; readers that are
+  // still using it keep it alive.
+  void Erase(std::uint64_t key) {
+    Shard &shard = ShardFor(key);
+    std::lock_guard<std::mutex> guard(shard.mut);
+    auto it = shard.slots.find(key);
+    if (it != shard.slots.end()) {
+      Remove(&shard, it->second);
+    }
+  }
+
+  std::size_t max_bytes() const { return max_bytes_; }
+
+  // The number of bytes used by the cached values
+  std::size_t bytes() const {
+    std::size_t total = 0;
+    for (const auto &shard : shards_) {
+      std::lock_guard<std::mutex> guard(shard.mut);
+      total += shard.bytes;
+    }
+    return total;
+  }
+
+  std::uint64_t hits() const { return hits_; }
+  std::uint64_t misses() const { return misses_; }
+  std::uint64_t evictions() const { return evictions_; }
+
+ private:
+  struct Entry {
+    std::uint64_t key;
+    std::shared_ptr<const T> value;
+    std::size_t bytes;
+    bool referenced;
+  };
+
+  struct Shard {
+    Shard() :hand(0), bytes(0) {}
+
+    mutable std::mutex mut;
+    std::vector<Entry> entries;
+    std::unordered_map<std::uint64_t, std::size_t> slots;  // key -> entry
+    std::size_t hand;
+    std::size_t bytes;
+  };
+
+  const std::size_t max_bytes_;
+  const std::size_t shard_bytes_;
+  const std::size_t max_entry_bytes_;
+  std::vector<Shard> shards_;
+
+  std::atomic<std::uint64_t> hits_;
+  std::atomic<std::uint64_t> misses_;
+  std::atomic<std::uint64_t> evictions_;
+
+  Shard& ShardFor(std::uint64_t key) {
+    // std::hash is the identity for integers, so mix the bits of the
+    // key to spread similar keys over the shards.
+    const std::uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+    return shards_[(h >> 32) % shards_.size()];
+  }
+
+  // Evict the entry at the clock hand; the shard's lock must be held.
+  void Evict(Shard *shard) {
+    assert(!shard->entries.empty());
+    while (true) {
+      if (shard->hand >= shard->entries.size()) {
+        shard->hand = 0;
+      }
+      Entry &entry = shard->entries[shard->hand];
+      if (entry.referenced) {
+        entry.referenced = false;
+        shard->hand++;
+        continue;
+      }
+
+      // The last entry fills the hole, so the hand looks at it next
+      Remove(shard, shard->hand);
+      evictions_++;
+      return;
+    }
+  }
+
+  // Remove the entry at an index, filling the hole with the last entry;
+  // the shard's lock must be held.
+  void Remove(Shard *shard, std::size_t index) {
+    Entry &entry = shard->entries[index];
+    shard->bytes -= entry.bytes;
+    shard->slots.erase(entry.key);
+    if (index != shard->entries.size() - 1) {
+      entry = std::move(shard->entries.back());
+      shard->slots[entry.key] = index;
+    }
+    shard->entries.pop_back();
+  }
+};
+}
+
+#endif  // SRC_CLOCK_CACHE_H_
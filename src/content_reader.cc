@@ -0,0 +1,63 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./content_reader.h"
+#include "./mmap.h"
+#include "./util.h"
+
+#include <boost/filesystem.hpp>
+#include <snappy.h>
+
+namespace codesearch {
+std::uint32_t FileContents::Start(std::uint32_t i) const {
+  assert(i <= num_lines_);
+  return ReadUint32(blob_.data() + (i + 1) * sizeof(std::uint32_t));
+}
+
+void FileContents::GetContext(std::size_t line_number, std::uint64_t offset,
+                              std::vector<ContextLine> *lines,
+                              std::size_t context) const {
+  const char *text = blob_.data() + (num_lines_ + 2) * sizeof(std::uint32_t);
+  GetLineContext(text, num_lines_,
+                 [this](std::size_t i) { return Start(i); },
+                 line_number, offset, context, lines);
+}
+
+ContentReader::ContentReader(const std::string &index_directory,
+                             const std::string &name)
+    :blobs_(nullptr), offsets_(nullptr), num_files_(0) {
+  const std::string directory = index_directory + "/" + name;
+  offsets_ = GetMmapForFile(directory + "/offsets").second;
+  num_files_ = boost::filesystem::file_size(directory + "/offsets") /
+      sizeof(std::uint64_t) - 1;
+  const std::uint64_t size = boost::filesystem::file_size(
+      directory + "/blobs");
+  assert(size == ReadUint64(offsets_ + num_files_ * sizeof(std::uint64_t)));
+  if (size > 0) {
+    blobs_ = GetMmapForFile(directory + "/blobs").second;
+  }
+}
+
+bool ContentReader::Exists(const std::string &index_directory,
+                           const std::string &name) {
+  return boost::filesystem::exists(index_directory + "/" + name + "/offsets");
+}
+
+bool ContentReader::Find(std::uint64_t file_id,
+                         FileContents *contents) const {
+  if (file_id >= num_files_) {
+    return false;
+  }
+  const char *offset = offsets_ + file_id * sizeof(std::uint64_t);
+  const std::uint64_t start = ReadUint64(offset);
+  const std::uint64_t end = ReadUint64(offset + sizeof(std::uint64_t));
+  contents->blob_.clear();
+  if (!snappy::Uncompress(blobs_ + start, end - start, &contents->blob_)) {
+    return false;
+  }
+  contents->num_lines_ = ReadUint32(contents->blob_.data());
+  assert(contents->blob_.size() ==
+         (contents->num_lines_ + 2) * sizeof(std::uint32_t) +
+         contents->Start(contents->num_lines_));
+  return true;
+}
+}
@@ -0,0 +1,73 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// Reads the "contents" store of an index, which is written by cindex
+// --store-contents. The store is a directory with two files:
+//
+//   blobs    the blob of each file, compressed with Snappy, one after
+//            the other in the order of the file ids
+//   offsets  the 8-byte BE offset of each file's blob in blobs, and
+//            then one more for the end of the last blob
+//
+// A blob holds the number of lines in the file and the offset that
+// each line starts at (as 4-byte BE integers), the size of the file,
+// and then the contents of the file. So the context of a line is found
+// by decompressing one blob, without going back to the source tree.
+
+#ifndef SRC_CONTENT_READER_H_
+#define SRC_CONTENT_READER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./file_util.h"
+
+namespace codesearch {
+
+// The decompressed contents of a file
+class FileContents {
+ public:
+  FileContents() :num_lines_(0) {}
+
+  // Get the context of the line that starts at offset, as
+  // GetLineContext() does. The lines point into this object.
+  void GetContext(std::size_t line_number, std::uint64_t offset,
+                  std::vector<ContextLine> *lines,
+                  std::size_t context = 1) const;
+
+ private:
+  friend class ContentReader;
+
+  std::string blob_;
+  std::uint32_t num_lines_;
+
+  // The offset in the file that line i starts at (for i up to
+  // num_lines_, which is the size of the file)
+  std::uint32_t Start(std::uint32_t i) const;
+};
+
+class ContentReader {
+ public:
+  explicit ContentReader(const std::string &index_directory,
+                         const std::string &name = "contents");
+
+  ContentReader(const ContentReader &other) = delete;
+  ContentReader& operator=(const ContentReader &other) = delete;
+
+  // Returns true if the index has a content store
+  static bool Exists(const std::string &index_directory,
+                     const std::string &name = "contents");
+
+  // Decompress the contents of a file. Returns false if the file isn't
+  // in the store.
+  bool Find(std::uint64_t file_id, FileContents *contents) const;
+
+ private:
+  const char *blobs_;
+  const char *offsets_;
+  std::uint64_t num_files_;
+};
+}
+
+#endif  // SRC_CONTENT_READER_H_
@@ -0,0 +1,78 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./content_writer.h"
+#include "./util.h"
+
+#include <boost/filesystem.hpp>
+#include <snappy.h>
+
+#include <iterator>
+#include <vector>
+
+namespace {
+void Open(const std::string &directory, const std::string &name,
+          std::ofstream *out) {
+  const std::string path = directory + "/" + name;
+  out->open(path.c_str(), std::ofstream::binary | std::ofstream::out |
+            std::ofstream::trunc);
+  assert(!out->fail());
+}
+}
+
+namespace codesearch {
+ContentWriter::ContentWriter(const std::string &index_directory,
+                             const std::string &name)
+    :next_key_(0), size_(0) {
+  const std::string directory = index_directory + "/" + name;
+  assert(!boost::filesystem::is_directory(directory));
+  boost::filesystem::create_directories(directory);
+  Open(directory, "blobs", &blobs_);
+  Open(directory, "offsets", &offsets_);
+}
+
+ContentWriter::~ContentWriter() {
+  // The offset of the end of the last blob
+  offsets_ << Uint64ToString(size_);
+}
+
+std::string ContentWriter::Compress(const std::string &filename) {
+  std::ifstream ifs(filename.c_str(),
+                    std::ifstream::binary | std::ifstream::in);
+  assert(!ifs.fail());
+  const std::string text((std::istreambuf_iterator<char>(ifs)),
+                         std::istreambuf_iterator<char>());
+  assert(text.size() <= UINT32_MAX);
+
+  // A line starts at the start of the file, and after each newline
+  // that isn't the last byte of the file
+  std::vector<std::uint32_t> starts;
+  if (!text.empty()) {
+    starts.push_back(0);
+  }
+  for (std::size_t i = 0; i + 1 < text.size(); i++) {
+    if (text[i] == '\n') {
+      starts.push_back(i + 1);
+    }
+  }
+
+  std::string blob = Uint32ToString(starts.size());
+  blob.reserve(sizeof(std::uint32_t) * (starts.size() + 2) + text.size());
+  for (const auto &start : starts) {
+    blob += Uint32ToString(start);
+  }
+  blob += Uint32ToString(text.size());
+  blob += text;
+
+  std::string compressed;
+  snappy::Compress(blob.data(), blob.size(), &compressed);
+  return compressed;
+}
+
+std::uint64_t ContentWriter::Add(const std::string &blob) {
+  std::lock_guard<std::mutex> guard(mut_);
+  offsets_ << Uint64ToString(size_);
+  blobs_.write(blob.data(), blob.size());
+  size_ += blob.size();
+  return next_key_++;
+}
+}
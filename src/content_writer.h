@@ -0,0 +1,44 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// Writes the "contents" store, which bundles the contents of each
+// indexed file with the index, so that the context of search results
+// can be shown without the source tree (see content_reader.h for the
+// layout).
+
+#ifndef SRC_CONTENT_WRITER_H_
+#define SRC_CONTENT_WRITER_H_
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+namespace codesearch {
+class ContentWriter {
+ public:
+  ContentWriter(const std::string &index_directory, const std::string &name);
+  ~ContentWriter();
+
+  ContentWriter(const ContentWriter &other) = delete;
+  ContentWriter& operator=(const ContentWriter &other) = delete;
+
+  // Read a file, and build its compressed blob. This can be called
+  // from any thread.
+  static std::string Compress(const std::string &filename);
+
+  // Add the blob of the next file, and return the file's id. Files
+  // have to be added in the order of their ids in the "files" index.
+  std::uint64_t Add(const std::string &blob);
+
+ private:
+  std::ofstream blobs_;
+  std::ofstream offsets_;
+
+  std::uint64_t next_key_;
+  std::uint64_t size_;
+  std::mutex mut_;
+};
+}
+
+#endif  // SRC_CONTENT_WRITER_H_
@@ -36,6 +36,13 @@ class NGramFrequency {
   codesearch::NGram ngram_;
   std::size_t frequency_;
 };
+
+// The cost of looking up one more posting list, in the number of
+// candidate lines that could be checked against a query in the same
+// time, and the extra cost for each id in the list (since much of a
+// list may have to be decoded)
+const double ngram_lookup_cost = 32;
+const double ngram_id_cost = 1.0 / 1024;
 }
 
 namespace codesearch {
@@ -49,7 +56,8 @@ Context::Context(const std::string &index_directory,
                  const std::string &vestibule_path,
                  bool create)
     :index_directory_(index_directory), vestibule_(vestibule_path),
-     sorted_ngrams_(nullptr), sorted_ngrams_size_(0), ngram_size_(ngram_size) {
+     sorted_ngrams_(nullptr), sorted_ngrams_size_(0),
+     contents_initialized_(false), ngram_size_(ngram_size) {
   std::string meta_config_path = index_directory + "/meta_config";
   if (create) {
     MetaIndexConfig meta_config;
@@ -156,6 +164,89 @@ void Context::SortNGrams(std::vector<NGram> *ngrams) {
   }
 }
 
+std::vector<NGram> Context::CoverNGrams(const std::string &query,
+                                        std::uint64_t num_lines) {
+  assert(query.size() >= ngram_size_);
+  InitializeSortedNGrams();
+
+  // The distinct ngrams of the query, and where each of them is
+  struct Candidate {
+    NGram ngram;
+    std::size_t count;
+    std::vector<std::size_t> offsets;
+    bool chosen;
+  };
+  std::vector<Candidate> candidates;
+  std::map<NGram, std::size_t> positions;
+  for (std::size_t i = 0; i <= query.size() - ngram_size_; i++) {
+    const NGram ngram(query.data() + i);
+    auto it = positions.find(ngram);
+    if (it == positions.end()) {
+      it = positions.insert({ngram, candidates.size()}).first;
+      candidates.push_back({ngram, NGramCount(ngram), {}, false});
+    }
+    candidates[it->second].offsets.push_back(i);
+  }
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](const Candidate &a, const Candidate &b) {
+                     return a.count < b.count;
+                   });
+
+  // The ngrams are chosen from the rarest to the most common. Ngrams
+  // that overlap an ngram that has already been chosen share most of
+  // their characters with it, so they rule out few more lines; they
+  // are only considered once there are no other ngrams left. An ngram
+  // is only chosen if the number of lines that it's expected to rule
+  // out (assuming that the ngrams occur independently) is worth the
+  // cost of looking it up, so this stops once there are few enough
+  // candidates that checking them is cheaper than looking up more.
+  std::vector<bool> covered(query.size(), false);
+  double expected = num_lines;
+  std::vector<NGram> ngrams;
+  for (int pass = 0; pass < 2; pass++) {
+    for (auto &candidate : candidates) {
+      if (candidate.chosen) {
+        continue;
+      }
+      std::size_t offset = query.size();
+      for (const auto &o : candidate.offsets) {
+        if (std::find(covered.begin() + o, covered.begin() + o + ngram_size_,
+                      true) == covered.begin() + o + ngram_size_) {
+          offset = o;
+          break;
+        }
+      }
+      if (pass == 0 && offset == query.size()) {
+        continue;
+      }
+      const double remaining = num_lines == 0 ? 0 : expected *
+          std::min(1.0, static_cast<double>(candidate.count) / num_lines);
+      if (!ngrams.empty() && expected - remaining <
+          ngram_lookup_cost + ngram_id_cost * candidate.count) {
+        continue;
+      }
+      candidate.chosen = true;
+      ngrams.push_back(candidate.ngram);
+      expected = remaining;
+      if (offset != query.size()) {
+        std::fill(covered.begin() + offset,
+                  covered.begin() + offset + ngram_size_, true);
+      }
+    }
+  }
+  SortNGrams(&ngrams);
+  return ngrams;
+}
+
+std::size_t Context::NGramCount(const NGram &ngram) {
+  InitializeSortedNGrams();
+  auto it = ngram_counts_.lower_bound(ngram);
+  if (it == ngram_counts_.end() || it->first != ngram) {
+    return 0;
+  }
+  return it->second;
+}
+
 void Context::InitializeSortedNGrams() {
   std::lock_guard<std::mutex> guard(mut_);
   if (sorted_ngrams_ != nullptr) {
@@ -194,22 +285,71 @@ void Context::InitializeSortedNGrams() {
 }
 
 void Context::InitializeFileOffsets() {
+  std::lock_guard<std::mutex> guard(mut_);
+  if (!file_offsets_.empty()) {
+    // the file offsets have already been initialized
+    return;
+  }
+
   Timer initialization_timer;
   std::ifstream ifs(index_directory_ + "/file_start_lines",
                     std::ifstream::binary | std::ifstream::in);
-  assert(file_offsets_.empty());
   FileStartLines lines;
   lines.ParseFromIstream(&ifs);
 
   FrozenMapBuilder<std::uint32_t, std::uint32_t> offsets;
+  FrozenMapBuilder<std::uint32_t, std::uint32_t> first_lines;
   for (const auto &start_line : lines.start_lines()) {
     offsets.insert(start_line.first_line(), start_line.file_id());
+    first_lines.insert(start_line.file_id(), start_line.first_line());
   }
   file_offsets_ = offsets;
+  file_first_lines_ = first_lines;
   LOG(INFO) << "initialized file offsets map in " <<
       initialization_timer.elapsed_ms() << " ms\n";
 }
 
+void Context::InitializePostingCache(std::size_t max_bytes) {
+  std::lock_guard<std::mutex> guard(mut_);
+  if (posting_cache_ != nullptr) {
+    return;
+  }
+  posting_cache_.reset(new PostingCache(max_bytes));
+  LOG(INFO) << "initialized posting list cache of " << max_bytes <<
+      " bytes\n";
+}
+
+void Context::InitializeBlockCache(std::size_t max_bytes) {
+  std::lock_guard<std::mutex> guard(mut_);
+  if (block_cache_ != nullptr) {
+    return;
+  }
+  block_cache_.reset(new BlockCache(max_bytes));
+  LOG(INFO) << "initialized lines block cache of " << max_bytes <<
+      " bytes\n";
+}
+
+void Context::InitializeFileCache(std::size_t max_bytes) {
+  std::lock_guard<std::mutex> guard(mut_);
+  if (file_cache_ != nullptr) {
+    return;
+  }
+  file_cache_.reset(new FileCache(max_bytes));
+  LOG(INFO) << "initialized mapped file cache of " << max_bytes <<
+      " bytes\n";
+}
+
+const ContentReader* Context::contents() {
+  std::lock_guard<std::mutex> guard(mut_);
+  if (!contents_initialized_) {
+    if (ContentReader::Exists(index_directory_)) {
+      contents_.reset(new ContentReader(index_directory_));
+    }
+    contents_initialized_ = true;
+  }
+  return contents_.get();
+}
+
 Context::~Context() {
   UnmapFiles();
   google::protobuf::ShutdownProtobufLibrary();
@@ -21,8 +21,12 @@
 #include <string>
 #include <vector>
 
+#include "./block_cache.h"
+#include "./content_reader.h"
+#include "./file_cache.h"
 #include "./frozen_map.h"
 #include "./ngram.h"
+#include "./posting_cache.h"
 
 namespace codesearch {
 class Context {
@@ -42,17 +46,64 @@ class Context {
 
   void SortNGrams(std::vector<NGram> *ngrams);
 
+  // The number of lines that have an ngram, from the counts that were
+  // written when the index was built
+  std::size_t NGramCount(const NGram &ngram);
+
+  // Choose the ngrams of a query to look up, in the order that
+  // SortNGrams() would put them in. A line that has the query has all
+  // of its ngrams, but a few rare ngrams that don't overlap rule out
+  // nearly as many lines as all of them do, so for long queries only
+  // the ngrams that are worth looking up are chosen, based on their
+  // counts and the number of lines in the index.
+  std::vector<NGram> CoverNGrams(const std::string &query,
+                                 std::uint64_t num_lines);
+
   // Initialize the list of small ngrams -- normally this method will
   // be called on demand (that is, the first time a query is done for
   // a small ngram).
   void InitializeSortedNGrams();
 
+  // Initialize the maps between files and the ids of their first
+  // lines. This is safe to call more than once.
   void InitializeFileOffsets();
 
   const FrozenMap<std::uint32_t, std::uint32_t> &file_offsets() const {
     return file_offsets_;
   }
 
+  const FrozenMap<std::uint32_t, std::uint32_t> &file_first_lines() const {
+    return file_first_lines_;
+  }
+
+  // Create a cache of decoded posting lists that uses up to max_bytes
+  // bytes, which will be shared by all of the readers of this index.
+  // This is safe to call more than once; only the first call has any
+  // effect.
+  void InitializePostingCache(std::size_t max_bytes);
+
+  // The posting list cache, or nullptr if there isn't one
+  PostingCache* posting_cache() const { return posting_cache_.get(); }
+
+  // Create a cache of the decompressed blocks of the "lines" index, as
+  // InitializePostingCache does for posting lists
+  void InitializeBlockCache(std::size_t max_bytes);
+
+  // The block cache, or nullptr if there isn't one
+  BlockCache* block_cache() const { return block_cache_.get(); }
+
+  // Create a cache of the mapped source files whose lines are shown
+  // in search results, as InitializePostingCache does for posting lists
+  void InitializeFileCache(std::size_t max_bytes);
+
+  // The mapped file cache, or nullptr if there isn't one
+  FileCache* file_cache() const { return file_cache_.get(); }
+
+  // The store of the contents of the indexed files, or nullptr if the
+  // index doesn't have one. The store is opened the first time that
+  // this is called.
+  const ContentReader* contents();
+
  private:
   Context(const std::string &index_directory,
           std::size_t ngram_size,
@@ -70,6 +121,16 @@ class Context {
   // a "map" of file_id -> id of the first line in the file
   FrozenMap<std::uint32_t, std::uint32_t> file_offsets_;
 
+  // the inverse of file_offsets_, file_id -> id of the first line
+  FrozenMap<std::uint32_t, std::uint32_t> file_first_lines_;
+
+  std::unique_ptr<PostingCache> posting_cache_;
+  std::unique_ptr<BlockCache> block_cache_;
+  std::unique_ptr<FileCache> file_cache_;
+
+  bool contents_initialized_;
+  std::unique_ptr<ContentReader> contents_;
+
   const std::size_t ngram_size_;
   std::mutex mut_;
 };
@@ -20,6 +20,18 @@ int main(int argc, char **argv) {
           codesearch::default_index_directory))
       ("threads,t", po::value<std::size_t>()->default_value(0),
        "number of threads to use per index reader")
+      ("posting-cache-mb", po::value<std::size_t>()->default_value(256),
+       "memory for caching decoded posting lists across queries (0 to "
+       "disable)")
+      ("block-cache-mb", po::value<std::size_t>()->default_value(256),
+       "memory for caching decompressed blocks of the lines index across "
+       "queries (0 to disable)")
+      ("file-cache-mb", po::value<std::size_t>()->default_value(256),
+       "size of the source files to keep mapped across queries, for the "
+       "context of results (0 to disable)")
+      ("recent-queries", po::value<std::size_t>()->default_value(8),
+       "number of recent queries per connection whose candidates are "
+       "kept, for queries that extend them (0 to disable)")
       ;
 
   po::variables_map vm;
@@ -43,9 +55,22 @@ int main(int argc, char **argv) {
       codesearch::Context::Acquire(db_path_str));
   ctx->InitializeSortedNGrams();
   ctx->InitializeFileOffsets();
+  std::size_t posting_cache_mb = vm["posting-cache-mb"].as<std::size_t>();
+  if (posting_cache_mb > 0) {
+    ctx->InitializePostingCache(posting_cache_mb << 20);
+  }
+  std::size_t block_cache_mb = vm["block-cache-mb"].as<std::size_t>();
+  if (block_cache_mb > 0) {
+    ctx->InitializeBlockCache(block_cache_mb << 20);
+  }
+  std::size_t file_cache_mb = vm["file-cache-mb"].as<std::size_t>();
+  if (file_cache_mb > 0) {
+    ctx->InitializeFileCache(file_cache_mb << 20);
+  }
 
   codesearch::IndexReaderServer server(
-      db_path_str, &io_service, endpoint, threads);
+      db_path_str, &io_service, endpoint, threads,
+      vm["recent-queries"].as<std::size_t>());
   server.Start();
   io_service.run();
 
@@ -59,6 +59,8 @@ int main(int argc, char **argv) {
       ("offset", po::value<std::size_t>()->default_value(0))
       ("threads,t", po::value<std::size_t>()->default_value(0))
       ("no-print", "suppress printing")
+      ("regexp,e", "the query is a regular expression")
+      ("case-insensitive,i", "ignore case")
       ("db-path", po::value<std::string>()->default_value(
           codesearch::default_index_directory))
       ("color", po::value<std::string>()->default_value("auto"),
@@ -109,10 +111,31 @@ int main(int argc, char **argv) {
       //vm["offset"].as<std::size_t>()
                                     );
   std::string query = vm["query"].as<std::string>();
-  reader.Find(query, &results);
+  const bool regexp = vm.count("regexp") > 0;
+  const bool case_insensitive = vm.count("case-insensitive") > 0;
+  if (regexp && case_insensitive) {
+    std::cerr << "case-insensitive regexps aren't supported\n";
+    return 1;
+  } else if (regexp) {
+    std::string error;
+    if (!reader.FindRegexp(query, &results, &error)) {
+      std::cerr << "invalid regexp: " << error << "\n";
+      return 1;
+    }
+  } else {
+    std::string error;
+    if (!reader.FindQuery(query, case_insensitive, &results, &error)) {
+      std::cerr << "invalid query: " << error << "\n";
+      return 1;
+    }
+  }
+  // Only the matches of plain queries are highlighted
+  const codesearch::QueryPlan plan(query);
+  const bool highlight = !regexp && !case_insensitive && plan.literal();
+  const std::string &highlighted = highlight ? plan.root().text : query;
   if (!vm.count("no-print")) {
     bool need_newline = false;
-    for (const auto &sr_ctx : results.contextual_results()) {
+    for (const auto &sr_ctx : results.contextual_results(&reader)) {
       if (need_newline) {
         std::cout << "\n";
       } else {
@@ -134,8 +157,9 @@ int main(int argc, char **argv) {
         if (colorize) {
           std::cout << line.line_num();
           Colorize(std::cout, Color::CYAN, ":");
-          if (line.is_matched_line()) {
-            ColorizeMatch(std::cout, Color::RED, query, line.line_text());
+          if (line.is_matched_line() && highlight) {
+            ColorizeMatch(std::cout, Color::RED, highlighted,
+                          line.line_text());
           } else {
             std::cout << line.line_text();
           }
@@ -149,7 +173,7 @@ int main(int argc, char **argv) {
       }
     }
   } else {
-    std::cout << results.contextual_results().size() <<
+    std::cout << results.contextual_results(&reader).size() <<
         " search results\n";
   }
   return 0;
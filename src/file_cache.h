@@ -0,0 +1,54 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// A bounded cache of mapped source files (see MappedFile), keyed by
+// file id, so that showing the lines around the matches in a file
+// doesn't map it again for every line and every request. One cache is
+// shared by all of the requests to an index (see
+// Context::file_cache()). The size of a file and of its line offsets
+// is counted against the cache, which bounds the address space that
+// mappings take up. A file that's been changed since it was mapped is
+// mapped again. See clock_cache.h for how entries are evicted.
+
+#ifndef SRC_FILE_CACHE_H_
+#define SRC_FILE_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "./clock_cache.h"
+#include "./file_util.h"
+
+namespace codesearch {
+class FileCache : public ClockCache<MappedFile> {
+ public:
+  explicit FileCache(std::size_t max_bytes, std::size_t num_shards = 16)
+      :ClockCache<MappedFile>(max_bytes, num_shards) {}
+
+  // Get a mapped file, mapping it if it isn't in the cache or if the
+  // cached mapping is stale. The cache may be null, in which case the
+  // file is always mapped.
+  static std::shared_ptr<const MappedFile> Get(FileCache *cache,
+                                               std::uint64_t file_id,
+                                               const std::string &name) {
+    std::shared_ptr<const MappedFile> file;
+    if (cache != nullptr) {
+      file = cache->Find(file_id);
+      if (file != nullptr && file->Changed(name)) {
+        cache->Erase(file_id);
+        file = nullptr;
+      }
+    }
+    if (file == nullptr) {
+      file = std::make_shared<MappedFile>(name);
+      if (cache != nullptr) {
+        cache->Insert(file_id, file, file->ByteSize());
+      }
+    }
+    return file;
+  }
+};
+}
+
+#endif  // SRC_FILE_CACHE_H_
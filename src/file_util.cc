@@ -6,8 +6,12 @@
 #include "./mmap.h"
 #include "./util.h"
 
+#include <sys/stat.h>
+
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <unordered_map>
@@ -97,63 +101,6 @@ std::string GetExtension(const std::string &filename) {
   }
   return filename.substr(dotpos, std::string::npos);
 }
-
-inline const char* c_memchr(const char *s, int c, size_t n) {
-  return reinterpret_cast<const char*>(
-      memchr(reinterpret_cast<const void*>(s), c, n));
-}
-
-inline const char* c_memrchr(const char *s, int c, size_t n) {
-  return reinterpret_cast<const char*>(
-      memrchr(reinterpret_cast<const void*>(s), c, n));
-}
-
-std::string GetLineBackwards(const char *buf, std::size_t *position) {
-  assert(*position && buf[*position - 1] == '\n');
-#if 0
-  if (*position == 1) {
-    *position = 0;
-    return std::string{};
-  }
-#endif
-  std::string line;
-  std::size_t newpos;
-  const char *newbuf = c_memrchr(buf, '\n', *position - 1);
-  if (newbuf == nullptr) {
-    newpos = 0;
-    line = std::string(buf, *position - 1);
-  } else {
-    newpos = newbuf - buf + 1;
-    line = std::string(newbuf + 1, *position - newpos - 1);
-  }
-  assert(line.find_first_of('\n') == std::string::npos);
-  *position = newpos;
-  return line;
-}
-
-std::string GetLineForwards(const char *buf, std::size_t buf_size,
-                            std::size_t *position) {
-  assert(*position < buf_size);
-  assert(!*position || buf[*position - 1] == '\n');
-
-  std::string line;
-  std::size_t newpos;
-  const char *newbuf = c_memchr(
-      buf + *position, '\n', buf_size - *position - 1);
-  if (newbuf == nullptr) {
-    newpos = buf_size;
-    line = std::string(buf + *position, buf_size - *position);
-    if (line.size() && line[line.size() - 1] == '\n') {
-      line = line.substr(0, line.size() - 1);
-    }
-  } else {
-    newpos = newbuf - buf + 1;
-    line = std::string(buf + *position, newpos - *position - 1);
-  }
-  assert(line.find_first_of('\n') == std::string::npos);
-  *position = newpos;
-  return line;
-}
 }
 
 namespace codesearch {
@@ -209,52 +156,64 @@ bool ShouldIndex(const std::string &filename, std::size_t read_size) {
   return valid_data > 0 && valid_data >= 20 * invalid_data;
 }
 
-std::map<std::size_t, std::string> GetFileContext(const std::string &name,
-                                                  std::size_t line_number,
-                                                  std::uint64_t offset,
-                                                  std::size_t context) {
-  MmapCtx memory_map(name);
-  const char *mmap_addr = memory_map.mapping();
-  const std::size_t map_size = memory_map.size();
-  std::map<std::size_t, std::string> return_map;
-
-  // We are going to maintain an invariant that at the start of this
-  // function, and after each loop iteration (both forwards and
-  // backwards), the position of the cursor will be at a position
-  // indicated by a caret mark below:
-  //
-  //  foo\nbar\nbaz\n\nquux
-  //  ^    ^    ^     ^^
-  //
-  // That is, at each point, the previous character is a newline (or
-  // the start of the file).
-
-  std::uint64_t pos = offset;
-
-  // Check the invariant
-  assert(pos == 0 || mmap_addr[pos - 1] == '\n');
-
-  if (pos != 0) {
-    for (std::size_t i = 0; i < context; i++) {
-      std::string line = GetLineBackwards(mmap_addr, &pos);
-      return_map.insert(return_map.begin(), {line_number - i - 1, line});
-      if (pos == 0) {
-        break;
-      }
+MappedFile::MappedFile(const std::string &name)
+    :data_(nullptr), size_(0) {
+  if (!Stat(name, &stat_)) {
+    throw FileError(name + ": " + strerror(errno));
+  }
+  try {
+    // An empty file can't be mapped, and doesn't need to be
+    if (stat_.size > 0) {
+      map_.reset(new MmapCtx(name));
+      data_ = map_->mapping();
+      size_ = map_->size();
     }
+  } catch (std::exception &e) {
+    throw FileError(e.what());
   }
 
-  pos = offset;
-  if (pos < map_size - 1) {
-    for (std::size_t i = 0; i < context + 1; i++) {
-      std::string line = GetLineForwards(mmap_addr, map_size, &pos);
-      return_map.insert(return_map.begin(), {line_number + i, line});
-      if (pos >= map_size) {
-        break;
-      }
+  // A line starts at the start of the file, and after each newline
+  // that isn't the last byte of the file
+  if (size_ > 0) {
+    starts_.push_back(0);
+  }
+  const char *end = data_ + size_;
+  for (const char *p = data_; p != nullptr && p + 1 < end; ) {
+    p = static_cast<const char*>(memchr(p, '\n', end - p - 1));
+    if (p != nullptr) {
+      starts_.push_back(++p - data_);
     }
   }
+  starts_.push_back(size_);
+  starts_.shrink_to_fit();
+}
 
-  return return_map;
+void MappedFile::GetContext(std::size_t line_number, std::uint64_t offset,
+                            std::vector<ContextLine> *lines,
+                            std::size_t context) const {
+  GetLineContext(data_, starts_.size() - 1,
+                 [this](std::size_t i) { return starts_[i]; },
+                 line_number, offset, context, lines);
+}
+
+std::size_t MappedFile::ByteSize() const {
+  return sizeof(*this) + size_ + starts_.capacity() * sizeof(std::uint64_t);
+}
+
+bool MappedFile::Changed(const std::string &name) const {
+  FileStat now;
+  return !Stat(name, &now) || !(now == stat_) || now.size != size_;
+}
+
+bool MappedFile::Stat(const std::string &name, FileStat *stat) {
+  struct stat st;
+  if (::stat(name.c_str(), &st) != 0) {
+    return false;
+  }
+  stat->inode = st.st_ino;
+  stat->size = st.st_size;
+  stat->mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) *
+      1000000000 + st.st_mtim.tv_nsec;
+  return true;
 }
 }
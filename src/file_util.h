@@ -4,10 +4,19 @@
 #ifndef SRC_FILE_UTIL_H_
 #define SRC_FILE_UTIL_H_
 
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "./mmap.h"
 
 namespace codesearch {
 
@@ -25,15 +34,56 @@ std::string FileLanguage(const std::string &filename);
 // data.
 bool ShouldIndex(const std::string &filename, std::size_t read_size = 10000);
 
-// Get the context for a file, where context is the number of
-// surrounding lines.
+// A line of the context of a match: its line number, and its text,
+// which points into the file that it's from
+typedef std::pair<std::size_t, boost::string_ref> ContextLine;
+
+// Get the context of a line, where context is the number of lines
+// around it, given the text of a file, the number of lines in it, and
+// a function that returns the offset that line i starts at (or for
+// i == num_lines, the size of the text). The line starts at offset,
+// and is numbered line_number; the lines around it are numbered from
+// it. The lines are appended to lines in order, without their
+// newlines. If no line starts at offset, nothing is appended.
+template <typename StartFn>
+void GetLineContext(const char *text, std::size_t num_lines,
+                    const StartFn &start, std::size_t line_number,
+                    std::uint64_t offset, std::size_t context,
+                    std::vector<ContextLine> *lines) {
+  std::size_t lo = 0, hi = num_lines;
+  while (lo < hi) {
+    const std::size_t mid = lo + (hi - lo) / 2;
+    if (start(mid) < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == num_lines || start(lo) != offset) {
+    return;
+  }
+  const std::size_t first = lo > context ? lo - context : 0;
+  const std::size_t last = std::min(lo + context + 1, num_lines);
+  for (std::size_t i = first; i < last; i++) {
+    const std::uint64_t line_start = start(i);
+    std::size_t size = start(i + 1) - line_start;
+    if (size > 0 && text[line_start + size - 1] == '\n') {
+      size--;
+    }
+    lines->emplace_back(line_number + i - lo,
+                        boost::string_ref(text + line_start, size));
+  }
+}
+
+// A source file that's mapped into memory, along with the offset that
+// each of its lines starts at, so that getting the context of each of
+// its matches is a binary search and a few array lookups. Mapped files
+// are shared between the requests that show their lines through a
+// FileCache (see Context::file_cache()), which checks with Changed()
+// that a file is still the one that was mapped before using it.
 //
-// The way this works is you pass in a file name, the line number for
-// the context, and the offset into the file where that line
-// starts. You also say how many lines of context you want. Then a map
-// of line number -> line is returned. For instance, suppose we have
-// the following file (line-delimited by \n, and file contents
-// delimited by """):
+// For instance, suppose we have the following file (line-delimited by
+// \n, and file contents delimited by """):
 //
 // """
 // foo
@@ -42,18 +92,61 @@ bool ShouldIndex(const std::string &filename, std::size_t read_size = 10000);
 // quux
 // """
 //
-// If we call GetFileContext(f, 0, 0, 1) then the return value of this
-// function will be {0: "foo", 1: "bar"}. If we call GetFileContext(f,
-// 1, 4, 1) then the return value will be {0: "foo", 1: "bar", 2:
-// "baz"}. If we call GetFileContext(f, 3, 12, 1) then the return
-// value will be {2: "baz", 3: "quux"}.
+// If we call GetContext(0, 0, &lines, 1) then lines will be {0: "foo",
+// 1: "bar"}. If we call GetContext(1, 4, &lines, 1) then lines will be
+// {0: "foo", 1: "bar", 2: "baz"}. If we call GetContext(3, 12, &lines,
+// 1) then lines will be {2: "baz", 3: "quux"}.
 //
 // Note that the line number you pass in is not checked, so it's up to
 // you if you think the lines should be 0 offset, 1 offset, etc.
-std::map<std::size_t, std::string> GetFileContext(const std::string &file_path,
-                                                  std::size_t line_number,
-                                                  std::uint64_t offset,
-                                                  std::size_t context = 1);
+class MappedFile {
+ public:
+  // Map a file. Throws FileError if the file can't be read.
+  explicit MappedFile(const std::string &name);
+
+  MappedFile(const MappedFile &other) = delete;
+  MappedFile& operator=(const MappedFile &other) = delete;
+
+  // Get the context of the line that starts at offset, as
+  // GetLineContext() does
+  void GetContext(std::size_t line_number, std::uint64_t offset,
+                  std::vector<ContextLine> *lines,
+                  std::size_t context = 1) const;
+
+  // The number of bytes that the file and its line offsets use, for
+  // the FileCache
+  std::size_t ByteSize() const;
+
+  // Returns true if the file has been changed, replaced or removed
+  // since it was mapped, in which case the mapping can't be used: the
+  // offsets might be of other lines, and reading past the end of a
+  // file that's been truncated raises SIGBUS.
+  bool Changed(const std::string &name) const;
+
+ private:
+  std::unique_ptr<MmapCtx> map_;
+  const char *data_;
+  std::size_t size_;
+
+  // What stat() said about the file before it was mapped
+  struct FileStat {
+    std::uint64_t inode;
+    std::uint64_t size;
+    std::int64_t mtime_ns;
+
+    bool operator==(const FileStat &other) const {
+      return inode == other.inode && size == other.size &&
+          mtime_ns == other.mtime_ns;
+    }
+  };
+  FileStat stat_;
+
+  // Stat a file; returns false if it can't be
+  static bool Stat(const std::string &name, FileStat *stat);
+
+  // The offset that each line starts at, and then the size of the file
+  std::vector<std::uint64_t> starts_;
+};
 }
 
 #endif
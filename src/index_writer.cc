@@ -26,6 +26,8 @@ IndexWriter::IndexWriter(const std::string &index_directory,
      auto_rotate_(auto_rotate),
      shard_num_(0),
      key_type_(IndexConfig_KeyType_NUMERIC),
+     value_format_(SSTableHeader_ValueFormat_PROTOBUF),
+     eytzinger_(false),
      state_(IndexConfig_DatabaseState_EMPTY),
   sstable_(nullptr) {
   boost::filesystem::path p(GetPathName(""));
@@ -37,7 +39,7 @@ IndexWriter::IndexWriter(const std::string &index_directory,
 
 IndexWriter::~IndexWriter() {
   if (sstable_ != nullptr) {
-    sstable_->Merge();
+    sstable_->Merge(eytzinger_);
     delete sstable_;
   }
   WriteStatus(IndexConfig_DatabaseState_COMPLETE);
@@ -55,18 +57,31 @@ void IndexWriter::EnsureSSTable() {
   if (sstable_ == nullptr) {
     std::string name = GetPathName(
         "shard_" + boost::lexical_cast<std::string>(shard_num_));
-    sstable_ = new SSTableWriter(name, key_size_);
+    sstable_ = new SSTableWriter(name, key_size_, value_format_);
   }
 }
 
 void IndexWriter::Rotate() {
   assert(sstable_ != nullptr);
-  sstable_->Merge();
+  sstable_->Merge(eytzinger_);
   delete sstable_;
   sstable_ = nullptr;
   shard_num_++;
 }
 
+void IndexWriter::WriteSidecar(const std::string &ext,
+                               const std::string &contents) {
+  assert(sstable_ != nullptr);
+  std::string name = GetPathName(
+      "shard_" + boost::lexical_cast<std::string>(shard_num_) + "." + ext);
+  std::ofstream out(name.c_str(),
+                    std::ofstream::binary |
+                    std::ofstream::out |
+                    std::ofstream::trunc);
+  out.write(contents.data(), contents.size());
+  assert(!out.fail());
+}
+
 void IndexWriter::WriteStatus(IndexConfig_DatabaseState new_state) {
   state_ = new_state;
 
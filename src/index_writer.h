@@ -33,6 +33,20 @@ class IndexWriter {
     key_type_ = key_type;
   }
 
+  // Set the value format that will be recorded in the header of each
+  // SSTable. The caller is responsible for actually encoding values
+  // in this format.
+  void SetValueFormat(SSTableHeader_ValueFormat value_format) {
+    value_format_ = value_format;
+  }
+
+  // Set whether the SSTables (starting with the current one) get a
+  // copy of their keys in Eytzinger order, for readers that search
+  // the whole table for a key
+  void SetEytzinger(bool eytzinger) {
+    eytzinger_ = eytzinger;
+  }
+
   template <typename U, typename V>
   void Add(const U &key, const V &value) {
     EnsureSSTable();
@@ -48,6 +62,11 @@ class IndexWriter {
 
   std::size_t shard_size() const { return shard_size_; }
 
+  // Write a file that goes along with the current SSTable, named like
+  // it but with the extension ext, e.g. "shard_0.stats". This has to
+  // be called before the table is rotated.
+  void WriteSidecar(const std::string &ext, const std::string &contents);
+
   ~IndexWriter();
 
  private:
@@ -58,6 +77,8 @@ class IndexWriter {
   const bool auto_rotate_;
   std::size_t shard_num_;
   IndexConfig_KeyType key_type_;
+  SSTableHeader_ValueFormat value_format_;
+  bool eytzinger_;
   IndexConfig_DatabaseState state_;
   SSTableWriter *sstable_;
 
@@ -45,8 +45,11 @@ int main(int argc, char **argv) {
   assert(hdr.max_value().size() == hdr.key_size());
   assert(memcmp(
       hdr.min_value().data(), hdr.max_value().data(), hdr.key_size()) <= 0);
-  assert(hdr.index_offset() + hdr.index_size() + hdr.data_size() == file_size);
-  assert(hdr.data_offset() + hdr.data_size() == file_size);
+  const std::size_t eytzinger_size = hdr.has_eytzinger_offset() ?
+      hdr.index_size() : 0;
+  assert(hdr.index_offset() + hdr.index_size() + hdr.data_size() +
+         eytzinger_size == file_size);
+  assert(hdr.data_offset() + hdr.data_size() + eytzinger_size == file_size);
 
   std::cout << "key_size     = " << hdr.key_size() << "\n";
   std::cout << "num_keys     = " << hdr.num_keys() << "\n";
@@ -54,6 +57,11 @@ int main(int argc, char **argv) {
   std::cout << "data_size    = " << hdr.data_size() << "\n";
   std::cout << "index_offset = " << hdr.index_offset() << "\n";
   std::cout << "data_offset  = " << hdr.data_offset() << "\n";
+  if (hdr.has_eytzinger_offset()) {
+    std::cout << "eytzinger_offset = " << hdr.eytzinger_offset() << "\n";
+  }
+  std::cout << "value_format = " <<
+      codesearch::SSTableHeader_ValueFormat_Name(hdr.value_format()) << "\n";
 
   // Now try to print the min/max value. To do this correctly we need
   // to read the config file in the containing directory, to get a
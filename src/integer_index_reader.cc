@@ -6,12 +6,15 @@
 #include "./util.h"
 
 #include <boost/lexical_cast.hpp>
+
+#include <algorithm>
 #include <fstream>
 
 namespace codesearch {
 IntegerIndexReader::IntegerIndexReader(const std::string &index_directory,
                                        const std::string &name,
-                                       std::size_t savepoints) {
+                                       std::size_t savepoints)
+    :keys_per_shard_(0) {
   std::string config_name = index_directory + "/" + name + "/config";
   std::ifstream config(config_name.c_str(),
                        std::ifstream::binary | std::ifstream::in);
@@ -23,22 +26,72 @@ IntegerIndexReader::IntegerIndexReader(const std::string &index_directory,
                               boost::lexical_cast<std::string>(i) + ".sst");
     shards_.emplace_back(shard_name);
   }
+
+  keys_per_shard_ = shards_[0].num_keys();
+  for (std::size_t i = 0; i < shards_.size(); i++) {
+    const SSTableReader<std::uint64_t> &shard = shards_[i];
+    starts_.push_back(ToUint64(shard.hdr().min_value()));
+    assert(ToUint64(shard.hdr().max_value()) - starts_.back() + 1 ==
+           shard.num_keys());
+    if (starts_.back() != i * keys_per_shard_ ||
+        (i + 1 < shards_.size() && shard.num_keys() != keys_per_shard_)) {
+      keys_per_shard_ = 0;
+    }
+  }
+}
+
+std::size_t IntegerIndexReader::ShardFor(std::uint64_t needle) const {
+  if (keys_per_shard_ != 0) {
+    return std::min<std::uint64_t>(needle / keys_per_shard_,
+                                   shards_.size() - 1);
+  }
+  auto it = std::upper_bound(starts_.begin(), starts_.end(), needle);
+  assert(it != starts_.begin());
+  return it - starts_.begin() - 1;
 }
 
 bool IntegerIndexReader::Find(std::uint64_t needle,
                               google::protobuf::MessageLite *msg) const {
-  for (const auto &shard : shards_) {
-    std::uint64_t min_key = ToUint64(shard.hdr().min_value());
-    std::uint64_t max_key = ToUint64(shard.hdr().max_value());
-    if (needle >= min_key && needle <= max_key) {
-      std::uint64_t delta = needle - min_key;
-      SSTableReader<std::uint64_t>::iterator pos = shard.begin() + delta;
-      assert(*pos == needle);
-      pos.parse_protobuf(msg);
-      return true;
+  const std::size_t i = ShardFor(needle);
+  const std::uint64_t delta = needle - starts_[i];
+  assert(needle >= starts_[i] && delta < shards_[i].num_keys());
+  SSTableReader<std::uint64_t>::iterator pos = shards_[i].begin() + delta;
+  assert(*pos == needle);
+  pos.parse_protobuf(msg);
+  return true;
+}
+
+bool IntegerIndexReader::FindMany(
+    const std::vector<std::uint64_t> &needles,
+    google::protobuf::MessageLite *msg,
+    const std::function<bool(std::size_t)> &fn) const {
+  if (needles.empty()) {
+    return true;
+  }
+  std::size_t shard = ShardFor(needles[0]);
+  for (std::size_t i = 0; i < needles.size(); i++) {
+    assert(i == 0 || needles[i - 1] <= needles[i]);
+    while (shard + 1 < shards_.size() && needles[i] >= starts_[shard + 1]) {
+      shard++;
+    }
+    const std::uint64_t delta = needles[i] - starts_[shard];
+    assert(needles[i] >= starts_[shard] && delta < shards_[shard].num_keys());
+    SSTableReader<std::uint64_t>::iterator pos =
+        shards_[shard].begin() + delta;
+    assert(*pos == needles[i]);
+    pos.parse_protobuf(msg);
+    if (!fn(i)) {
+      return false;
     }
   }
-  assert(false);  // should never happen
-  return false;
+  return true;
+}
+
+std::uint64_t IntegerIndexReader::size() const {
+  std::uint64_t num_keys = 0;
+  for (const auto &shard : shards_) {
+    num_keys += shard.num_keys();
+  }
+  return num_keys;
 }
 }
@@ -4,6 +4,7 @@
 #ifndef SRC_INTEGER_INDEX_READER_H_
 #define SRC_INTEGER_INDEX_READER_H_
 
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
@@ -20,17 +21,37 @@ class IntegerIndexReader {
                      const std::string &name,
                      std::size_t savepoints = 2048);
 
-  // Find a needle. This searches the shards sequentially, and returns
-  // early (i.e. on the first shard with the needle). In general, the
-  // fact that this is sequential and not parallel shouldn't present
-  // any problems, because the index bounds are stored in the SSTable
-  // header (which is read into memory when the reader is created),
-  // and therefore searching an SSTable without the needle is very,
-  // very cheap.
+  // Find a needle. The keys of each shard are consecutive, so the
+  // shard with the needle is found from the first keys of the shards
+  // (by division, if every shard but the last has the same number of
+  // keys, and otherwise by binary search), and the needle is then at
+  // a known position in the shard.
   bool Find(std::uint64_t needle, google::protobuf::MessageLite *msg) const;
 
+  // Find a sorted list of needles, walking the shards in order along
+  // with them. For each needle, its value is parsed into msg, and then
+  // fn is called with the index of the needle in needles. If fn returns
+  // false, then no more needles are looked up, and false is returned.
+  bool FindMany(const std::vector<std::uint64_t> &needles,
+                google::protobuf::MessageLite *msg,
+                const std::function<bool(std::size_t)> &fn) const;
+
+  // The number of keys in the index. The keys are assigned in order
+  // from 0 (see IntegerIndexWriter), so these are 0 up to size() - 1.
+  std::uint64_t size() const;
+
  private:
   std::vector<SSTableReader<std::uint64_t> > shards_;
+
+  // The first key of each shard
+  std::vector<std::uint64_t> starts_;
+
+  // The number of keys in each shard, if every shard but the last has
+  // the same number of keys, or 0
+  std::uint64_t keys_per_shard_;
+
+  // The index of the shard that would hold a key
+  std::size_t ShardFor(std::uint64_t needle) const;
 };
 }
 
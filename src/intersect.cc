@@ -0,0 +1,147 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./intersect.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef ENABLE_SLOW_ASSERTS
+#include <iterator>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+#endif
+
+namespace {
+std::size_t IntersectSortedScalar(const std::uint64_t *a, std::size_t a_size,
+                                  const std::uint64_t *b, std::size_t b_size,
+                                  std::uint64_t *out) {
+  std::size_t i = 0, j = 0, k = 0;
+  while (i < a_size && j < b_size) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (b[j] < a[i]) {
+      j++;
+    } else {
+      out[k++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  return k;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+// For each 4-bit mask of matching 64-bit lanes, the 32-bit lane
+// permutation that moves the matching lanes to the front of the
+// register.
+const std::int32_t compress_table[16][8] __attribute__((aligned(32))) = {
+  {0, 1, 0, 1, 0, 1, 0, 1},
+  {0, 1, 0, 1, 0, 1, 0, 1},
+  {2, 3, 0, 1, 0, 1, 0, 1},
+  {0, 1, 2, 3, 0, 1, 0, 1},
+  {4, 5, 0, 1, 0, 1, 0, 1},
+  {0, 1, 4, 5, 0, 1, 0, 1},
+  {2, 3, 4, 5, 0, 1, 0, 1},
+  {0, 1, 2, 3, 4, 5, 0, 1},
+  {6, 7, 0, 1, 0, 1, 0, 1},
+  {0, 1, 6, 7, 0, 1, 0, 1},
+  {2, 3, 6, 7, 0, 1, 0, 1},
+  {0, 1, 2, 3, 6, 7, 0, 1},
+  {4, 5, 6, 7, 0, 1, 0, 1},
+  {0, 1, 4, 5, 6, 7, 0, 1},
+  {2, 3, 4, 5, 6, 7, 0, 1},
+  {0, 1, 2, 3, 4, 5, 6, 7},
+};
+
+__attribute__((target("avx2,popcnt")))
+std::size_t IntersectSortedAvx2(const std::uint64_t *a, std::size_t a_size,
+                                const std::uint64_t *b, std::size_t b_size,
+                                std::uint64_t *out) {
+  const std::size_t out_size = std::min(a_size, b_size);
+  std::size_t i = 0, j = 0, k = 0;
+  while (i + 4 <= a_size && j + 4 <= b_size) {
+    const __m256i va = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(a + i));
+    const __m256i vb = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(b + j));
+
+    // compare va against every rotation of vb
+    __m256i eq = _mm256_or_si256(
+        _mm256_cmpeq_epi64(va, vb),
+        _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+    eq = _mm256_or_si256(
+        eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4e)));
+    eq = _mm256_or_si256(
+        eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+    const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+
+    // Move the matches to the front of the register and store the
+    // whole register; near the end of the output, go through a
+    // temporary so that the store can't run past it.
+    const __m256i perm = _mm256_load_si256(
+        reinterpret_cast<const __m256i *>(compress_table[mask]));
+    const __m256i matches = _mm256_permutevar8x32_epi32(va, perm);
+    const int num_matches = __builtin_popcount(mask);
+    if (k + 4 <= out_size) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), matches);
+    } else {
+      std::uint64_t tmp[4];
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(tmp), matches);
+      memcpy(out + k, tmp, num_matches * sizeof(std::uint64_t));
+    }
+    k += num_matches;
+
+    const std::uint64_t a_max = a[i + 3];
+    const std::uint64_t b_max = b[j + 3];
+    i += (a_max <= b_max) ? 4 : 0;
+    j += (b_max <= a_max) ? 4 : 0;
+  }
+  return k + IntersectSortedScalar(a + i, a_size - i, b + j, b_size - j,
+                                   out + k);
+}
+#endif
+
+std::vector<codesearch::IntersectImpl> SupportedImpls() {
+  std::vector<codesearch::IntersectImpl> impls{
+    {&IntersectSortedScalar, "scalar"}};
+#ifdef HAVE_AVX2_KERNEL
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    impls.push_back({&IntersectSortedAvx2, "avx2"});
+  }
+#endif
+  return impls;
+}
+
+// the fastest implementation is the last one
+const codesearch::IntersectImpl impl = SupportedImpls().back();
+}
+
+namespace codesearch {
+std::size_t IntersectSorted(const std::uint64_t *a, std::size_t a_size,
+                            const std::uint64_t *b, std::size_t b_size,
+                            std::uint64_t *out) {
+  std::size_t n = impl.func(a, a_size, b, b_size, out);
+#ifdef ENABLE_SLOW_ASSERTS
+  // check the vectorized results against the standard library
+  std::vector<std::uint64_t> expected;
+  std::set_intersection(a, a + a_size, b, b + b_size,
+                        std::back_inserter(expected));
+  assert(n == expected.size());
+  assert(std::equal(expected.begin(), expected.end(), out));
+#endif
+  return n;
+}
+
+const char* IntersectSortedImpl() {
+  return impl.name;
+}
+
+std::vector<IntersectImpl> IntersectSortedImpls() {
+  return SupportedImpls();
+}
+}  // namespace codesearch
@@ -0,0 +1,46 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// Intersection of sorted id lists. On CPUs that support AVX2 this
+// compares four ids from each list at a time (by comparing one
+// register against all four rotations of the other), and otherwise
+// falls back to a scalar merge. The implementation is chosen at
+// startup, using CPUID.
+
+#ifndef SRC_INTERSECT_H_
+#define SRC_INTERSECT_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace codesearch {
+
+// Intersect two sorted lists of unique ids, writing the ids that are
+// in both lists to out, and returning the number of ids written. The
+// output must have room for min(a_size, b_size) ids, and may alias
+// neither input.
+std::size_t IntersectSorted(const std::uint64_t *a, std::size_t a_size,
+                            const std::uint64_t *b, std::size_t b_size,
+                            std::uint64_t *out);
+
+// Returns the name of the implementation used by IntersectSorted,
+// e.g. "avx2" or "scalar".
+const char* IntersectSortedImpl();
+
+typedef std::size_t (*IntersectFunc)(const std::uint64_t *, std::size_t,
+                                     const std::uint64_t *, std::size_t,
+                                     std::uint64_t *);
+
+struct IntersectImpl {
+  IntersectFunc func;
+  const char *name;
+};
+
+// Returns every implementation that this CPU can run, starting with
+// the scalar one, so that they can be checked against each other (see
+// intersect_test.cc).
+std::vector<IntersectImpl> IntersectSortedImpls();
+}
+
+#endif  // SRC_INTERSECT_H_
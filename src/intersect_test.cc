@@ -0,0 +1,180 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// Checks every implementation of IntersectSorted that this CPU can run
+// against std::set_intersection, using random lists. Exits with a
+// non-zero status if any of them disagree.
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "./intersect.h"
+
+namespace po = boost::program_options;
+
+namespace {
+// Written after the end of the output, to catch stores that run past it
+const std::uint64_t guard_value = 0xdeadbeefdeadbeefULL;
+const std::size_t num_guards = 4;
+
+// A sorted list of size unique ids, chosen from [base, base + range)
+std::vector<std::uint64_t> RandomList(std::mt19937_64 *rng,
+                                      std::size_t size,
+                                      std::uint64_t base,
+                                      std::uint64_t range) {
+  std::vector<std::uint64_t> ids;
+  if (range <= size * 2) {
+    // dense: keep each id in the range with the right probability
+    std::uniform_int_distribution<std::uint64_t> keep(0, range - 1);
+    for (std::uint64_t id = 0; id < range; id++) {
+      if (keep(*rng) < size) {
+        ids.push_back(base + id);
+      }
+    }
+    return ids;
+  }
+  std::uniform_int_distribution<std::uint64_t> dist(0, range - 1);
+  while (ids.size() < size) {
+    ids.push_back(base + dist(*rng));
+    if (ids.size() == size) {
+      std::sort(ids.begin(), ids.end());
+      ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+  }
+  return ids;
+}
+
+// Make a random pair of lists to intersect. The cases cover lists of
+// very different lengths (so that one of them runs out while the
+// other has many blocks left), lists where one is a subset of the
+// other, and ids near the top of the range.
+void RandomCase(std::mt19937_64 *rng,
+                std::vector<std::uint64_t> *a,
+                std::vector<std::uint64_t> *b) {
+  std::uniform_int_distribution<int> kind(0, 5);
+  std::uniform_int_distribution<std::size_t> small(0, 40);
+  std::uniform_int_distribution<std::size_t> large(0, 3000);
+  std::uniform_int_distribution<std::uint64_t> spread(1, 8);
+
+  const std::size_t a_size = kind(*rng) == 0 ? large(*rng) : small(*rng);
+  const std::size_t b_size = kind(*rng) == 0 ? large(*rng) : small(*rng);
+  const std::uint64_t range = (std::max(a_size, b_size) + 1) * spread(*rng);
+  std::uint64_t base = 0;
+  if (kind(*rng) == 0) {
+    base = std::numeric_limits<std::uint64_t>::max() - range;
+  }
+
+  *a = RandomList(rng, a_size, base, range);
+  switch (kind(*rng)) {
+    case 0: {
+      // b is a subset of a
+      std::bernoulli_distribution keep(0.5);
+      b->clear();
+      for (std::uint64_t id : *a) {
+        if (keep(*rng)) {
+          b->push_back(id);
+        }
+      }
+      break;
+    }
+    case 1:
+      *b = *a;
+      break;
+    case 2: {
+      // nothing in common
+      const std::vector<std::uint64_t> ids =
+          RandomList(rng, b_size, base, range);
+      b->clear();
+      std::set_difference(ids.begin(), ids.end(), a->begin(), a->end(),
+                          std::back_inserter(*b));
+      break;
+    }
+    default:
+      *b = RandomList(rng, b_size, base, range);
+      break;
+  }
+}
+
+// Returns true if the implementation gets the intersection right,
+// without writing past the end of the output
+bool Check(const codesearch::IntersectImpl &impl,
+           const std::vector<std::uint64_t> &a,
+           const std::vector<std::uint64_t> &b) {
+  std::vector<std::uint64_t> expected;
+  std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                        std::back_inserter(expected));
+
+  const std::size_t out_size = std::min(a.size(), b.size());
+  std::vector<std::uint64_t> out(out_size + num_guards, guard_value);
+  const std::size_t n = impl.func(a.data(), a.size(), b.data(), b.size(),
+                                  out.data());
+  if (n != expected.size() ||
+      !std::equal(expected.begin(), expected.end(), out.begin())) {
+    std::cerr << impl.name << ": wrong intersection of lists of "
+              << a.size() << " and " << b.size() << " ids (got " << n
+              << " ids, expected " << expected.size() << ")\n";
+    return false;
+  }
+  for (std::size_t i = out_size; i < out.size(); i++) {
+    if (out[i] != guard_value) {
+      std::cerr << impl.name << ": wrote past the end of the output for "
+                << "lists of " << a.size() << " and " << b.size()
+                << " ids\n";
+      return false;
+    }
+  }
+  return true;
+}
+}
+
+int main(int argc, char **argv) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help,h", "produce help message")
+      ("iterations,n", po::value<std::size_t>()->default_value(20000),
+       "the number of random cases to check")
+      ("seed,s", po::value<std::uint64_t>()->default_value(0),
+       "the random seed")
+      ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    return 0;
+  }
+
+  const std::vector<codesearch::IntersectImpl> impls =
+      codesearch::IntersectSortedImpls();
+  const std::size_t iterations = vm["iterations"].as<std::size_t>();
+  std::mt19937_64 rng(vm["seed"].as<std::uint64_t>());
+  std::vector<std::uint64_t> a, b;
+  std::size_t failures = 0;
+  for (std::size_t i = 0; i < iterations; i++) {
+    RandomCase(&rng, &a, &b);
+    for (const auto &impl : impls) {
+      // the arguments are swapped, too, since the kernels aren't
+      // symmetric in how they advance through the lists
+      if (!Check(impl, a, b) || !Check(impl, b, a)) {
+        failures++;
+      }
+    }
+  }
+
+  std::cout << "checked";
+  for (const auto &impl : impls) {
+    std::cout << " " << impl.name;
+  }
+  std::cout << " (IntersectSorted uses "
+            << codesearch::IntersectSortedImpl() << ")\n"
+            << iterations << " cases, " << failures << " failures\n";
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,163 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./lines_reader.h"
+#include "./mmap.h"
+#include "./util.h"
+
+#include <boost/filesystem.hpp>
+#include <snappy.h>
+
+namespace {
+// Map a column, and check that it has width bytes for each of num
+// entries. An empty column has no mapping.
+const char* MapColumn(const std::string &directory, const std::string &name,
+                      std::size_t width, std::uint64_t num) {
+  const std::string path = directory + "/" + name;
+  const std::uint64_t size = boost::filesystem::file_size(path);
+  assert(width == 0 || size == width * num);
+  if (size == 0) {
+    return nullptr;
+  }
+  return codesearch::GetMmapForFile(path).second;
+}
+}
+
+namespace codesearch {
+void Line::SetLegacy() {
+  file_id_ = legacy_.file_id();
+  file_offset_ = legacy_.file_offset();
+  file_line_ = legacy_.file_line();
+  line_ = legacy_.line();
+}
+
+LinesReader::LinesReader(const std::string &index_directory,
+                         const std::string &name, std::size_t table)
+    :file_ids_(nullptr), file_offsets_(nullptr), file_lines_(nullptr),
+     text_offsets_(nullptr), text_(nullptr), size_(0), text_blocks_(nullptr),
+     num_blocks_(0), table_(table) {
+  const std::string directory = index_directory + "/" + name;
+  if (!boost::filesystem::exists(directory + "/text")) {
+    legacy_.reset(new IntegerIndexReader(index_directory, name));
+    size_ = legacy_->size();
+    return;
+  }
+
+  size_ = boost::filesystem::file_size(directory + "/file_ids") /
+      sizeof(std::uint32_t);
+  file_ids_ = MapColumn(directory, "file_ids", sizeof(std::uint32_t), size_);
+  file_offsets_ = MapColumn(directory, "file_offsets", sizeof(std::uint64_t),
+                            size_);
+  file_lines_ = MapColumn(directory, "file_lines", sizeof(std::uint32_t),
+                          size_);
+  text_offsets_ = MapColumn(directory, "text_offsets", sizeof(std::uint64_t),
+                            size_ + 1);
+  text_ = MapColumn(directory, "text", 0, 0);
+  if (!boost::filesystem::exists(directory + "/text_blocks")) {
+    assert(boost::filesystem::file_size(directory + "/text") ==
+           ReadUint64(text_offsets_ + size_ * sizeof(std::uint64_t)));
+    return;
+  }
+
+  const std::size_t entry_size = 2 * sizeof(std::uint64_t);
+  num_blocks_ = boost::filesystem::file_size(directory + "/text_blocks") /
+      entry_size - 1;
+  text_blocks_ = MapColumn(directory, "text_blocks", entry_size,
+                           num_blocks_ + 1);
+  const char *end = text_blocks_ + num_blocks_ * entry_size;
+  assert(ReadUint64(end) ==
+         ReadUint64(text_offsets_ + size_ * sizeof(std::uint64_t)));
+  assert(boost::filesystem::file_size(directory + "/text") ==
+         ReadUint64(end + sizeof(std::uint64_t)));
+}
+
+bool LinesReader::Find(std::uint64_t line_id, Line *line,
+                       BlockCache *cache) const {
+  if (legacy_ != nullptr) {
+    if (!legacy_->Find(line_id, &line->legacy_)) {
+      return false;
+    }
+    line->SetLegacy();
+    return true;
+  } else if (line_id >= size_) {
+    return false;
+  }
+  line->file_id_ = ReadUint32(file_ids_ + line_id * sizeof(std::uint32_t));
+  line->file_offset_ = ReadUint64(
+      file_offsets_ + line_id * sizeof(std::uint64_t));
+  line->file_line_ = ReadUint32(file_lines_ + line_id * sizeof(std::uint32_t));
+  const char *offsets = text_offsets_ + line_id * sizeof(std::uint64_t);
+  const std::uint64_t start = ReadUint64(offsets);
+  const std::uint64_t end = ReadUint64(offsets + sizeof(std::uint64_t));
+  if (text_blocks_ == nullptr) {
+    line->line_ = boost::string_ref(text_ + start, end - start);
+  } else {
+    FindText(start, end, line, cache);
+  }
+  return true;
+}
+
+bool LinesReader::FindMany(const std::vector<std::uint64_t> &line_ids,
+                           Line *line,
+                           const std::function<bool(std::size_t)> &fn,
+                           BlockCache *cache) const {
+  if (legacy_ != nullptr) {
+    return legacy_->FindMany(line_ids, &line->legacy_, [&](std::size_t i) {
+        line->SetLegacy();
+        return fn(i);
+      });
+  }
+  for (std::size_t i = 0; i < line_ids.size(); i++) {
+    Find(line_ids[i], line, cache);
+    if (!fn(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LinesReader::FindText(std::uint64_t start, std::uint64_t end,
+                           Line *line, BlockCache *cache) const {
+  if (start == end) {
+    // The line is empty, and might be at the very end of a block
+    line->line_ = boost::string_ref();
+    return;
+  } else if (line->block_reader_ != this || start < line->block_start_ ||
+             end > line->block_end_) {
+    // Find the last block that starts at or before the line
+    const std::size_t entry_size = 2 * sizeof(std::uint64_t);
+    std::uint64_t lo = 0, hi = num_blocks_;
+    while (hi - lo > 1) {
+      const std::uint64_t mid = lo + (hi - lo) / 2;
+      if (ReadUint64(text_blocks_ + mid * entry_size) <= start) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    const char *entry = text_blocks_ + lo * entry_size;
+    line->block_start_ = ReadUint64(entry);
+    line->block_end_ = ReadUint64(entry + entry_size);
+    line->block_reader_ = this;
+    line->block_.reset();
+    if (cache != nullptr) {
+      line->block_ = cache->Find(table_, lo);
+    }
+    if (line->block_ == nullptr) {
+      const std::uint64_t offset = ReadUint64(entry + sizeof(std::uint64_t));
+      const std::uint64_t next = ReadUint64(
+          entry + entry_size + sizeof(std::uint64_t));
+      std::shared_ptr<std::string> block(new std::string);
+      const bool ok = snappy::Uncompress(text_ + offset, next - offset,
+                                         block.get());
+      assert(ok && block->size() == line->block_end_ - line->block_start_);
+      line->block_ = block;
+      if (cache != nullptr) {
+        cache->Insert(table_, lo, line->block_);
+      }
+    }
+    assert(start >= line->block_start_ && end <= line->block_end_);
+  }
+  line->line_ = boost::string_ref(
+      line->block_->data() + (start - line->block_start_), end - start);
+}
+}
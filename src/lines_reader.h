@@ -0,0 +1,138 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// Reads the "lines" index. The index is a directory of files, each of
+// which is a column with an entry for every line, in the order of the
+// line ids:
+//
+//   file_ids      4-byte BE id of the line's file
+//   file_offsets  8-byte BE offset of the line in its file
+//   file_lines    4-byte BE line number of the line in its file
+//   text_offsets  8-byte BE offset of the line in text, and one more
+//                 entry for the end of the last line
+//   text          the text of every line, one after the other
+//
+// The files are mapped, so looking a line up doesn't parse or copy
+// anything: it reads a few integers, and the text of the Line points
+// into the mapping of text.
+//
+// In an index written with compression, text is a series of blocks
+// compressed with Snappy, each of which holds whole lines, and there's
+// one more file:
+//
+//   text_blocks   for each block, the 8-byte BE offset of its first
+//                 line (as in text_offsets) and the 8-byte BE offset
+//                 of the block in text, and then one more pair for the
+//                 end of the last block
+//
+// A line is then looked up by decompressing its block, unless the
+// Line already holds it or it's in the BlockCache, and its text points
+// into the decompressed block.
+//
+// Indexes written before this format have an SSTable of PositionValue
+// messages instead, which are still read.
+
+#ifndef SRC_LINES_READER_H_
+#define SRC_LINES_READER_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "./block_cache.h"
+#include "./index.pb.h"
+#include "./integer_index_reader.h"
+
+namespace codesearch {
+
+class LinesReader;
+
+// A line of the index. The text is only valid until the Line is looked
+// up again.
+class Line {
+ public:
+  Line() :file_id_(0), file_offset_(0), file_line_(0), block_start_(0),
+          block_end_(0), block_reader_(nullptr) {}
+
+  std::uint64_t file_id() const { return file_id_; }
+  std::uint64_t file_offset() const { return file_offset_; }
+  std::uint64_t file_line() const { return file_line_; }
+  boost::string_ref line() const { return line_; }
+
+ private:
+  friend class LinesReader;
+
+  std::uint64_t file_id_;
+  std::uint64_t file_offset_;
+  std::uint64_t file_line_;
+  boost::string_ref line_;
+
+  // For compressed indexes, the block that the text is in, which text
+  // offsets it holds, and the reader that it's from
+  std::shared_ptr<const std::string> block_;
+  std::uint64_t block_start_;
+  std::uint64_t block_end_;
+  const LinesReader *block_reader_;
+
+  // The message that the line was parsed into, for old indexes
+  PositionValue legacy_;
+
+  void SetLegacy();
+};
+
+class LinesReader {
+ public:
+  // The table is the table's number in the BlockCache, which must be
+  // the same for every reader of the table (see
+  // BlockCache::lines_table).
+  LinesReader(const std::string &index_directory, const std::string &name,
+              std::size_t table);
+
+  LinesReader(const LinesReader &other) = delete;
+  LinesReader& operator=(const LinesReader &other) = delete;
+
+  // Find a line by its id. If the index is compressed and cache isn't
+  // null, the blocks that are decompressed are shared through it.
+  bool Find(std::uint64_t line_id, Line *line,
+            BlockCache *cache = nullptr) const;
+
+  // Find a sorted list of lines, as IntegerIndexReader::FindMany does:
+  // fn is called with the index in line_ids of each line after it's
+  // looked up, and if it returns false, no more lines are looked up,
+  // and false is returned.
+  bool FindMany(const std::vector<std::uint64_t> &line_ids, Line *line,
+                const std::function<bool(std::size_t)> &fn,
+                BlockCache *cache = nullptr) const;
+
+  // The number of lines in the index
+  std::uint64_t size() const { return size_; }
+
+ private:
+  const char *file_ids_;
+  const char *file_offsets_;
+  const char *file_lines_;
+  const char *text_offsets_;
+  const char *text_;
+  std::uint64_t size_;
+
+  // For compressed indexes, the blocks, and the number of the table in
+  // the BlockCache
+  const char *text_blocks_;
+  std::uint64_t num_blocks_;
+  const std::size_t table_;
+
+  // The SSTables of an old index, or null
+  std::unique_ptr<IntegerIndexReader> legacy_;
+
+  // Point a line at the text between two offsets, decompressing the
+  // block that it's in if the line doesn't already have it
+  void FindText(std::uint64_t start, std::uint64_t end, Line *line,
+                BlockCache *cache) const;
+};
+}
+
+#endif  // SRC_LINES_READER_H_
@@ -0,0 +1,82 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./lines_writer.h"
+#include "./util.h"
+
+#include <boost/filesystem.hpp>
+#include <snappy.h>
+
+namespace {
+void Open(const std::string &directory, const std::string &name,
+          std::ofstream *out) {
+  const std::string path = directory + "/" + name;
+  out->open(path.c_str(), std::ofstream::binary | std::ofstream::out |
+            std::ofstream::trunc);
+  assert(!out->fail());
+}
+}
+
+namespace codesearch {
+LinesWriter::LinesWriter(const std::string &index_directory,
+                         const std::string &name,
+                         bool compress)
+    :compress_(compress), next_key_(0), text_size_(0), block_start_(0),
+     compressed_size_(0) {
+  const std::string directory = index_directory + "/" + name;
+  assert(!boost::filesystem::is_directory(directory));
+  boost::filesystem::create_directories(directory);
+  Open(directory, "file_ids", &file_ids_);
+  Open(directory, "file_offsets", &file_offsets_);
+  Open(directory, "file_lines", &file_lines_);
+  Open(directory, "text_offsets", &text_offsets_);
+  Open(directory, "text", &text_);
+  if (compress_) {
+    Open(directory, "text_blocks", &text_blocks_);
+  }
+}
+
+LinesWriter::~LinesWriter() {
+  // The offset of the end of the last line, and of the last block
+  text_offsets_ << Uint64ToString(text_size_);
+  if (compress_) {
+    if (!block_.empty()) {
+      FlushBlock();
+    }
+    text_blocks_ << Uint64ToString(text_size_) <<
+        Uint64ToString(compressed_size_);
+  }
+}
+
+std::uint64_t LinesWriter::Add(std::uint64_t file_id,
+                               std::uint64_t file_offset,
+                               std::uint64_t file_line,
+                               const std::string &line) {
+  std::lock_guard<std::mutex> guard(mut_);
+  assert(file_id <= UINT32_MAX && file_line <= UINT32_MAX);
+  file_ids_ << Uint32ToString(file_id);
+  file_offsets_ << Uint64ToString(file_offset);
+  file_lines_ << Uint32ToString(file_line);
+  text_offsets_ << Uint64ToString(text_size_);
+  if (!compress_) {
+    text_.write(line.data(), line.size());
+  } else {
+    if (!block_.empty() && block_.size() + line.size() > lines_block_size) {
+      FlushBlock();
+    }
+    block_.append(line);
+  }
+  text_size_ += line.size();
+  return next_key_++;
+}
+
+void LinesWriter::FlushBlock() {
+  std::string compressed;
+  snappy::Compress(block_.data(), block_.size(), &compressed);
+  text_blocks_ << Uint64ToString(block_start_) <<
+      Uint64ToString(compressed_size_);
+  text_.write(compressed.data(), compressed.size());
+  compressed_size_ += compressed.size();
+  block_start_ = text_size_;
+  block_.clear();
+}
+}
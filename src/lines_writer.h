@@ -0,0 +1,64 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// Writes the "lines" index, which is stored as columns rather than as
+// an SSTable of PositionValue messages (see lines_reader.h for the
+// layout). Lines are numbered in the order that they're added, from 0.
+
+#ifndef SRC_LINES_WRITER_H_
+#define SRC_LINES_WRITER_H_
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+namespace codesearch {
+
+// The size of the text of the lines in a compressed block, before it's
+// compressed. A block only holds whole lines, so a line longer than
+// this gets a block to itself.
+const std::size_t lines_block_size = 64 << 10;
+
+class LinesWriter {
+ public:
+  // If compress is set, the text of the lines is compressed with
+  // Snappy, in blocks of about lines_block_size bytes.
+  LinesWriter(const std::string &index_directory, const std::string &name,
+              bool compress = false);
+  ~LinesWriter();
+
+  LinesWriter(const LinesWriter &other) = delete;
+  LinesWriter& operator=(const LinesWriter &other) = delete;
+
+  // Add a line, and return its id
+  std::uint64_t Add(std::uint64_t file_id, std::uint64_t file_offset,
+                    std::uint64_t file_line, const std::string &line);
+
+ private:
+  const bool compress_;
+  std::ofstream file_ids_;
+  std::ofstream file_offsets_;
+  std::ofstream file_lines_;
+  std::ofstream text_offsets_;
+  std::ofstream text_;
+  std::ofstream text_blocks_;
+
+  std::uint64_t next_key_;
+  std::uint64_t text_size_;
+
+  // For compressed text, the text of the lines that haven't been
+  // written yet, where it starts, and the size of the blocks that have
+  // been written
+  std::string block_;
+  std::uint64_t block_start_;
+  std::uint64_t compressed_size_;
+
+  std::mutex mut_;
+
+  // Compress the block, and write it out
+  void FlushBlock();
+};
+}
+
+#endif  // SRC_LINES_WRITER_H_
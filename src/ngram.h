@@ -33,6 +33,10 @@ class NGram {
 
   const static std::size_t ngram_size = 3;
 
+  // The number of values of the first two bytes of an ngram, see
+  // prefix()
+  const static std::size_t num_prefixes = 1 << 16;
+
   NGram() = delete;
 
   explicit NGram(const char *ngram) {
@@ -142,6 +146,10 @@ class NGram {
   inline std::uint32_t raw_num() const { return data_.num; }
   inline std::uint32_t num() const { return be32toh(data_.num); }
 
+  // The first two bytes of the ngram, as a number; ngrams that are
+  // sorted are sorted by their prefixes too
+  inline std::uint32_t prefix() const { return num() >> 16; }
+
  private:
   union {
     char buf[sizeof(std::uint32_t)];
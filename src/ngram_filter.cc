@@ -0,0 +1,95 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./ngram_filter.h"
+
+#include <cassert>
+
+namespace {
+// The number of the ngram among all of the 2^24 ngrams
+inline std::uint32_t NGramIndex(const codesearch::NGram &ngram) {
+  return ngram.num() >> 8;
+}
+
+// Mix the bits of an ngram, so that ngrams that share most of their
+// bytes set unrelated bits
+inline std::uint64_t HashNGram(const codesearch::NGram &ngram) {
+  std::uint64_t h = NGramIndex(ngram) * 0x9E3779B97F4A7C15ULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 32;
+  return h;
+}
+
+// The block of the filter that an ngram's bits are in
+inline std::size_t BlockFor(std::uint64_t hash, std::size_t num_blocks) {
+  return static_cast<std::size_t>(
+      ((hash >> 32) * static_cast<std::uint64_t>(num_blocks)) >> 32);
+}
+
+// The number of a bit within a block. The probes are spaced out by
+// double hashing, with the low bits of the hash (the block uses the
+// high ones).
+inline std::size_t ProbeBit(std::uint64_t hash, std::size_t probe) {
+  const std::size_t bits = 8 * codesearch::ngram_filter_block_size;
+  const std::size_t start = hash % bits;
+  const std::size_t step = ((hash / bits) % bits) | 1;
+  return (start + probe * step) % bits;
+}
+}
+
+namespace codesearch {
+NGramFilter::NGramFilter(const char *data, std::size_t size)
+    :data_(data), size_(size) {
+  assert(size_ == ngram_bitmap_size || size_ % ngram_filter_block_size == 0);
+  assert(size_ > 0);
+}
+
+std::string NGramFilter::Build(const std::vector<NGram> &ngrams) {
+  std::size_t num_blocks = (ngrams.size() * ngram_filter_bits +
+                            8 * ngram_filter_block_size - 1) /
+      (8 * ngram_filter_block_size);
+  if (num_blocks == 0) {
+    num_blocks = 1;
+  }
+  if (num_blocks * ngram_filter_block_size >= ngram_bitmap_size) {
+    std::string bitmap(ngram_bitmap_size, '\0');
+    for (const auto &ngram : ngrams) {
+      const std::uint32_t i = NGramIndex(ngram);
+      bitmap[i / 8] |= 1 << (i % 8);
+    }
+    return bitmap;
+  }
+
+  std::string filter(num_blocks * ngram_filter_block_size, '\0');
+  for (const auto &ngram : ngrams) {
+    const std::uint64_t hash = HashNGram(ngram);
+    char *block = &filter[BlockFor(hash, num_blocks) *
+                          ngram_filter_block_size];
+    for (std::size_t probe = 0; probe < ngram_filter_probes; probe++) {
+      const std::size_t bit = ProbeBit(hash, probe);
+      block[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+  return filter;
+}
+
+bool NGramFilter::MayContain(const NGram &ngram) const {
+  if (data_ == nullptr) {
+    return true;
+  } else if (size_ == ngram_bitmap_size) {
+    const std::uint32_t i = NGramIndex(ngram);
+    return data_[i / 8] & (1 << (i % 8));
+  }
+
+  const std::uint64_t hash = HashNGram(ngram);
+  const char *block = data_ + BlockFor(
+      hash, size_ / ngram_filter_block_size) * ngram_filter_block_size;
+  for (std::size_t probe = 0; probe < ngram_filter_probes; probe++) {
+    const std::size_t bit = ProbeBit(hash, probe);
+    if (!(block[bit / 8] & (1 << (bit % 8)))) {
+      return false;
+    }
+  }
+  return true;
+}
+}
@@ -0,0 +1,62 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// A filter of the ngrams that are in a shard of an ngram index, which
+// is written next to the shard (as shard_N.filter) so that a search
+// can tell that a shard doesn't have one of its ngrams without
+// searching the shard.
+//
+// The filter is a blocked Bloom filter: an array of 64-byte blocks,
+// where each ngram sets ngram_filter_probes bits in one block, so that
+// checking an ngram only touches one cache line. There are about
+// ngram_filter_bits bits per ngram, which gives roughly 1% false
+// positives. A shard with so many ngrams that this would take up more
+// than 2 MB instead gets a plain bitmap of all 2^24 ngrams, which
+// doesn't have any false positives.
+
+#ifndef SRC_NGRAM_FILTER_H_
+#define SRC_NGRAM_FILTER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./ngram.h"
+
+namespace codesearch {
+
+// The size of a block of the filter, in bytes
+const std::size_t ngram_filter_block_size = 64;
+
+// The number of bits of the filter per ngram
+const std::size_t ngram_filter_bits = 10;
+
+// The number of bits that each ngram sets in its block
+const std::size_t ngram_filter_probes = 7;
+
+// The size of the bitmap of every ngram, in bytes
+const std::size_t ngram_bitmap_size = (1 << (8 * NGram::ngram_size)) / 8;
+
+class NGramFilter {
+ public:
+  // An empty filter, which may contain any ngram
+  NGramFilter() :data_(nullptr), size_(0) {}
+
+  // A filter that was written by Build(). The data isn't copied.
+  NGramFilter(const char *data, std::size_t size);
+
+  // Build the filter for a set of ngrams
+  static std::string Build(const std::vector<NGram> &ngrams);
+
+  // Returns false if the ngram definitely isn't in the filter's set
+  bool MayContain(const NGram &ngram) const;
+
+  bool empty() const { return data_ == nullptr; }
+
+ private:
+  const char *data_;
+  std::size_t size_;
+};
+}
+
+#endif  // SRC_NGRAM_FILTER_H_
@@ -5,6 +5,7 @@
 #include "./context.h"
 #include "./frozen_map.h"
 #include "./index.pb.h"
+#include "./intersect.h"
 #include "./ngram.h"
 #include "./ngram_index_reader.h"
 #include "./queue.h"
@@ -12,8 +13,12 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <functional>
+#include <iterator>
+#include <memory>
 #include <set>
 #include <thread>
 
@@ -38,15 +43,217 @@ namespace codesearch {
 // to optimize for the pathological case.
 inline std::size_t concurrency() { return std::thread::hardware_concurrency(); }
 
+// The most candidates that are kept for a query, across all shards
+const std::size_t max_query_candidates = 1 << 18;
+
+// How many candidates a worker checks between the checks of whether
+// the shard it's searching can still add anything to the results
+const std::size_t cancel_check_interval = 64;
+
+// The candidates that a query produced in one shard, less the ones
+// that turned out not to hold the query. Candidates are produced in
+// order, so this is every line that might hold the query whose id is
+// less than resume (or every such line, if exhausted is set). For
+// FILE_POSTINGS shards, the ids are files and the payloads are the
+// ordinals of the lines.
+struct ShardCandidates {
+  ShardCandidates() :complete(false), exhausted(false), resume(0) {}
+
+  // Set once the shard has been searched, if the candidates weren't
+  // too many to keep and the search wasn't cancelled
+  bool complete;
+  bool exhausted;
+  std::uint64_t resume;
+  std::shared_ptr<DecodedPostingList> list;
+};
+
+// The candidates of a query in each shard, for the queries that come
+// after it.
+struct QueryCandidates {
+  QueryCandidates(const std::string &q, std::size_t num_shards)
+      :query(q), shards(num_shards), budget(max_query_candidates) {}
+
+  const std::string query;
+  std::vector<ShardCandidates> shards;
+
+  // The number of candidates that can still be kept, which is shared
+  // by the workers searching each shard
+  std::atomic<std::ptrdiff_t> budget;
+
+  // Keep a candidate; returns false if the query has run out of room,
+  // in which case the shard's candidates are dropped.
+  bool Add(ShardCandidates *shard, std::uint64_t id,
+           const std::vector<std::uint32_t> *payload) {
+    const std::size_t size = 1 + (payload ? payload->size() : 0);
+    if (budget.fetch_sub(size) < static_cast<std::ptrdiff_t>(size)) {
+      shard->list.reset();
+      return false;
+    }
+    shard->list->ids.push_back(id);
+    if (payload != nullptr) {
+      shard->list->payloads.insert(shard->list->payloads.end(),
+                                   payload->begin(), payload->end());
+      shard->list->payload_starts.push_back(shard->list->payloads.size());
+    }
+    return true;
+  }
+};
+
 struct QueryRequest {
   QueryRequest(const std::string &q,
                const std::vector<NGram> &n,
-               SearchResults *r)
-      :query(q), ngrams(n), results(r) {}
+               SearchResults *r,
+               const QueryCandidates *p,
+               QueryCandidates *c,
+               const Regexp *re = nullptr,
+               const NGramQuery *nq = nullptr,
+               const CaseInsensitiveMatcher *m = nullptr,
+               const QueryPlan *qp = nullptr)
+      :query(q), ngrams(n), results(r), prior(p), candidates(c), regexp(re),
+       ngram_query(nq), plan(qp), matcher(m) {}
+
+  // Check whether a candidate line really holds the query
+  bool Matches(boost::string_ref line) const {
+    if (matcher != nullptr) {
+      return matcher->Match(line);
+    }
+    return line.find(query) != std::string::npos;
+  }
+
+  // Check whether anything in a shard might match, using the shard's
+  // filter of its ngrams
+  bool MayMatch(const NGramTableReader &shard) const {
+    if (ngram_query != nullptr) {
+      return MayMatch(*ngram_query, shard);
+    }
+    for (const auto &ngram : ngrams) {
+      if (!shard.MayContain(ngram)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool MayMatch(const NGramQuery &q, const NGramTableReader &shard) {
+    switch (q.op()) {
+      case NGramQuery::ALL:
+        return true;
+      case NGramQuery::NONE:
+        return false;
+      case NGramQuery::AND:
+        for (const auto &ngram : q.ngrams()) {
+          if (!shard.MayContain(ngram)) {
+            return false;
+          }
+        }
+        for (const auto &sub : q.subs()) {
+          if (!MayMatch(sub, shard)) {
+            return false;
+          }
+        }
+        return true;
+      case NGramQuery::OR:
+        for (const auto &ngram : q.ngrams()) {
+          if (shard.MayContain(ngram)) {
+            return true;
+          }
+        }
+        for (const auto &sub : q.subs()) {
+          if (MayMatch(sub, shard)) {
+            return true;
+          }
+        }
+        return false;
+    }
+    return true;
+  }
 
   const std::string &query;
   const std::vector<NGram> &ngrams;
   SearchResults *results;
+  const QueryCandidates *prior;
+  QueryCandidates *candidates;
+
+  // For regexp queries, the regexp, or for boolean queries, the plan,
+  // and the ngrams that their matches have
+  const Regexp *regexp;
+  const NGramQuery *ngram_query;
+  const QueryPlan *plan;
+
+  // For case-insensitive queries, which are searched for in the
+  // "ngrams_folded" index, the matcher for the lines
+  const CaseInsensitiveMatcher *matcher;
+};
+
+// Uses the ngram offsets stored in positional posting lists to check
+// whether a line could hold the query, i.e. whether every ngram that
+// was looked up appears in the line at the same distance from the
+// others as it does in the query. The ngrams are only a selective
+// subset of the query's ngrams (see Context::CoverNGrams()), so passing
+// this check only means that a line may hold the query; its text is
+// still checked afterwards.
+class OffsetFilter {
+ public:
+  // The postings must be in the same order as the ngrams, and are
+  // copied, so that the caller can go on to consume them.
+  OffsetFilter(const std::string &query,
+               const std::vector<NGram> &ngrams,
+               const std::vector<PostingIterator> &postings)
+      :lists_(postings), query_offsets_(ngrams.size()) {
+    assert(query.size() >= NGram::ngram_size);
+    for (std::size_t i = 0; i <= query.size() - NGram::ngram_size; i++) {
+      const NGram ngram(query.data() + i);
+      for (std::size_t j = 0; j < ngrams.size(); j++) {
+        if (ngrams[j] == ngram) {
+          query_offsets_[j].push_back(i);
+        }
+      }
+    }
+  }
+
+  // Check a candidate, which must be in all of the posting lists.
+  // Candidates must be checked in increasing order.
+  bool CanMatch(std::uint64_t candidate) {
+    // the possible offsets of the query in the line
+    bool seeded = false;
+    starts_.clear();
+    for (std::size_t j = 0; j < lists_.size(); j++) {
+      lists_[j].advance_to(candidate);
+      assert(lists_[j].valid() && lists_[j].value() == candidate);
+      lists_[j].payload(&line_offsets_);
+      for (const auto &query_offset : query_offsets_[j]) {
+        scratch_.clear();
+        if (!seeded) {
+          for (const auto &offset : line_offsets_) {
+            if (offset >= query_offset) {
+              scratch_.push_back(offset - query_offset);
+            }
+          }
+          seeded = true;
+        } else {
+          for (const auto &start : starts_) {
+            if (std::binary_search(line_offsets_.begin(),
+                                   line_offsets_.end(),
+                                   start + query_offset)) {
+              scratch_.push_back(start);
+            }
+          }
+        }
+        std::swap(starts_, scratch_);
+        if (starts_.empty()) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+ private:
+  std::vector<PostingIterator> lists_;
+  std::vector<std::vector<std::uint32_t> > query_offsets_;
+  std::vector<std::uint32_t> line_offsets_;
+  std::vector<std::uint32_t> starts_;
+  std::vector<std::uint32_t> scratch_;
 };
 
 NGramReaderWorker::NGramReaderWorker(Queue<NGramReaderWorker*> *responses,
@@ -54,19 +261,29 @@ NGramReaderWorker::NGramReaderWorker(Queue<NGramReaderWorker*> *responses,
                                      NGramIndexReader *index_reader)
     :responses_(responses), terminate_responses_(terminate_responses),
      index_reader_(index_reader), keep_going_(true), req_(nullptr),
-     shard_(nullptr) {}
+     shard_(nullptr), task_(nullptr) {}
 
 void NGramReaderWorker::Run() {
   std::unique_lock<std::mutex> lock(mut_);
   while (true) {
-    cond_.wait(lock, [=](){ return !keep_going_ || req_ != nullptr; });
+    cond_.wait(lock, [=](){
+        return !keep_going_ || req_ != nullptr || task_ != nullptr; });
     if (!keep_going_) {
       break;
     }
 
-    FindShard();
-    req_ = nullptr;
-    shard_ = nullptr;
+    if (task_ != nullptr) {
+      (*task_)();
+      task_ = nullptr;
+    } else {
+      if (local_ == nullptr) {
+        local_.reset(new LocalResults(req_->results));
+      }
+      local_->set_shard_num(shard_->shard_num());
+      FindShard();
+      req_ = nullptr;
+      shard_ = nullptr;
+    }
     responses_->push(this);
   }
   terminate_responses_->push(this);
@@ -81,87 +298,226 @@ void NGramReaderWorker::Stop() {
 void NGramReaderWorker::SendRequest(const QueryRequest *req,
                                     const NGramTableReader *shard) {
   std::unique_lock<std::mutex> lock(mut_);
-  cond_.wait(lock, [=]() { return req_ == nullptr; });
+  cond_.wait(lock, [=]() { return req_ == nullptr && task_ == nullptr; });
   assert(req_ == nullptr);
   req_ = req;
   shard_ = shard;
   cond_.notify_all();
 }
 
+void NGramReaderWorker::SendTask(const std::function<void()> *task) {
+  std::unique_lock<std::mutex> lock(mut_);
+  cond_.wait(lock, [=]() { return req_ == nullptr && task_ == nullptr; });
+  task_ = task;
+  cond_.notify_all();
+}
+
+bool NGramReaderWorker::Cancelled() const {
+  return req_->results->PastShard(shard_->shard_num());
+}
+
 void NGramReaderWorker::FindShard() {
-  Timer timer;
-  std::vector<std::uint64_t> candidates;
-  std::vector<std::uint64_t> intersection;
-
-  NGramValue ngram_val;
-  std::vector<NGram>::const_iterator ngrams_iter = req_->ngrams.cbegin();
-
-  // Get all of the candidates -- that is, all of the lines/positions
-  // who have all of the ngrams. To do this we populate the candidates
-  // vector, and successively check the remaining ngrams (in
-  // lexicographical order), taking the intersection of the
-  // candidates.
-  if (!shard_->Find(*ngrams_iter, &candidates)) {
+  if (req_->ngram_query != nullptr) {
+    FindQueryShard();
     return;
   }
 
-#if 0
-  intersection.reserve(candidates.size());
-#endif
+  Timer timer;
+  const bool file_postings =
+      shard_->value_format() == SSTableHeader_ValueFormat_FILE_POSTINGS;
 
+  // If this query's candidates are being kept, start keeping them for
+  // this shard.
+  ShardCandidates *record = nullptr;
+  if (req_->candidates != nullptr) {
+    record = &req_->candidates->shards[shard_->shard_num()];
+    record->list = std::make_shared<DecodedPostingList>();
+    if (file_postings) {
+      record->list->payload_starts.push_back(0);
+    }
+  }
 
-  ngrams_iter++;
-  for (; ngrams_iter != req_->ngrams.end() &&
-           candidates.size() > req_->results->max_keys();
-       ++ngrams_iter) {
-    std::vector<std::uint64_t> new_candidates;
-    if (!shard_->Find(*ngrams_iter, &new_candidates)) {
+  // The ngrams are ordered by their counts across the whole index, but
+  // an ngram that's rare overall can be common in this shard, so they
+  // are looked up in the order of this shard's counts. If any of the
+  // ngrams isn't in this shard then nothing in the shard can match,
+  // and the shard is skipped without reading any of its posting lists.
+  // The lists that Count() finds in the cache are handed to Find(), so
+  // that each ngram is only looked up in the cache once.
+  PostingCache *cache = index_reader_->ctx_->posting_cache();
+  std::vector<std::size_t> counts(req_->ngrams.size());
+  std::vector<std::size_t> order(req_->ngrams.size());
+  std::vector<std::shared_ptr<const DecodedPostingList> > cached(
+      req_->ngrams.size());
+  for (std::size_t i = 0; i < req_->ngrams.size(); i++) {
+    if (Cancelled()) {
+      return;
+    }
+    counts[i] = shard_->Count(req_->ngrams[i], cache, &cached[i]);
+    if (counts[i] == 0) {
+      if (record != nullptr) {
+        record->complete = record->exhausted = true;
+      }
       return;
     }
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](std::size_t a, std::size_t b) {
+                     return counts[a] < counts[b];
+                   });
 
-    // Do the actual set intersection, storing the result into the
-    // "intersection" vector. Then swap out the contents into our
-    // "candidates" vector.
-    std::set_intersection(
-        candidates.begin(), candidates.end(),
-        new_candidates.begin(), new_candidates.end(),
-        std::back_inserter(intersection));
-    std::swap(candidates, intersection);
-    intersection.clear();  // reset for the next loop iteration
+  std::vector<PostingIterator> postings(req_->ngrams.size());
+  std::vector<PostingIterator*> lists;
+  lists.reserve(postings.size());
+  for (const auto &i : order) {
+    if (Cancelled()) {
+      return;
+    }
+    if (!shard_->Find(req_->ngrams[i], &postings[i], cache, &cached[i])) {
+      // The shard's counts say that it has the ngram, but its table
+      // doesn't, so the stats are out of date; like an ngram with no
+      // count, nothing in the shard can match.
+      LOG(WARNING) << "shard " << shard_->shard_name() << " has a count " <<
+          "for ngram " << req_->ngrams[i] << " but no posting list\n";
+      if (record != nullptr) {
+        record->complete = record->exhausted = true;
+      }
+      return;
+    }
+    lists.push_back(&postings[i]);
+  }
+
+  // If the index has the offsets of the ngrams in each line, they can
+  // rule out most of the candidates that don't match before their
+  // lines are looked up.
+  std::unique_ptr<OffsetFilter> filter;
+  if (shard_->value_format() == SSTableHeader_ValueFormat_POSITIONAL_POSTINGS &&
+      req_->query.size() >= NGram::ngram_size) {
+    filter.reset(new OffsetFilter(req_->query, req_->ngrams, postings));
+  }
+
+  std::size_t num_candidates = 0;
+  std::size_t lines_added = 0;
+  bool exhausted = false;
+
+  // If a query that this query contains was searched recently, then
+  // every candidate of this query is one of its candidates, so for
+  // the ids it covers only its candidates have to be intersected with
+  // the ngrams that this query adds. The posting lists are copied for
+  // this, since it may move them past resume.
+  const ShardCandidates *prior = nullptr;
+  if (req_->prior != nullptr) {
+    prior = &req_->prior->shards[shard_->shard_num()];
+    if (!prior->complete) {
+      prior = nullptr;
+    }
+  }
+  if (prior != nullptr) {
+    std::set<NGram> prior_ngrams;
+    for (std::string::size_type i = 0;
+         i <= req_->prior->query.size() - NGram::ngram_size; i++) {
+      prior_ngrams.insert(NGram(req_->prior->query.data() + i));
+    }
+    PostingIterator prior_postings;
+    prior_postings.Reset(prior->list);
+    std::vector<PostingIterator> new_postings;
+    new_postings.reserve(postings.size());
+    std::vector<PostingIterator*> prior_lists{&prior_postings};
+    for (std::size_t i = 0; i < req_->ngrams.size(); i++) {
+      if (!prior_ngrams.count(req_->ngrams[i])) {
+        new_postings.push_back(postings[i]);
+        prior_lists.push_back(&new_postings.back());
+      }
+    }
+    exhausted = SearchLists(prior_lists, filter.get(), record,
+                            &num_candidates, &lines_added);
+    if (exhausted && !prior->exhausted) {
+      // carry on from where the prior query's candidates end
+      if (record != nullptr) {
+        record->resume = prior->resume;
+      }
+      for (auto &list : lists) {
+        list->advance_to(prior->resume);
+      }
+      exhausted = SearchLists(lists, filter.get(), record, &num_candidates,
+                              &lines_added);
+    }
+  } else {
+    exhausted = SearchLists(lists, filter.get(), record, &num_candidates,
+                            &lines_added);
   }
-  LOG(INFO) << "shard " << shard_->shard_name() <<
-      " finished SST lookups and set intersections after " <<
-      timer.elapsed_us() << " us" <<
-      (ngrams_iter != req_->ngrams.end() ? " (and aborted early)" : "") <<
-      ", final size is " << candidates.size() << "\n";
 
-  // We are going to construct a map of filename -> [(line num,
-  // offset, line)].
-  Timer trim_candidates_timer;
-  std::size_t lines_added = TrimCandidates(candidates);
+  // A shard that was given up on isn't complete, so a later query that
+  // extends this one searches it in full.
+  const bool cancelled = !exhausted && Cancelled();
+  if (record != nullptr && record->list != nullptr && !cancelled) {
+    record->complete = true;
+    record->exhausted = exhausted;
+  }
 
   LOG(INFO) << "shard " << shard_->shard_name() <<
       " searched query \"" << req_->query << "\" to add " << lines_added <<
-      " lines in " << timer.elapsed_us() << " us (trim took " <<
-      trim_candidates_timer.elapsed_us() << " us)\n";
+      " lines from " << num_candidates << " candidates in " <<
+      timer.elapsed_us() << " us" <<
+      (prior != nullptr ? " (using the candidates of a prior query)" : "") <<
+      "\n";
+}
+
+bool NGramReaderWorker::SearchLists(
+    const std::vector<PostingIterator*> &lists, OffsetFilter *filter,
+    ShardCandidates *record, std::size_t *num_candidates,
+    std::size_t *lines_added) {
+  // The candidates are all of the lines/positions that have all of
+  // the ngrams. They're produced lazily, and verified as they are
+  // produced, so the shard stops doing work as soon as the results
+  // can't take any more of its lines. The intersection is driven by
+  // the shortest posting list in this shard, and the longer lists are
+  // only decoded for the blocks that might hold one of its ids.
+  std::vector<PostingIterator*> sorted_lists(lists);
+  std::stable_sort(sorted_lists.begin(), sorted_lists.end(),
+                   [](const PostingIterator *a, const PostingIterator *b) {
+                     return a->size() < b->size();
+                   });
+  if (shard_->value_format() == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+    // The posting lists hold files, so the files that have all of the
+    // ngrams are found first, and only their lines are intersected.
+    FilePostingIntersection candidates(sorted_lists);
+    return TrimFileCandidates(&candidates, record, num_candidates,
+                              lines_added);
+  }
+  PostingIntersection candidates(sorted_lists);
+  return TrimCandidates(&candidates, filter, record, num_candidates,
+                        lines_added);
 }
 
-std::size_t NGramReaderWorker::TrimCandidates(
-    const std::vector<std::uint64_t> &candidates) {
-  // The candidates vector contains the ids of rows in the "lines"
-  // index that are candidates. We need to check each candidate to
-  // make sure it really is a match.
+bool NGramReaderWorker::TrimCandidates(
+    PostingIntersection *candidates, OffsetFilter *filter,
+    ShardCandidates *record, std::size_t *num_candidates,
+    std::size_t *lines_added) {
+  // The candidates are the ids of rows in the "lines" index. We need
+  // to check each candidate to make sure it really is a match.
   //
   // To do the trimming/sorting for consistent results, we're going to
   // do the full lookup of all of the lines.
   const FrozenMap<std::uint32_t, std::uint32_t> &offsets =\
       index_reader_->ctx_->file_offsets();
   const bool use_offsets = !offsets.empty();
+  BlockCache *cache = index_reader_->ctx_->block_cache();
 
-  std::size_t lines_added = 0;
-  std::uint64_t max_file_id = UINT64_MAX;
-  PositionValue pos;
-  for (const auto &candidate : candidates) {
+  Line line;
+  std::uint64_t candidate;
+  while (candidates->next(&candidate)) {
+    if (*num_candidates % cancel_check_interval == 0 && Cancelled()) {
+      return false;
+    }
+    (*num_candidates)++;
+    if (record != nullptr) {
+      record->resume = candidate + 1;
+    }
+    if (filter != nullptr && !filter->CanMatch(candidate)) {
+      continue;
+    }
     std::uint64_t file_id;
     if (use_offsets) {
       auto it = offsets.lower_bound(candidate);
@@ -173,51 +529,281 @@ std::size_t NGramReaderWorker::TrimCandidates(
       } else {
         file_id = it->second - 1;
       }
-      if (file_id >= max_file_id) {
-        continue;
-      }
-      assert(index_reader_->lines_index_.Find(candidate, &pos));
-      assert(file_id == pos.file_id());
+      const bool found = index_reader_->lines_index_.Find(candidate, &line,
+                                                          cache);
+      assert(found && file_id == line.file_id());
     } else {
-      assert(index_reader_->lines_index_.Find(candidate, &pos));
+      const bool found = index_reader_->lines_index_.Find(candidate, &line,
+                                                          cache);
+      assert(found);
+      file_id = line.file_id();
+    }
 
-      // Check that it's going to be possible to insert with this file
-      // id -- no mutexes need to be accessed for this check!
-      file_id = pos.file_id();
-      if (file_id >= max_file_id) {
-        continue;
+    // We can't insert the file data if the file_id is too big. Lines
+    // are numbered in the order that their files were added, so every
+    // candidate after this one has a file id that's at least as big,
+    // and there's no point in checking any more of them. This
+    // candidate wasn't checked, so it's where a later query resumes.
+    if (local_->PastCutoff(file_id)) {
+      if (record != nullptr) {
+        record->resume = candidate;
       }
+      return false;
     }
 
     // Ensure that the text really matches our query
-    if (pos.line().find(req_->query) == std::string::npos) {
+    if (!req_->Matches(line.line())) {
       continue;
     }
+    if (record != nullptr &&
+        !req_->candidates->Add(record, candidate, nullptr)) {
+      record = nullptr;
+    }
 
     FileValue fileval;
     index_reader_->files_index_.Find(file_id, &fileval);
     FileKey filekey(file_id, fileval.filename());
 
-    BoundedMapInsertionResult status = req_->results->insert(
-        filekey, FileResult(pos.file_offset(), pos.file_line()));
+    BoundedMapInsertionResult status = local_->insert(
+        filekey, FileResult(line.file_offset(), line.file_line()));
     if (status == BoundedMapInsertionResult::INSERT_SUCCESSFUL) {
-      lines_added++;
+      (*lines_added)++;
     } else if (status == BoundedMapInsertionResult::KEY_TOO_LARGE) {
-      // We failed to insert the file data, because the file_id was
-      // too big. Track this file_id, so we can avoid trying to insert
-      // with file ids >= this one in the future.
-      max_file_id = file_id;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool NGramReaderWorker::TrimFileCandidates(
+    FilePostingIntersection *candidates, ShardCandidates *record,
+    std::size_t *num_candidates, std::size_t *lines_added) {
+  // The candidates are files, along with the ordinals of the lines in
+  // each file that might match; the ids of those lines in the "lines"
+  // index are just offsets from the id of the first line in the file.
+  const FrozenMap<std::uint32_t, std::uint32_t> &first_lines =\
+      index_reader_->ctx_->file_first_lines();
+  BlockCache *cache = index_reader_->ctx_->block_cache();
+
+  Line line;
+  std::uint64_t file_id;
+  std::vector<std::uint32_t> ordinals;
+  std::vector<std::uint32_t> matches;
+  bool keep_going = true;
+  while (keep_going && candidates->next(&file_id, &ordinals)) {
+    // Neither this file nor the ones after it can be inserted if the
+    // results have been filled with files before it
+    if (Cancelled() || local_->PastCutoff(file_id)) {
+      keep_going = false;
+      break;
+    }
+    auto it = first_lines.lower_bound(file_id);
+    assert(it != first_lines.end() && it->first == file_id);
+    const std::uint64_t first_line = it->second;
+
+    // The file is only looked up if one of its lines really matches
+    bool have_file = false;
+    FileValue fileval;
+    matches.clear();
+    auto ordinal = ordinals.begin();
+    for (; ordinal != ordinals.end(); ++ordinal) {
+      (*num_candidates)++;
+      const bool found = index_reader_->lines_index_.Find(
+          first_line + *ordinal, &line, cache);
+      assert(found && line.file_id() == file_id);
+
+      // Ensure that the text really matches our query
+      if (!req_->Matches(line.line())) {
+        continue;
+      }
+      matches.push_back(*ordinal);
+      if (!have_file) {
+        index_reader_->files_index_.Find(file_id, &fileval);
+        have_file = true;
+      }
+      FileKey filekey(file_id, fileval.filename());
+
+      BoundedMapInsertionResult status = local_->insert(
+          filekey, FileResult(line.file_offset(), line.file_line()));
+      if (status == BoundedMapInsertionResult::INSERT_SUCCESSFUL) {
+        (*lines_added)++;
+      } else if (status == BoundedMapInsertionResult::KEY_TOO_LARGE) {
+        // The files are produced in increasing order, so none of the
+        // files after this one can be inserted either.
+        keep_going = false;
+        ++ordinal;
+        break;
+      } else if (status == BoundedMapInsertionResult::VAL_LIST_TOO_LONG) {
+        // The rest of this file's lines come after this one, and
+        // won't fit either.
+        ++ordinal;
+        break;
+      }
+    }
+
+    // Keep the lines that matched, and the ones that weren't checked
+    if (record != nullptr) {
+      record->resume = file_id + 1;
+      matches.insert(matches.end(), ordinal, ordinals.end());
+      if (!matches.empty() &&
+          !req_->candidates->Add(record, file_id, &matches)) {
+        record = nullptr;
+      }
+    }
+  }
+  return keep_going;
+}
+
+void NGramReaderWorker::FindQueryShard() {
+  Timer timer;
+  std::vector<std::uint64_t> lines;
+  if (Cancelled()) {
+    return;
+  }
+  EvalQuery(*req_->ngram_query, &lines);
+  if (Cancelled()) {
+    return;
+  }
+
+  // The matchers build their DFAs as they go, so each worker has its
+  // own
+  std::function<bool(const Line&)> matches;
+  std::unique_ptr<RegexpMatcher> regexp_matcher;
+  std::unique_ptr<QueryMatcher> query_matcher;
+  if (req_->regexp != nullptr) {
+    regexp_matcher.reset(new RegexpMatcher(*req_->regexp));
+    matches = [&](const Line &line) {
+      return regexp_matcher->Match(line.line());
+    };
+  } else {
+    query_matcher.reset(new QueryMatcher(*req_->plan,
+                                         index_reader_->files_index_));
+    matches = [&](const Line &line) {
+      return query_matcher->Match(line);
+    };
+  }
+  std::size_t lines_added = 0;
+  Line line;
+  index_reader_->lines_index_.FindMany(lines, &line, [&](std::size_t) {
+      return index_reader_->MatchLine(line, matches, local_.get(),
+                                      &lines_added);
+    }, index_reader_->ctx_->block_cache());
+
+  LOG(INFO) << "shard " << shard_->shard_name() << " searched " <<
+      (req_->regexp != nullptr ? "regexp" : "query") << " \"" <<
+      req_->query << "\" to add " << lines_added << " lines from " <<
+      lines.size() << " candidates in " << timer.elapsed_us() << " us\n";
+}
+
+void NGramReaderWorker::EvalQuery(const NGramQuery &query,
+                                  std::vector<std::uint64_t> *lines) {
+  assert(query.op() == NGramQuery::AND || query.op() == NGramQuery::OR);
+  lines->clear();
+
+  // As in FindShard, an AND that has an ngram that isn't in this shard
+  // can't match anything in it, which the shard's counts tell without
+  // reading any posting lists.
+  PostingCache *cache = index_reader_->ctx_->posting_cache();
+  std::vector<std::shared_ptr<const DecodedPostingList> > cached;
+  if (query.op() == NGramQuery::AND) {
+    cached.resize(query.ngrams().size());
+    for (std::size_t i = 0; i < query.ngrams().size(); i++) {
+      if (shard_->Count(query.ngrams()[i], cache, &cached[i]) == 0) {
+        return;
+      }
+    }
+  }
+
+  std::vector<PostingIterator> postings(query.ngrams().size());
+  std::vector<PostingIterator*> lists;
+  for (std::size_t i = 0; i < query.ngrams().size(); i++) {
+    if (shard_->Find(query.ngrams()[i], &postings[i], cache,
+                     cached.empty() ? nullptr : &cached[i])) {
+      lists.push_back(&postings[i]);
+    }
+  }
+
+  std::vector<std::uint64_t> sub_lines;
+  std::vector<std::uint64_t> scratch;
+  if (query.op() == NGramQuery::AND) {
+    // Start with the ngrams, which are intersected a container at a
+    // time from the shortest list, and then narrow the lines down by
+    // each of the subqueries.
+    bool have_lines = false;
+    if (!lists.empty()) {
+      std::stable_sort(lists.begin(), lists.end(),
+                       [](const PostingIterator *a, const PostingIterator *b) {
+                         return a->size() < b->size();
+                       });
+      IntersectLines(lists, lines);
+      have_lines = true;
+    }
+    for (const auto &sub : query.subs()) {
+      if (have_lines && lines->empty()) {
+        break;
+      }
+      EvalQuery(sub, &sub_lines);
+      if (!have_lines) {
+        lines->swap(sub_lines);
+        have_lines = true;
+        continue;
+      }
+      scratch.clear();
+      std::set_intersection(lines->begin(), lines->end(),
+                            sub_lines.begin(), sub_lines.end(),
+                            std::back_inserter(scratch));
+      lines->swap(scratch);
+    }
+    return;
+  }
+
+  for (const auto &list : lists) {
+    IntersectLines({list}, &sub_lines);
+    lines->insert(lines->end(), sub_lines.begin(), sub_lines.end());
+  }
+  for (const auto &sub : query.subs()) {
+    EvalQuery(sub, &sub_lines);
+    lines->insert(lines->end(), sub_lines.begin(), sub_lines.end());
+  }
+  std::sort(lines->begin(), lines->end());
+  lines->erase(std::unique(lines->begin(), lines->end()), lines->end());
+}
+
+void NGramReaderWorker::IntersectLines(
+    const std::vector<PostingIterator*> &lists,
+    std::vector<std::uint64_t> *lines) {
+  lines->clear();
+  if (shard_->value_format() != SSTableHeader_ValueFormat_FILE_POSTINGS) {
+    PostingIntersection candidates(lists);
+    std::uint64_t line;
+    while (candidates.next(&line)) {
+      lines->push_back(line);
+    }
+    return;
+  }
+
+  const FrozenMap<std::uint32_t, std::uint32_t> &first_lines =\
+      index_reader_->ctx_->file_first_lines();
+  FilePostingIntersection candidates(lists);
+  std::uint64_t file_id;
+  std::vector<std::uint32_t> ordinals;
+  while (candidates.next(&file_id, &ordinals)) {
+    auto it = first_lines.lower_bound(file_id);
+    assert(it != first_lines.end() && it->first == file_id);
+    for (const auto &ordinal : ordinals) {
+      lines->push_back(it->second + ordinal);
     }
   }
-  return lines_added;
 }
 
 NGramIndexReader::NGramIndexReader(const std::string &index_directory,
-                                   std::size_t threads)
+                                   std::size_t threads,
+                                   std::size_t recent_queries)
     :ctx_(Context::Acquire(index_directory)),
      files_index_(index_directory, "files"),
-     lines_index_(index_directory, "lines"),
-     parallelism_(threads == 0 ? concurrency() : threads) {
+     lines_index_(index_directory, "lines", BlockCache::lines_table),
+     parallelism_(threads == 0 ? concurrency() : threads),
+     max_recent_(recent_queries) {
   std::string config_name = index_directory + "/ngrams/config";
   std::ifstream config(config_name.c_str(),
                        std::ifstream::binary | std::ifstream::in);
@@ -225,7 +811,30 @@ NGramIndexReader::NGramIndexReader(const std::string &index_directory,
   IndexConfig index_config;
   index_config.ParseFromIstream(&config);
   for (std::size_t i = 0; i < index_config.num_shards(); i++) {
-    shards_.emplace_back(index_directory, i);
+    shards_.emplace_back(index_directory, "ngrams", i, i);
+  }
+
+  // Indexes built with --fold-case also have the ngrams of the case
+  // folded lines. Their posting lists are cached after those of the
+  // "ngrams" shards.
+  std::ifstream folded_config(
+      (index_directory + "/ngrams_folded/config").c_str(),
+      std::ifstream::binary | std::ifstream::in);
+  if (!folded_config.fail()) {
+    IndexConfig folded_index_config;
+    folded_index_config.ParseFromIstream(&folded_config);
+    for (std::size_t i = 0; i < folded_index_config.num_shards(); i++) {
+      folded_shards_.emplace_back(index_directory, "ngrams_folded", i,
+                                  shards_.size() + i);
+    }
+  }
+
+  // FILE_POSTINGS lists store lines relative to the start of each file
+  for (const auto &shard : shards_) {
+    if (shard.value_format() == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+      ctx_->InitializeFileOffsets();
+      break;
+    }
   }
 
   for (std::size_t i = 0; i < parallelism_; i++) {
@@ -237,7 +846,8 @@ NGramIndexReader::NGramIndexReader(const std::string &index_directory,
   }
 
   LOG(INFO) << "initialized NGramIndexReader for directory " <<
-      index_directory << "\n";
+      index_directory << " (using " << IntersectSortedImpl() <<
+      " set intersection)\n";
 }
 
 NGramIndexReader::~NGramIndexReader() {
@@ -264,17 +874,180 @@ void NGramIndexReader::Find(const std::string &query,
     return;
   }
 
-  // split the query into its constituent ngrams
-  std::vector<NGram> ngrams;
+  // choose the ngrams of the query that are worth looking up
+  const std::vector<NGram> ngrams = ctx_->CoverNGrams(query,
+                                                      lines_index_.size());
+  assert(!ngrams.empty());
+  LOG(INFO) << "looking up " << ngrams.size() << " of the ngrams of query \"" <<
+      query << "\"\n";
+  if (max_recent_ == 0) {
+    FindNGrams(query, ngrams, results);
+    return;
+  }
+
+  // Use the longest recent query that this query contains, and keep
+  // the candidates of this query for the ones after it
+  auto prior = recent_.end();
+  for (auto it = recent_.begin(); it != recent_.end(); ++it) {
+    if (query.find((*it)->query) != std::string::npos &&
+        (prior == recent_.end() ||
+         (*it)->query.size() > (*prior)->query.size())) {
+      prior = it;
+    }
+  }
+  std::unique_ptr<QueryCandidates> candidates(
+      new QueryCandidates(query, shards_.size()));
+  FindNGrams(query, ngrams, results,
+             prior == recent_.end() ? nullptr : prior->get(),
+             candidates.get());
+
+  for (auto it = recent_.begin(); it != recent_.end(); ++it) {
+    if ((*it)->query == query) {
+      recent_.erase(it);
+      break;
+    }
+  }
+  if (recent_.size() == max_recent_) {
+    recent_.pop_back();
+  }
+  recent_.insert(recent_.begin(), std::move(candidates));
+}
+
+bool NGramIndexReader::FindRegexp(const std::string &pattern,
+                                  SearchResults *results,
+                                  std::string *error) {
+  Timer timer;
+  Regexp re(pattern);
+  if (!re.ok()) {
+    *error = re.error();
+    return false;
+  }
+  const NGramQuery query(re);
+  LOG(INFO) << "regexp \"" << pattern << "\" has ngram query " <<
+      query.ToString() << "\n";
+
+  if (query.op() == NGramQuery::ALL) {
+    RegexpMatcher matcher(re);
+    ScanLines(pattern, [&](const Line &line) {
+        return matcher.Match(line.line());
+      }, results);
+  } else if (query.op() != NGramQuery::NONE) {
+    const std::vector<NGram> ngrams;
+    QueryRequest req(pattern, ngrams, results, nullptr, nullptr, &re, &query);
+    SearchShards(req, shards_);
+  }
+  LOG(INFO) << "done with FindRegexp() after " << timer.elapsed_us() <<
+      " us\n";
+  return true;
+}
+
+void NGramIndexReader::FindCaseInsensitive(const std::string &query,
+                                           SearchResults *results) {
+  Timer timer;
+  const CaseInsensitiveMatcher matcher(query);
+  const std::string &folded = matcher.folded();
+  if (folded_shards_.empty() || folded.size() < NGram::ngram_size) {
+    std::string error;
+    if (!FindRegexp(CaseInsensitiveRegexp(query), results, &error)) {
+      LOG(INFO) << "couldn't search for \"" << query <<
+          "\" ignoring case: " << error << "\n";
+    }
+    return;
+  }
+
   std::set<NGram> ngrams_set;
   for (std::string::size_type i = 0;
-       i <= query.length() - NGram::ngram_size; i++) {
-    ngrams_set.insert(NGram(query.substr(i, NGram::ngram_size)));
+       i <= folded.size() - NGram::ngram_size; i++) {
+    ngrams_set.insert(NGram(folded.data() + i));
+  }
+  const std::vector<NGram> ngrams(ngrams_set.begin(), ngrams_set.end());
+  QueryRequest req(folded, ngrams, results, nullptr, nullptr, nullptr,
+                   nullptr, &matcher);
+  SearchShards(req, folded_shards_);
+  LOG(INFO) << "done with FindCaseInsensitive() after " <<
+      timer.elapsed_us() << " us\n";
+}
+
+bool NGramIndexReader::FindQuery(const std::string &query,
+                                 bool case_insensitive,
+                                 SearchResults *results,
+                                 std::string *error) {
+  QueryPlan plan(query, case_insensitive);
+  if (!plan.ok()) {
+    *error = plan.error();
+    return false;
+  } else if (plan.literal()) {
+    if (case_insensitive) {
+      FindCaseInsensitive(plan.root().text, results);
+    } else {
+      Find(plan.root().text, results);
+    }
+    return true;
+  }
+
+  Timer timer;
+  plan.Optimize(ctx_, lines_index_.size());
+  const bool folded = case_insensitive && !folded_shards_.empty();
+  const NGramQuery ngram_query = plan.ngram_query(folded);
+  LOG(INFO) << "query \"" << query << "\" has plan " << plan.ToString() <<
+      " and ngram query " << ngram_query.ToString() << "\n";
+
+  if (ngram_query.op() == NGramQuery::ALL) {
+    QueryMatcher matcher(plan, files_index_);
+    ScanLines(query, [&](const Line &line) {
+        return matcher.Match(line);
+      }, results);
+  } else if (ngram_query.op() != NGramQuery::NONE) {
+    const std::vector<NGram> ngrams;
+    QueryRequest req(query, ngrams, results, nullptr, nullptr, nullptr,
+                     &ngram_query, nullptr, &plan);
+    SearchShards(req, folded ? folded_shards_ : shards_);
+  }
+  LOG(INFO) << "done with FindQuery() after " << timer.elapsed_us() <<
+      " us\n";
+  return true;
+}
+
+void NGramIndexReader::ScanLines(
+    const std::string &query,
+    const std::function<bool(const Line&)> &matches,
+    SearchResults *results) {
+  std::size_t lines_added = 0;
+  const std::uint64_t num_lines = lines_index_.size();
+  LocalResults local(results);
+  Line line;
+  for (std::uint64_t line_id = 0; line_id < num_lines; line_id++) {
+    const bool found = lines_index_.Find(line_id, &line, ctx_->block_cache());
+    assert(found);
+    if (!MatchLine(line, matches, &local, &lines_added)) {
+      break;
+    }
+  }
+  results->Merge({&local});
+  LOG(INFO) << "scanned for \"" << query << "\" to add " << lines_added <<
+      " lines\n";
+}
+
+bool NGramIndexReader::MatchLine(
+    const Line &line,
+    const std::function<bool(const Line&)> &matches,
+    LocalResults *results, std::size_t *lines_added) const {
+  if (results->PastCutoff(line.file_id())) {
+    return false;
+  }
+  if (!matches(line)) {
+    return true;
   }
-  assert(!ngrams_set.empty());
-  ngrams.insert(ngrams.begin(), ngrams_set.begin(), ngrams_set.end());
-  ctx_->SortNGrams(&ngrams);
-  FindNGrams(query, ngrams, results);
+
+  FileValue fileval;
+  files_index_.Find(line.file_id(), &fileval);
+  FileKey filekey(line.file_id(), fileval.filename());
+  BoundedMapInsertionResult status = results->insert(
+      filekey, FileResult(line.file_offset(), line.file_line()));
+  if (status == BoundedMapInsertionResult::INSERT_SUCCESSFUL) {
+    (*lines_added)++;
+  }
+  return status != BoundedMapInsertionResult::KEY_TOO_LARGE;
 }
 
 void NGramIndexReader::FindSmall(const std::string &query,
@@ -298,28 +1071,86 @@ void NGramIndexReader::FindSmall(const std::string &query,
 
 void NGramIndexReader::FindNGrams(const std::string &query,
                                   const std::vector<NGram> ngrams,
-                                  SearchResults *results) {
+                                  SearchResults *results,
+                                  const QueryCandidates *prior,
+                                  QueryCandidates *candidates) {
 
   Timer timer;
-  QueryRequest req(query, ngrams, results);
+  QueryRequest req(query, ngrams, results, prior, candidates);
+  SearchShards(req, shards_);
+  LOG(INFO) << "done with FindNGrams() after " << timer.elapsed_us() << " us\n";
+}
 
-  for (const auto &shard : shards_) {
+void NGramIndexReader::SearchShards(
+    const QueryRequest &req, const std::vector<NGramTableReader> &shards) {
+  std::size_t skipped = 0;
+  for (const auto &shard : shards) {
     if (free_workers_.empty()) {
       free_workers_.push_back(response_queue_.pop());
     }
-    if (results->IsFull()) {
+    if (req.results->IsFull()) {
       break;
     }
+    if (!req.MayMatch(shard)) {
+      // The shard is missing one of the ngrams, so it doesn't have to
+      // be searched at all
+      if (req.candidates != nullptr) {
+        ShardCandidates *record = &req.candidates->shards[shard.shard_num()];
+        record->list = std::make_shared<DecodedPostingList>();
+        if (shard.value_format() == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+          record->list->payload_starts.push_back(0);
+        }
+        record->complete = record->exhausted = true;
+      }
+      skipped++;
+      continue;
+    }
     NGramReaderWorker *worker = free_workers_.back();
     free_workers_.pop_back();
     worker->SendRequest(&req, &shard);
   }
 
+  // wait for all of the pending workers to finish, and merge their
+  // results
+  while (free_workers_.size() < parallelism_) {
+    free_workers_.push_back(response_queue_.pop());
+  }
+  std::vector<std::unique_ptr<LocalResults> > locals;
+  for (auto &worker : free_workers_) {
+    std::unique_ptr<LocalResults> local = worker->TakeResults();
+    if (local != nullptr) {
+      locals.push_back(std::move(local));
+    }
+  }
+  std::vector<const LocalResults*> local_ptrs;
+  for (const auto &local : locals) {
+    local_ptrs.push_back(local.get());
+  }
+  req.results->Merge(local_ptrs);
+  if (skipped) {
+    LOG(INFO) << "skipped " << skipped << " of " << shards.size() <<
+        " shards for query \"" << req.query << "\" using their filters\n";
+  }
+}
+
+void NGramIndexReader::RunTasks(
+    const std::vector<std::function<void()> > &tasks) {
+  Timer timer;
+  for (const auto &task : tasks) {
+    if (free_workers_.empty()) {
+      free_workers_.push_back(response_queue_.pop());
+    }
+    NGramReaderWorker *worker = free_workers_.back();
+    free_workers_.pop_back();
+    worker->SendTask(&task);
+  }
+
   // wait for all of the pending workers to finish
   while (free_workers_.size() < parallelism_) {
     free_workers_.push_back(response_queue_.pop());
   }
-  LOG(INFO) << "done with FindNGrams() after " << timer.elapsed_us() << " us\n";
+  LOG(INFO) << "ran " << tasks.size() << " tasks on " << parallelism_ <<
+      " workers in " << timer.elapsed_us() << " us\n";
 }
 
 }  // namespace codesearch
@@ -4,26 +4,42 @@
 #ifndef SRC_NGRAM_INDEX_READER_H_
 #define SRC_NGRAM_INDEX_READER_H_
 
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "./bounded_map.h"
+#include "./case_fold.h"
 #include "./context.h"
 #include "./integer_index_reader.h"
+#include "./lines_reader.h"
 #include "./ngram.h"
+#include "./ngram_query.h"
 #include "./ngram_table_reader.h"
+#include "./posting_list.h"
+#include "./query_plan.h"
 #include "./queue.h"
+#include "./regexp.h"
 #include "./search_results.h"
 
 namespace codesearch {
 
 class QueryRequest;
 class NGramReaderWorker;
+class OffsetFilter;
+struct QueryCandidates;
+struct ShardCandidates;
 
 class NGramIndexReader {
  public:
+  // If recent_queries is non-zero, the candidates of that many recent
+  // queries are kept, and a query that contains one of them (e.g. the
+  // next keystroke of a query that's being typed) only has to check
+  // those candidates against its extra ngrams.
   NGramIndexReader(const std::string &index_directory,
-                   std::size_t threads = 0);
+                   std::size_t threads = 0,
+                   std::size_t recent_queries = 0);
   ~NGramIndexReader();
 
   NGramIndexReader(const NGramIndexReader &other) = delete;
@@ -34,16 +50,54 @@ class NGramIndexReader {
   // max number of results that will be returned.
   void Find(const std::string &query, SearchResults *results);
 
+  // Find the lines that match a regular expression (see regexp.h for
+  // the syntax). Only the lines that have the ngrams that every match
+  // must have are checked, or if the regexp doesn't require any
+  // ngrams, all of the lines. Returns false, and says why in error, if
+  // the pattern isn't a valid regexp.
+  bool FindRegexp(const std::string &pattern, SearchResults *results,
+                  std::string *error);
+
+  // Find a string in the ngram index, ignoring case (see case_fold.h
+  // for the letters that are folded). If the index has the ngrams of
+  // the case folded lines, the folded query is looked up in them, so
+  // this costs the same as Find(). Otherwise, and for queries shorter
+  // than an ngram, the query is searched for as a regexp that has a
+  // character class for each letter.
+  void FindCaseInsensitive(const std::string &query,
+                           SearchResults *results);
+
+  // Find the lines that match a query in the boolean query language
+  // (see query_plan.h). Queries that don't use any of its operators
+  // are passed on to Find() or FindCaseInsensitive(). Otherwise the
+  // plan of the query is optimized with the ngram counts, and only
+  // the lines with the ngrams that its matches must have are checked
+  // against it. Returns false, and says why in error, if the query
+  // isn't valid.
+  bool FindQuery(const std::string &query, bool case_insensitive,
+                 SearchResults *results, std::string *error);
+
+  // Run a list of tasks on the workers, and wait for all of them to
+  // finish. The tasks can be run in any order, at the same time.
+  void RunTasks(const std::vector<std::function<void()> > &tasks);
+
  private:
   friend class NGramReaderWorker;
 
   Context *ctx_;
   const IntegerIndexReader files_index_;
-  const IntegerIndexReader lines_index_;
+  const LinesReader lines_index_;
   std::vector<NGramTableReader> shards_;
 
+  // The shards of the "ngrams_folded" index, if there is one
+  std::vector<NGramTableReader> folded_shards_;
+
   const std::size_t parallelism_;
 
+  // The most recent queries first
+  const std::size_t max_recent_;
+  std::vector<std::unique_ptr<QueryCandidates> > recent_;
+
   Queue<NGramReaderWorker*> response_queue_;
   Queue<NGramReaderWorker*> terminate_response_queue_;
   std::vector<NGramReaderWorker*> free_workers_;
@@ -53,10 +107,34 @@ class NGramIndexReader {
                  SearchResults *results);
 
   // Find according to a list of ngrams. This is the thing that looks
-  // up each ngram, and then intersects the results from each ngram query.
+  // up each ngram, and then intersects the results from each ngram
+  // query. If prior isn't null, it's the candidates of a query that
+  // this query contains, which are used in the shards that they
+  // cover. If candidates isn't null, the candidates of this query are
+  // stored there.
   void FindNGrams(const std::string &query,
                   const std::vector<NGram> ngrams,
-                  SearchResults *results);
+                  SearchResults *results,
+                  const QueryCandidates *prior = nullptr,
+                  QueryCandidates *candidates = nullptr);
+
+  // Hand a request to the workers, one shard at a time, until the
+  // shards run out or the results are full.
+  void SearchShards(const QueryRequest &req,
+                    const std::vector<NGramTableReader> &shards);
+
+  // Check every line in the index against a regexp or query plan
+  void ScanLines(const std::string &query,
+                 const std::function<bool(const Line&)> &matches,
+                 SearchResults *results);
+
+  // Add a line to the results if it matches. Returns false if the
+  // results can't take the line because its file comes after all of
+  // theirs, in which case they can't take any of the lines after it
+  // either.
+  bool MatchLine(const Line &line,
+                 const std::function<bool(const Line&)> &matches,
+                 LocalResults *results, std::size_t *lines_added) const;
 };
 
 
@@ -69,6 +147,11 @@ class NGramReaderWorker {
   void Run();  // run in a loop
   void Stop();  // stop running
   void SendRequest(const QueryRequest *req, const NGramTableReader *shard);
+  void SendTask(const std::function<void()> *task);
+
+  // Take the results that the worker has collected for the request it
+  // has been searching shards for, if it has any
+  std::unique_ptr<LocalResults> TakeResults() { return std::move(local_); }
 
  private:
   Queue<NGramReaderWorker*> *responses_;
@@ -78,19 +161,64 @@ class NGramReaderWorker {
 
   const QueryRequest* req_;
   const NGramTableReader *shard_;
+  const std::function<void()> *task_;
+
+  // The results of the shards searched for the current request
+  std::unique_ptr<LocalResults> local_;
 
   std::mutex mut_;
   std::condition_variable cond_;
 
+  // Returns true if the shard can't add anything to the results,
+  // because the results have been filled by a shard before it. The
+  // search of the shard is then given up.
+  bool Cancelled() const;
+
   // The wrapper function that coordinates the logic for searching a
   // single SSTableReader<NGram> (i.e. a single SSTable file).
   void FindShard();
 
-  // Given a vector of candidate position ids, this function actually
-  // looks up the position data to see if the positions are true
-  // matches, and fills in the SearchResults object. This method does
-  // quries agains the "lines" and "files" SSTables.
-  std::size_t TrimCandidates(const std::vector<std::uint64_t> &candidates);
+  // Like FindShard, for regexps and query plans
+  void FindQueryShard();
+
+  // Find the lines in this shard that satisfy an ngram query, in
+  // order.
+  void EvalQuery(const NGramQuery &query, std::vector<std::uint64_t> *lines);
+
+  // Find the lines that are in all of the posting lists, in order
+  void IntersectLines(const std::vector<PostingIterator*> &lists,
+                      std::vector<std::uint64_t> *lines);
+
+  // Given the candidate position ids, this function actually looks up
+  // the position data to see if the positions are true matches, and
+  // fills in the SearchResults object. This method does quries agains
+  // the "lines" and "files" SSTables. If filter isn't null, it's used
+  // to skip candidates that can't match before their lines are looked
+  // up. If record isn't null, the candidates are added to it. The
+  // number of candidates that were checked and the number of lines
+  // that were added are added to num_candidates and lines_added.
+  // Returns true if the candidates ran out, or false if the results
+  // couldn't take any more of them.
+  bool TrimCandidates(PostingIntersection *candidates,
+                      OffsetFilter *filter,
+                      ShardCandidates *record,
+                      std::size_t *num_candidates,
+                      std::size_t *lines_added);
+
+  // Like TrimCandidates, for the files and line ordinals produced
+  // from FILE_POSTINGS lists. The number of lines that were checked
+  // is added to num_candidates.
+  bool TrimFileCandidates(FilePostingIntersection *candidates,
+                          ShardCandidates *record,
+                          std::size_t *num_candidates,
+                          std::size_t *lines_added);
+
+  // Intersect the posting lists, and check the candidates
+  bool SearchLists(const std::vector<PostingIterator*> &lists,
+                   OffsetFilter *filter,
+                   ShardCandidates *record,
+                   std::size_t *num_candidates,
+                   std::size_t *lines_added);
 };
 
 }  // codesearch
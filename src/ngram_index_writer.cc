@@ -3,29 +3,100 @@
 
 #include "./ngram_index_writer.h"
 
+#include "./case_fold.h"
 #include "./file_util.h"
 #include "./ngram_counter.h"
+#include "./ngram_filter.h"
+#include "./posting_list.h"
 #include "./util.h"
 
+#include <algorithm>
 #include <set>
 #include <thread>
 
+namespace {
+// Sort ids, along with their payloads
+void SortWithPayloads(std::vector<std::uint64_t> *ids,
+                      std::vector<std::vector<std::uint32_t> > *payloads) {
+  assert(ids->size() == payloads->size());
+  std::vector<std::size_t> order(ids->size());
+  for (std::size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(),
+            [=](std::size_t a, std::size_t b) {
+              return (*ids)[a] < (*ids)[b];
+            });
+
+  std::vector<std::uint64_t> sorted_ids;
+  std::vector<std::vector<std::uint32_t> > sorted_payloads;
+  sorted_ids.reserve(ids->size());
+  sorted_payloads.reserve(payloads->size());
+  for (const auto &i : order) {
+    sorted_ids.push_back((*ids)[i]);
+    sorted_payloads.push_back(std::move((*payloads)[i]));
+  }
+  std::swap(*ids, sorted_ids);
+  std::swap(*payloads, sorted_payloads);
+}
+
+// Build the dictionary of a shard, given its keys in order: for each
+// prefix of two bytes, the index of the first key with that prefix (or
+// a larger one), and then the number of keys, each as a 4-byte BE
+// integer
+std::string BuildDictionary(const std::vector<codesearch::NGram> &keys) {
+  std::string dict;
+  dict.reserve((codesearch::NGram::num_prefixes + 1) * sizeof(std::uint32_t));
+  std::size_t key = 0;
+  for (std::size_t prefix = 0; prefix < codesearch::NGram::num_prefixes;
+       prefix++) {
+    while (key < keys.size() && keys[key].prefix() < prefix) {
+      key++;
+    }
+    dict += codesearch::Uint32ToString(key);
+  }
+  dict += codesearch::Uint32ToString(keys.size());
+  return dict;
+}
+}
+
 namespace codesearch {
+NGramIndexWriter::Table::Table(const std::string &index_directory,
+                               const std::string &name,
+                               std::size_t shard_size,
+                               SSTableHeader_ValueFormat value_format)
+    :index_writer(index_directory, name, sizeof(std::uint64_t), shard_size,
+                  false),
+     num_vals(0) {
+  index_writer.SetKeyType(IndexConfig_KeyType_STRING);
+  index_writer.SetValueFormat(value_format);
+}
+
 NGramIndexWriter::NGramIndexWriter(const std::string &index_directory,
                                    std::size_t ngram_size,
                                    std::size_t shard_size,
-                                   std::size_t max_threads)
-    :index_writer_(
-        index_directory, "ngrams", sizeof(std::uint64_t), shard_size, false),
+                                   std::size_t max_threads,
+                                   SSTableHeader_ValueFormat value_format,
+                                   bool fold_case,
+                                   bool compress_lines,
+                                   bool store_contents)
+    :ngrams_(index_directory, "ngrams", shard_size, value_format),
+     folded_(fold_case ?
+             new Table(index_directory, "ngrams_folded", shard_size,
+                       value_format) : nullptr),
      files_index_(index_directory, "files"),
-     lines_index_(index_directory, "lines"),
+     lines_index_(index_directory, "lines", compress_lines),
+     contents_(store_contents ?
+               new ContentWriter(index_directory, "contents") : nullptr),
      ngram_size_(ngram_size),
+     value_format_(value_format),
      file_count_(0),
-     num_vals_(0),
      index_directory_(index_directory),
      pool_(max_threads) {
   assert(ngram_size == NGram::ngram_size);
-  index_writer_.SetKeyType(IndexConfig_KeyType_STRING);
+  assert(value_format == SSTableHeader_ValueFormat_HYBRID_POSTINGS ||
+         value_format == SSTableHeader_ValueFormat_POSITIONAL_POSTINGS ||
+         value_format == SSTableHeader_ValueFormat_FILE_POSTINGS);
 }
 
 // Add a file, dispatching to AddFileThread to add the file in its own
@@ -54,14 +125,26 @@ void NGramIndexWriter::AddFileThread(std::size_t file_count,
   file_val.set_filename(file_name);
   file_val.set_lang(FileLanguage(canonical_name));
 
+  // The contents are compressed here, so that only writing them out
+  // waits for the files before this one
+  std::string blob;
+  if (contents_ != nullptr) {
+    blob = ContentWriter::Compress(canonical_name);
+  }
+
   std::uint64_t file_id;
   {
     IntWait::WaitHandle hdl = files_wait_.Handle(file_count);
     file_id = files_index_.Add(file_val);
+    if (contents_ != nullptr) {
+      const std::uint64_t contents_id = contents_->Add(blob);
+      assert(contents_id == file_id);
+    }
   }
 
   // Collect all of the lines
   std::unordered_map<uint64_t, std::string> positions_map;
+  std::uint64_t first_line_id = 0;
   {
     bool first_line = true;
     std::ifstream ifs(canonical_name.c_str(), std::ifstream::in);
@@ -80,17 +163,13 @@ void NGramIndexWriter::AddFileThread(std::size_t file_count,
             std::endl;
         continue;
       }
-      PositionValue val;
-      val.set_file_id(file_id);
-      val.set_file_offset(file_offset);
-      val.set_file_line(++linenum);
-      val.set_line(line);
 
       // N.B. we write *all* valid UTF-8 lines to the index, even
       // those whose length is less than our trigram length. This
       // makes it possible to reconstruct file contents just from the
       // lines index.
-      std::uint64_t line_id = lines_index_.Add(val);
+      std::uint64_t line_id = lines_index_.Add(file_id, file_offset,
+                                               ++linenum, line);
       positions_map.insert({line_id, line});
 
       // Note the first line in the file
@@ -99,14 +178,44 @@ void NGramIndexWriter::AddFileThread(std::size_t file_count,
         FileStartLine *start_line  = file_start_lines_.add_start_lines();
         start_line->set_file_id(file_id);
         start_line->set_first_line(line_id);
+        first_line_id = line_id;
       }
     }
   }
 
   // We have all of the lines (in memory!) -- generate a map of type
-  // ngram -> [position_id]
-  std::unordered_map<NGram, std::vector<std::uint64_t> > ngrams_map;
-  for (const auto &item : positions_map) {
+  // ngram -> [position_id], and if this is a positional index, a map
+  // of type ngram -> [[offset in the line]] to go along with it. The
+  // folded lines are the same length as the lines, so their offsets
+  // are offsets into the lines, too.
+  LinesMap ngrams_map, folded_map;
+  OffsetsMap offsets_map, folded_offsets_map;
+  CollectNGrams(positions_map, &ngrams_map, &offsets_map);
+  if (folded_ != nullptr) {
+    for (auto &item : positions_map) {
+      item.second = FoldCase(item.second);
+    }
+    CollectNGrams(positions_map, &folded_map, &folded_offsets_map);
+  }
+
+  {
+    IntWait::WaitHandle hdl = ngrams_wait_.Handle(file_count);
+    AddNGrams(&ngrams_, file_id, first_line_id, &ngrams_map, &offsets_map);
+    MaybeRotate(&ngrams_);
+    if (folded_ != nullptr) {
+      AddNGrams(folded_.get(), file_id, first_line_id, &folded_map,
+                &folded_offsets_map);
+      MaybeRotate(folded_.get());
+    }
+  }
+}
+
+void NGramIndexWriter::CollectNGrams(
+    const std::unordered_map<std::uint64_t, std::string> &lines,
+    LinesMap *ngrams_map, OffsetsMap *offsets_map) {
+  const bool positional =
+      value_format_ == SSTableHeader_ValueFormat_POSITIONAL_POSTINGS;
+  for (const auto &item : lines) {
     const uint64_t position_id = item.first;
     const std::string &line = item.second;
     if (line.size() < ngram_size_) {
@@ -117,77 +226,151 @@ void NGramIndexWriter::AddFileThread(std::size_t file_count,
       NGram ngram = NGram(line.substr(i, ngram_size_));
       auto pos = seen_ngrams.lower_bound(ngram);
       if (pos == seen_ngrams.end() || *pos != ngram) {
-        const auto &map_item = ngrams_map.find(ngram);
-        if (map_item == ngrams_map.end()) {
+        const auto &map_item = ngrams_map->find(ngram);
+        if (map_item == ngrams_map->end()) {
           std::vector<std::uint64_t> positions;
           positions.push_back(position_id);
-          ngrams_map.insert(map_item, {ngram, positions});
+          ngrams_map->insert(map_item, {ngram, positions});
         } else {
           map_item->second.push_back(position_id);
         }
         seen_ngrams.insert(pos, ngram);
-     }
+        if (positional) {
+          (*offsets_map)[ngram].push_back(
+              std::vector<std::uint32_t>{static_cast<std::uint32_t>(i)});
+        }
+      } else if (positional) {
+        (*offsets_map)[ngram].back().push_back(i);
+      }
     }
   }
+}
 
-  {
-    IntWait::WaitHandle hdl = ngrams_wait_.Handle(file_count);
-    for (const auto &it : ngrams_map) {
-      Add(it.first, it.second);
+void NGramIndexWriter::AddNGrams(Table *table, std::uint64_t file_id,
+                                 std::uint64_t first_line_id,
+                                 LinesMap *ngrams_map,
+                                 OffsetsMap *offsets_map) {
+  const bool positional =
+      value_format_ == SSTableHeader_ValueFormat_POSITIONAL_POSTINGS;
+  for (auto &it : *ngrams_map) {
+    if (value_format_ == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+      // There's just one posting for the whole file, and its payload
+      // is the lines of the file that have the ngram.
+      std::vector<std::vector<std::uint32_t> > ordinals(1);
+      for (const auto &line_id : it.second) {
+        assert(line_id - first_line_id <= UINT32_MAX);
+        ordinals[0].push_back(line_id - first_line_id);
+      }
+      std::sort(ordinals[0].begin(), ordinals[0].end());
+      Add(table, it.first, {file_id}, &ordinals);
+    } else {
+      Add(table, it.first, it.second,
+          positional ? &(*offsets_map)[it.first] : nullptr);
     }
-    MaybeRotate();
   }
 }
 
-void NGramIndexWriter::Add(const NGram &ngram,
-                           const std::vector<std::uint64_t> &vals) {
-  const auto it = lists_.lower_bound(ngram);
-  if (it != lists_.end() && it->first == ngram) {
+void NGramIndexWriter::Add(Table *table, const NGram &ngram,
+                           const std::vector<std::uint64_t> &vals,
+                           std::vector<std::vector<std::uint32_t> > *payloads) {
+  const auto it = table->lists.lower_bound(ngram);
+  if (it != table->lists.end() && it->first == ngram) {
     std::vector<std::uint64_t> &ngram_vals = it->second;
     ngram_vals.insert(ngram_vals.end(), vals.begin(), vals.end());
   } else {
-    lists_.insert(it, {ngram, vals});
+    table->lists.insert(it, {ngram, vals});
+  }
+  table->num_vals += vals.size();
+
+  if (payloads != nullptr) {
+    assert(payloads->size() == vals.size());
+    std::vector<std::vector<std::uint32_t> > &ngram_payloads =
+        table->payloads[ngram];
+    for (auto &payload : *payloads) {
+      // each payload value takes up about as much space as an id
+      table->num_vals += payload.size();
+      ngram_payloads.push_back(std::move(payload));
+    }
   }
-  num_vals_ += vals.size();
 }
 
-std::size_t NGramIndexWriter::EstimateSize() {
-  return (2 * sizeof(std::uint64_t) +                 // the SST header
-          2 * sizeof(std::uint64_t) * lists_.size() + // the index
-          sizeof(std::uint64_t) * num_vals_ / 6);     // guess for data
+std::size_t NGramIndexWriter::EstimateSize(const Table &table) {
+  return (2 * sizeof(std::uint64_t) +                      // the SST header
+          2 * sizeof(std::uint64_t) * table.lists.size() + // the index
+          sizeof(std::uint64_t) * table.num_vals / 6);     // guess for data
 }
 
-void NGramIndexWriter::MaybeRotate(bool force) {
-  if (force || EstimateSize() >= index_writer_.shard_size()) {
+void NGramIndexWriter::MaybeRotate(Table *table, bool force) {
+  if (force || EstimateSize(*table) >= table->index_writer.shard_size()) {
     NGramCounter *counter = NGramCounter::Instance();
-    for (auto &it : lists_) {
-      NGramValue ngram_val;
-      std::size_t val_count = 0;
+    std::string posting_list;
 
+    // The number of lines that have each ngram in this shard, in the
+    // same order as the keys, so that readers can plan their
+    // intersections for the shard without reading any posting lists.
+    // The keys themselves are kept for the shard's filter and
+    // dictionary.
+    std::string stats;
+    stats.reserve(table->lists.size() * sizeof(std::uint32_t));
+    std::vector<NGram> keys;
+    keys.reserve(table->lists.size());
+    for (auto &it : table->lists) {
       // Because of the loose locking we have, position ids can be
       // added out of order. We need to re-order them before we add
       // them into the posting list.
-      std::sort(it.second.begin(), it.second.end());
-      std::uint64_t last_val = 0;
-      for (const auto &v : it.second) {
-        assert(!last_val || v > last_val);
-        ngram_val.add_position_ids(v - last_val);
-        last_val = v;
-        val_count++;
+      posting_list.clear();
+      std::size_t num_lines = it.second.size();
+      if (value_format_ == SSTableHeader_ValueFormat_HYBRID_POSTINGS) {
+        std::sort(it.second.begin(), it.second.end());
+        EncodePostingList(it.second, &posting_list);
+      } else {
+        std::vector<std::vector<std::uint32_t> > &payloads =
+            table->payloads[it.first];
+        SortWithPayloads(&it.second, &payloads);
+        EncodePayloadPostingList(it.second, payloads, &posting_list);
+        if (value_format_ == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+          num_lines = 0;
+          for (const auto &ordinals : payloads) {
+            num_lines += ordinals.size();
+          }
+        }
+      }
+      assert(std::adjacent_find(it.second.begin(), it.second.end()) ==
+             it.second.end());
+      if (table == &ngrams_) {
+        // the counts are only used to look up queries in "ngrams"
+        counter->UpdateCount(it.first, num_lines);
       }
-      counter->UpdateCount(it.first, val_count);
-      index_writer_.Add(it.first.string(), ngram_val);
+      table->index_writer.Add(it.first.string(), posting_list);
+      assert(num_lines <= UINT32_MAX);
+      stats += Uint32ToString(num_lines);
+      keys.push_back(it.first);
     }
-    index_writer_.Rotate();
-    num_vals_ = 0;
-    lists_.clear();
+    table->index_writer.WriteSidecar("stats", stats);
+    table->index_writer.WriteSidecar("filter", NGramFilter::Build(keys));
+    // The dictionary has an entry for every possible prefix, so small
+    // shards have their keys written in Eytzinger order instead
+    if (keys.size() * 2 * sizeof(std::uint64_t) >=
+        NGram::num_prefixes * sizeof(std::uint32_t)) {
+      table->index_writer.WriteSidecar("dict", BuildDictionary(keys));
+      table->index_writer.SetEytzinger(false);
+    } else {
+      table->index_writer.SetEytzinger(true);
+    }
+    table->index_writer.Rotate();
+    table->num_vals = 0;
+    table->lists.clear();
+    table->payloads.clear();
   }
 }
 
 NGramIndexWriter::~NGramIndexWriter() {
   pool_.Wait();
-  if (num_vals_ || !lists_.empty()) {
-    MaybeRotate(true);
+  if (ngrams_.num_vals || !ngrams_.lists.empty()) {
+    MaybeRotate(&ngrams_, true);
+  }
+  if (folded_ != nullptr && (folded_->num_vals || !folded_->lists.empty())) {
+    MaybeRotate(folded_.get(), true);
   }
   std::ofstream ofs(index_directory_ + "/file_start_lines",
                     std::ofstream::binary | std::ofstream::out);
@@ -5,11 +5,17 @@
 #define SRC_NGRAM_INDEX_WRTITER_H_
 
 #include "./index_writer.h"
+#include "./content_writer.h"
 #include "./integer_index_writer.h"
+#include "./lines_writer.h"
 #include "./ngram.h"
 #include "./thread_util.h"
 
+#include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace codesearch {
 class NGramIndexWriter {
@@ -17,7 +23,12 @@ class NGramIndexWriter {
   NGramIndexWriter(const std::string &index_directory,
                    std::size_t ngram_size = 3,
                    std::size_t shard_size = 16 << 20,
-                   std::size_t max_threads = 1);
+                   std::size_t max_threads = 1,
+                   SSTableHeader_ValueFormat value_format =
+                   SSTableHeader_ValueFormat_HYBRID_POSTINGS,
+                   bool fold_case = false,
+                   bool compress_lines = false,
+                   bool store_contents = false);
 
   void AddFile(const std::string &canonical_name,
                const std::string &dir_name,
@@ -26,14 +37,40 @@ class NGramIndexWriter {
   ~NGramIndexWriter();
 
  private:
-  IndexWriter index_writer_;
+  typedef std::unordered_map<NGram, std::vector<std::uint64_t> > LinesMap;
+  typedef std::unordered_map<NGram, std::vector<std::vector<std::uint32_t> > >
+      OffsetsMap;
+
+  // One of the ngram indexes that's being written
+  struct Table {
+    Table(const std::string &index_directory, const std::string &name,
+          std::size_t shard_size, SSTableHeader_ValueFormat value_format);
+
+    IndexWriter index_writer;
+
+    // The posting lists, which hold line ids, or file ids for
+    // FILE_POSTINGS. For the value formats that have payloads,
+    // payloads holds the payload of each id, in the same order as
+    // lists.
+    std::map<NGram, std::vector<std::uint64_t> > lists;
+    std::map<NGram, std::vector<std::vector<std::uint32_t> > > payloads;
+    std::size_t num_vals;
+  };
+
+  // The "ngrams" index, and if fold_case is set, the "ngrams_folded"
+  // index, which has the ngrams of the case folded lines
+  Table ngrams_;
+  std::unique_ptr<Table> folded_;
+
   IntegerIndexWriter files_index_;
-  IntegerIndexWriter lines_index_;
+  LinesWriter lines_index_;
+
+  // The contents of the files, if store_contents is set
+  std::unique_ptr<ContentWriter> contents_;
 
-  std::map<NGram, std::vector<std::uint64_t> > lists_;
   const std::size_t ngram_size_;
+  const SSTableHeader_ValueFormat value_format_;
   std::size_t file_count_;
-  std::size_t num_vals_;
 
   const std::string index_directory_;
 
@@ -51,13 +88,25 @@ class NGramIndexWriter {
                      const std::string &dir_name,
                      const std::string &file_name);
 
-  void Add(const NGram &ngram, const std::vector<std::uint64_t> &vals);
+  // Find the lines that have each ngram, and if this is a positional
+  // index, the offsets of the ngram in each of those lines
+  void CollectNGrams(const std::unordered_map<std::uint64_t, std::string>
+                     &lines, LinesMap *ngrams_map, OffsetsMap *offsets_map);
+
+  // Add the ngrams of a file's lines to a table
+  void AddNGrams(Table *table, std::uint64_t file_id,
+                 std::uint64_t first_line_id, LinesMap *ngrams_map,
+                 OffsetsMap *offsets_map);
+
+  void Add(Table *table, const NGram &ngram,
+           const std::vector<std::uint64_t> &vals,
+           std::vector<std::vector<std::uint32_t> > *payloads);
 
-  // Estimate the size of the index that will be written
-  std::size_t EstimateSize();
+  // Estimate the size of the table that will be written
+  std::size_t EstimateSize(const Table &table);
 
-  // Rotate the index writer, if the index is large enough
-  void MaybeRotate(bool force = false);
+  // Rotate a table's index writer, if the table is large enough
+  void MaybeRotate(Table *table, bool force = false);
 };
 }
 
@@ -0,0 +1,476 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./ngram_query.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+#include "./util.h"
+
+namespace codesearch {
+namespace {
+typedef std::set<std::string> StringSet;
+
+const std::size_t ngram_size = NGram::ngram_size;
+
+// The largest exact set that's kept before it's turned into ngrams,
+// and the largest prefix or suffix set
+const std::size_t max_exact = 7;
+const std::size_t max_set = 20;
+
+// Classes with more code points than this are treated like "."
+const std::size_t max_class = 100;
+
+std::size_t MinLength(const StringSet &strings) {
+  if (strings.empty()) {
+    return 0;
+  }
+  std::size_t min = strings.begin()->size();
+  for (const auto &str : strings) {
+    min = std::min(min, str.size());
+  }
+  return min;
+}
+
+StringSet Cross(const StringSet &a, const StringSet &b) {
+  StringSet out;
+  for (const auto &x : a) {
+    for (const auto &y : b) {
+      out.insert(x + y);
+    }
+  }
+  return out;
+}
+
+StringSet Union(const StringSet &a, const StringSet &b) {
+  StringSet out(a);
+  out.insert(b.begin(), b.end());
+  return out;
+}
+
+// What's known about the strings that a node of a regexp matches
+struct RegexpInfo {
+  RegexpInfo() :can_empty(false), has_exact(false),
+                match(NGramQuery::ALL) {}
+
+  bool can_empty;
+
+  // If has_exact is set, exact is every string that's matched.
+  // Otherwise every match starts with one of the prefixes and ends
+  // with one of the suffixes.
+  bool has_exact;
+  StringSet exact;
+  StringSet prefix;
+  StringSet suffix;
+
+  // The query that the lines holding a match satisfy
+  NGramQuery match;
+
+  void AddExact() {
+    if (has_exact) {
+      match = match.And(NGramQuery::ForStrings(exact));
+    }
+  }
+
+  // Move information from the exact set into the query once the set
+  // is large, or its strings are long enough to have ngrams, and keep
+  // the prefix and suffix sets small.
+  void Simplify(bool force) {
+    const std::size_t min_length = MinLength(exact);
+    if (has_exact && (exact.size() > max_exact ||
+                      (min_length >= ngram_size && force) ||
+                      min_length >= ngram_size + 1)) {
+      match = match.And(NGramQuery::ForStrings(exact));
+      for (const auto &str : exact) {
+        if (str.size() < ngram_size) {
+          prefix.insert(str);
+          suffix.insert(str);
+        } else {
+          prefix.insert(str.substr(0, ngram_size - 1));
+          suffix.insert(str.substr(str.size() - ngram_size + 1));
+        }
+      }
+      exact.clear();
+      has_exact = false;
+    }
+    if (!has_exact) {
+      SimplifySet(&prefix, false);
+      SimplifySet(&suffix, true);
+    }
+  }
+
+  // Add the ngrams of the set to the query, and cut its strings down
+  // to less than an ngram (and shorter still, if the set is large).
+  void SimplifySet(StringSet *strings, bool is_suffix) {
+    match = match.And(NGramQuery::ForStrings(*strings));
+    for (std::size_t len = ngram_size;
+         len > 0 && (len == ngram_size || strings->size() > max_set);
+         len--) {
+      StringSet shorter;
+      for (const auto &str : *strings) {
+        if (str.size() >= len) {
+          shorter.insert(is_suffix ? str.substr(str.size() - len + 1) :
+                         str.substr(0, len - 1));
+        } else {
+          shorter.insert(str);
+        }
+      }
+      strings->swap(shorter);
+    }
+  }
+};
+
+RegexpInfo EmptyString() {
+  RegexpInfo info;
+  info.can_empty = true;
+  info.has_exact = true;
+  info.exact.insert("");
+  return info;
+}
+
+RegexpInfo AnyChar() {
+  RegexpInfo info;
+  info.prefix.insert("");
+  info.suffix.insert("");
+  return info;
+}
+
+RegexpInfo AnyString() {
+  RegexpInfo info = AnyChar();
+  info.can_empty = true;
+  return info;
+}
+
+RegexpInfo Concat(const RegexpInfo &x, const RegexpInfo &y) {
+  RegexpInfo xy;
+  xy.match = x.match.And(y.match);
+  if (x.has_exact && y.has_exact) {
+    xy.has_exact = true;
+    xy.exact = Cross(x.exact, y.exact);
+  } else {
+    if (x.has_exact) {
+      xy.prefix = Cross(x.exact, y.prefix);
+    } else {
+      xy.prefix = x.prefix;
+      if (x.can_empty) {
+        xy.prefix = Union(xy.prefix, y.prefix);
+      }
+    }
+    if (y.has_exact) {
+      xy.suffix = Cross(x.suffix, y.exact);
+    } else {
+      xy.suffix = y.suffix;
+      if (y.can_empty) {
+        xy.suffix = Union(xy.suffix, x.suffix);
+      }
+    }
+  }
+
+  // If the strings where x meets y are long enough, a match has the
+  // ngrams of one of them, which aren't necessarily in the prefixes or
+  // suffixes of xy.
+  if (!x.has_exact && !y.has_exact && x.suffix.size() <= max_set &&
+      y.prefix.size() <= max_set &&
+      MinLength(x.suffix) + MinLength(y.prefix) >= ngram_size) {
+    xy.match = xy.match.And(NGramQuery::ForStrings(
+        Cross(x.suffix, y.prefix)));
+  }
+  xy.can_empty = x.can_empty && y.can_empty;
+  xy.Simplify(false);
+  return xy;
+}
+
+RegexpInfo Alternate(RegexpInfo x, RegexpInfo y) {
+  RegexpInfo xy;
+  if (x.has_exact && y.has_exact) {
+    xy.has_exact = true;
+    xy.exact = Union(x.exact, y.exact);
+  } else if (x.has_exact) {
+    xy.prefix = Union(x.exact, y.prefix);
+    xy.suffix = Union(x.exact, y.suffix);
+    x.AddExact();
+  } else if (y.has_exact) {
+    xy.prefix = Union(x.prefix, y.exact);
+    xy.suffix = Union(x.suffix, y.exact);
+    y.AddExact();
+  } else {
+    xy.prefix = Union(x.prefix, y.prefix);
+    xy.suffix = Union(x.suffix, y.suffix);
+  }
+  xy.can_empty = x.can_empty || y.can_empty;
+  xy.match = x.match.Or(y.match);
+  xy.Simplify(false);
+  return xy;
+}
+
+RegexpInfo Analyze(const RegexpNode &node) {
+  RegexpInfo info;
+  switch (node.op) {
+    case RegexpNode::NO_MATCH:
+      info.has_exact = true;
+      info.match = NGramQuery(NGramQuery::NONE);
+      break;
+    case RegexpNode::EMPTY_MATCH:
+    case RegexpNode::BEGIN_LINE:
+    case RegexpNode::END_LINE:
+      info = EmptyString();
+      break;
+    case RegexpNode::LITERAL:
+      info.has_exact = true;
+      info.exact.insert(node.literal);
+      break;
+    case RegexpNode::CHAR_CLASS: {
+      std::size_t size = 0;
+      for (const auto &r : node.ranges) {
+        size += r.second - r.first + 1;
+      }
+      if (size > max_class) {
+        info = AnyChar();
+        break;
+      }
+      info.has_exact = true;
+      for (const auto &r : node.ranges) {
+        for (std::uint32_t c = r.first; c <= r.second; c++) {
+          std::string str;
+          AppendUtf8(c, &str);
+          info.exact.insert(str);
+        }
+      }
+      break;
+    }
+    case RegexpNode::CONCAT:
+      info = EmptyString();
+      for (const auto &sub : node.subs) {
+        info = Concat(info, Analyze(*sub));
+      }
+      break;
+    case RegexpNode::ALTERNATE:
+      info = Analyze(*node.subs[0]);
+      for (std::size_t i = 1; i < node.subs.size(); i++) {
+        info = Alternate(info, Analyze(*node.subs[i]));
+      }
+      break;
+    case RegexpNode::REPEAT:
+      if (node.max == 0) {
+        info = EmptyString();
+      } else if (node.min == 0 && node.max == 1) {
+        info = Alternate(Analyze(*node.subs[0]), EmptyString());
+      } else if (node.min == 0) {
+        info = AnyString();
+      } else {
+        // There's at least one match of the sub, so the prefixes and
+        // suffixes stay the same, but the exact set doesn't.
+        info = Analyze(*node.subs[0]);
+        if (info.has_exact && !(node.min == 1 && node.max == 1)) {
+          info.prefix = info.exact;
+          info.suffix = info.exact;
+          info.exact.clear();
+          info.has_exact = false;
+        }
+      }
+      break;
+  }
+  info.Simplify(false);
+  return info;
+}
+}
+
+NGramQuery::NGramQuery(const Regexp &re) :op_(ALL) {
+  assert(re.ok());
+  RegexpInfo info = Analyze(re.root());
+  info.Simplify(true);
+  info.AddExact();
+  *this = info.match;
+}
+
+NGramQuery NGramQuery::ForStrings(const std::set<std::string> &strings) {
+  if (MinLength(strings) < ngram_size) {
+    return NGramQuery(ALL);
+  }
+  NGramQuery query(NONE);
+  for (const auto &str : strings) {
+    NGramQuery ngrams(AND);
+    for (std::size_t i = 0; i + ngram_size <= str.size(); i++) {
+      ngrams.ngrams_.push_back(NGram(str.data() + i));
+    }
+    std::sort(ngrams.ngrams_.begin(), ngrams.ngrams_.end());
+    ngrams.ngrams_.erase(
+        std::unique(ngrams.ngrams_.begin(), ngrams.ngrams_.end()),
+        ngrams.ngrams_.end());
+    query = query.Or(ngrams);
+  }
+  return query;
+}
+
+NGramQuery NGramQuery::And(const NGramQuery &other) const {
+  return AndOr(*this, other, AND);
+}
+
+NGramQuery NGramQuery::Or(const NGramQuery &other) const {
+  return AndOr(*this, other, OR);
+}
+
+NGramQuery NGramQuery::AndOr(NGramQuery q, NGramQuery r, Op op) {
+  // An AND of nothing matches everything, and an OR of nothing matches
+  // nothing
+  for (NGramQuery *query : {&q, &r}) {
+    if (query->ngrams_.empty() && query->subs_.empty()) {
+      if (query->op_ == AND) {
+        query->op_ = ALL;
+      } else if (query->op_ == OR) {
+        query->op_ = NONE;
+      }
+    }
+  }
+  if (q.op_ == NONE) {
+    return op == AND ? q : r;
+  } else if (r.op_ == NONE) {
+    return op == AND ? r : q;
+  } else if (q.op_ == ALL) {
+    return op == AND ? r : q;
+  } else if (r.op_ == ALL) {
+    return op == AND ? q : r;
+  }
+
+  // A query with just one sub is the same as the sub
+  if (q.ngrams_.empty() && q.subs_.size() == 1) {
+    NGramQuery sub = q.subs_[0];
+    q = std::move(sub);
+  }
+  if (r.ngrams_.empty() && r.subs_.size() == 1) {
+    NGramQuery sub = r.subs_[0];
+    r = std::move(sub);
+  }
+
+  // If q implies r, then q AND r is q and q OR r is r
+  if (q.Implies(r)) {
+    return op == AND ? q : r;
+  } else if (r.Implies(q)) {
+    return op == AND ? r : q;
+  }
+
+  // Merge the queries if they're the same op (a query with a single
+  // ngram can be either)
+  std::vector<NGram> merged;
+  const bool q_atom = q.ngrams_.size() == 1 && q.subs_.empty();
+  const bool r_atom = r.ngrams_.size() == 1 && r.subs_.empty();
+  if ((q.op_ == op && (r.op_ == op || r_atom)) ||
+      (r.op_ == op && q_atom) || (q_atom && r_atom)) {
+    std::set_union(q.ngrams_.begin(), q.ngrams_.end(),
+                   r.ngrams_.begin(), r.ngrams_.end(),
+                   std::back_inserter(merged));
+    if (q.op_ != op && r.op_ == op) {
+      std::swap(q, r);
+    }
+    q.op_ = op;
+    q.ngrams_.swap(merged);
+    q.subs_.insert(q.subs_.end(), r.subs_.begin(), r.subs_.end());
+    return q;
+  }
+
+  // If one of them is the op, add the other to it
+  if (q.op_ == op) {
+    q.subs_.push_back(r);
+    return q;
+  } else if (r.op_ == op) {
+    r.subs_.push_back(q);
+    return r;
+  }
+
+  // This is an AND of ORs or an OR of ANDs, so factor out the ngrams
+  // that they have in common, e.g.
+  //   (abc|def|ghi) AND (abc|def|jkl) => (abc|def) OR (ghi AND jkl)
+  std::vector<NGram> common, q_rest, r_rest;
+  std::set_intersection(q.ngrams_.begin(), q.ngrams_.end(),
+                        r.ngrams_.begin(), r.ngrams_.end(),
+                        std::back_inserter(common));
+  if (!common.empty()) {
+    std::set_difference(q.ngrams_.begin(), q.ngrams_.end(),
+                        common.begin(), common.end(),
+                        std::back_inserter(q_rest));
+    std::set_difference(r.ngrams_.begin(), r.ngrams_.end(),
+                        common.begin(), common.end(),
+                        std::back_inserter(r_rest));
+    q.ngrams_.swap(q_rest);
+    r.ngrams_.swap(r_rest);
+    const Op other_op = op == AND ? OR : AND;
+    NGramQuery factored(other_op);
+    factored.ngrams_.swap(common);
+    return AndOr(factored, AndOr(q, r, op), other_op);
+  }
+
+  NGramQuery out(op);
+  out.subs_.push_back(std::move(q));
+  out.subs_.push_back(std::move(r));
+  return out;
+}
+
+bool NGramQuery::Implies(const NGramQuery &other) const {
+  if (op_ == NONE || other.op_ == ALL) {
+    return true;
+  } else if (op_ == ALL || other.op_ == NONE) {
+    return false;
+  } else if (op_ == AND || (op_ == OR && ngrams_.size() == 1 &&
+                            subs_.empty())) {
+    return NGramsImply(ngrams_, other);
+  }
+  return (op_ == OR && other.op_ == OR && !ngrams_.empty() &&
+          subs_.empty() &&
+          std::includes(other.ngrams_.begin(), other.ngrams_.end(),
+                        ngrams_.begin(), ngrams_.end()));
+}
+
+bool NGramQuery::NGramsImply(const std::vector<NGram> &ngrams,
+                             const NGramQuery &q) {
+  switch (q.op_) {
+    case OR:
+      for (const auto &sub : q.subs_) {
+        if (NGramsImply(ngrams, sub)) {
+          return true;
+        }
+      }
+      for (const auto &ngram : ngrams) {
+        if (std::binary_search(q.ngrams_.begin(), q.ngrams_.end(), ngram)) {
+          return true;
+        }
+      }
+      return false;
+    case AND:
+      for (const auto &sub : q.subs_) {
+        if (!NGramsImply(ngrams, sub)) {
+          return false;
+        }
+      }
+      return std::includes(ngrams.begin(), ngrams.end(),
+                           q.ngrams_.begin(), q.ngrams_.end());
+    default:
+      return false;
+  }
+}
+
+std::string NGramQuery::ToString() const {
+  if (op_ == ALL) {
+    return "+";
+  } else if (op_ == NONE) {
+    return "-";
+  } else if (subs_.empty() && ngrams_.size() == 1) {
+    return "\"" + PrintBinaryString(ngrams_[0].string()) + "\"";
+  }
+  const std::string join = op_ == AND ? " " : "|";
+  std::string out;
+  for (const auto &ngram : ngrams_) {
+    if (!out.empty()) {
+      out += join;
+    }
+    out += "\"" + PrintBinaryString(ngram.string()) + "\"";
+  }
+  for (const auto &sub : subs_) {
+    if (!out.empty()) {
+      out += join;
+    }
+    out += "(" + sub.ToString() + ")";
+  }
+  return out;
+}
+}  // namespace codesearch
@@ -0,0 +1,75 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// A boolean query over the ngrams of the lines in the index, i.e. a
+// description of which ngrams a line has to have to possibly match
+// something. The query for a regular expression is worked out from its
+// parse tree the way that Russ Cox describes in "Regular Expression
+// Matching with a Trigram Index": for each node of the tree we track
+// whether it can match the empty string, the exact set of strings that
+// it matches (while that set is small), or otherwise sets of the
+// prefixes and suffixes of its matches, along with the query that all
+// of its matches satisfy. Where two nodes meet, e.g. at the suffixes of
+// one and the prefixes of the next, the ngrams that span them are
+// added to the query.
+
+#ifndef SRC_NGRAM_QUERY_H_
+#define SRC_NGRAM_QUERY_H_
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./ngram.h"
+#include "./regexp.h"
+
+namespace codesearch {
+class NGramQuery {
+ public:
+  enum Op {
+    ALL,   // any line may match
+    NONE,  // no line can match
+    AND,   // lines must have all of the ngrams, and match all of the subs
+    OR     // lines must have one of the ngrams, or match one of the subs
+  };
+
+  explicit NGramQuery(Op op) :op_(op) {}
+
+  // The query for the lines that a regexp might match
+  explicit NGramQuery(const Regexp &re);
+
+  // The query for lines that contain one of the strings. If any of
+  // them is shorter than an ngram, this is ALL.
+  static NGramQuery ForStrings(const std::set<std::string> &strings);
+
+  NGramQuery And(const NGramQuery &other) const;
+  NGramQuery Or(const NGramQuery &other) const;
+
+  Op op() const { return op_; }
+
+  // The ngrams of the query, in sorted order
+  const std::vector<NGram>& ngrams() const { return ngrams_; }
+
+  const std::vector<NGramQuery>& subs() const { return subs_; }
+
+  // A readable form of the query, for logging
+  std::string ToString() const;
+
+ private:
+  Op op_;
+  std::vector<NGram> ngrams_;
+  std::vector<NGramQuery> subs_;
+
+  // Combine two queries with AND or OR, simplifying the result
+  static NGramQuery AndOr(NGramQuery q, NGramQuery r, Op op);
+
+  // True if any line that matches this query matches other, too
+  bool Implies(const NGramQuery &other) const;
+
+  // True if any line with all of the ngrams matches q
+  static bool NGramsImply(const std::vector<NGram> &ngrams,
+                          const NGramQuery &q);
+};
+}
+
+#endif  // SRC_NGRAM_QUERY_H_
@@ -2,39 +2,106 @@
 // Copyright 2012, Evan Klitzke <evan@eklitzke.org>
 
 #include "./ngram_table_reader.h"
+#include "./posting_list.h"
+
+#include <boost/filesystem.hpp>
 
 #include <sstream>
 
 namespace {
 std::string NameForShard(const std::string &index_directory,
-                         std::size_t shard_num) {
+                         const std::string &table,
+                         std::size_t shard_num,
+                         const std::string &ext = "sst") {
   std::stringstream reader_name;
-  reader_name << index_directory << "/ngrams/shard_" << shard_num
-              << ".sst";
+  reader_name << index_directory << "/" << table << "/shard_" << shard_num
+              << "." << ext;
   return reader_name.str();
 }
+
+// The number of lines in a decoded list; the ids of a FILE_POSTINGS
+// list are files, and its payloads are their lines
+std::size_t CountLines(codesearch::SSTableHeader_ValueFormat format,
+                       const codesearch::DecodedPostingList &list) {
+  if (format == codesearch::SSTableHeader_ValueFormat_FILE_POSTINGS) {
+    return list.payloads.size();
+  }
+  return list.ids.size();
+}
 }
 
 namespace codesearch {
 NGramTableReader::NGramTableReader(const std::string &index_directory,
+                                   const std::string &table,
                                    std::size_t shard_num,
+                                   std::size_t cache_table,
                                    std::size_t savepoints)
-    :reader_(NameForShard(index_directory, shard_num)) {
-  name_ = NameForShard(index_directory, shard_num);
+    :reader_(NameForShard(index_directory, table, shard_num)),
+     shard_num_(shard_num), cache_table_(cache_table), dict_(nullptr),
+     stats_(nullptr) {
+  name_ = NameForShard(index_directory, table, shard_num);
   assert(reader_.hdr().index_offset() < 1024);
-  FrozenMapBuilder<NGram, std::size_t> builder;
   std::size_t num_keys = reader_.num_keys();
-  for (std::size_t i = 0; i < savepoints; i++) {
-    std::size_t offset = i * num_keys / savepoints;
-    assert(offset < num_keys);
-    auto it = reader_.begin() + offset;
-    builder.insert(*it, offset);
+
+  // Small shards are written with their keys in Eytzinger order
+  // instead of with a dictionary, and shards written before either of
+  // them existed are searched from savepoints
+  const std::string dict_name = NameForShard(index_directory, table,
+                                             shard_num, "dict");
+  if (boost::filesystem::exists(dict_name)) {
+    std::pair<std::size_t, const char *> dict = GetMmapForFile(dict_name);
+    assert(dict.first == (NGram::num_prefixes + 1) * sizeof(std::uint32_t));
+    dict_ = dict.second;
+    assert(ReadUint32(dict_ + NGram::num_prefixes * sizeof(std::uint32_t)) ==
+           num_keys);
+  } else if (!reader_.has_eytzinger()) {
+    FrozenMapBuilder<NGram, std::size_t> builder;
+    for (std::size_t i = 0; i < savepoints; i++) {
+      std::size_t offset = i * num_keys / savepoints;
+      assert(offset < num_keys);
+      auto it = reader_.begin() + offset;
+      builder.insert(*it, offset);
+    }
+    savepoints_ = builder;
+  }
+
+  const std::string stats_name = NameForShard(index_directory, table,
+                                              shard_num, "stats");
+  if (boost::filesystem::exists(stats_name)) {
+    std::pair<std::size_t, const char *> stats = GetMmapForFile(stats_name);
+    assert(stats.first == num_keys * sizeof(std::uint32_t));
+    stats_ = stats.second;
+  }
+
+  const std::string filter_name = NameForShard(index_directory, table,
+                                               shard_num, "filter");
+  if (boost::filesystem::exists(filter_name)) {
+    std::pair<std::size_t, const char *> filter = GetMmapForFile(filter_name);
+    filter_ = NGramFilter(filter.second, filter.first);
   }
-  savepoints_ = builder;
 }
 
-bool NGramTableReader::Find(const NGram &ngram,
-                            std::vector<std::uint64_t> *candidates) const {
+bool NGramTableReader::Lookup(const NGram &ngram,
+                              SSTableReader<NGram>::iterator *pos) const {
+  if (!filter_.MayContain(ngram)) {
+    return false;
+  }
+  if (dict_ != nullptr) {
+    // The keys with the ngram's prefix are between two entries of the
+    // dictionary, and there are at most 256 of them
+    const char *entry = dict_ + ngram.prefix() * sizeof(std::uint32_t);
+    const SSTableReader<NGram>::iterator lower =
+        reader_.begin() + ReadUint32(entry);
+    const SSTableReader<NGram>::iterator upper =
+        reader_.begin() + ReadUint32(entry + sizeof(std::uint32_t));
+    *pos = reader_.lower_bound(lower, upper, ngram);
+    return *pos != upper && **pos == ngram;
+  }
+  if (reader_.has_eytzinger()) {
+    *pos = reader_.lower_bound(ngram);
+    return *pos != reader_.end() && **pos == ngram;
+  }
+
   auto lo = savepoints_.lower_bound(ngram);
   auto hi = lo;
   if (lo == savepoints_.end()) {
@@ -49,29 +116,124 @@ bool NGramTableReader::Find(const NGram &ngram,
   assert(lo->first <= ngram);
 
   SSTableReader<NGram>::iterator lower = reader_.begin() + lo->second;
-  SSTableReader<NGram>::iterator pos;
 
   if (hi == savepoints_.end()) {
     // edge case, lo was the last entry in savepoints_
-    pos = reader_.lower_bound(lower, reader_.end(), ngram);
+    *pos = reader_.lower_bound(lower, reader_.end(), ngram);
   } else {
     assert(hi->first > ngram);
     SSTableReader<NGram>::iterator upper = reader_.begin() + hi->second;
     assert(lower.reader() == upper.reader());
-    pos = reader_.lower_bound(lower, upper, ngram);
+    *pos = reader_.lower_bound(lower, upper, ngram);
+  }
+  return *pos != reader_.end() && **pos == ngram;
+}
+
+std::size_t NGramTableReader::Count(
+    const NGram &ngram, PostingCache *cache,
+    std::shared_ptr<const DecodedPostingList> *cached) const {
+  const SSTableHeader_ValueFormat format = reader_.hdr().value_format();
+  std::shared_ptr<const DecodedPostingList> list;
+  if (cache != nullptr) {
+    list = cache->Find(cache_table_, ngram);
+    if (cached != nullptr) {
+      *cached = list;
+    }
+    if (list != nullptr && list->ids.empty()) {
+      return 0;
+    }
+  }
+
+  SSTableReader<NGram>::iterator pos;
+  if (!Lookup(ngram, &pos)) {
+    if (cache != nullptr) {
+      list = std::make_shared<const DecodedPostingList>();
+      cache->Insert(cache_table_, ngram, list);
+      if (cached != nullptr) {
+        *cached = list;
+      }
+    }
+    return 0;
+  }
+  if (stats_ != nullptr) {
+    return ReadUint32(stats_ + pos.offset() * sizeof(std::uint32_t));
+  } else if (list != nullptr) {
+    return CountLines(format, *list);
   }
 
-  if (pos == reader_.end() || *pos != ngram) {
+  if (format == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+    // the size of the list is the number of files, so the lines are
+    // counted from the payloads
+    std::pair<const char *, std::uint32_t> val = pos.value();
+    DecodedPostingList decoded;
+    DecodePostingList(format, val.first, val.second, &decoded);
+    return CountLines(format, decoded);
+  } else if (format != SSTableHeader_ValueFormat_PROTOBUF) {
+    return PostingListSize(format, pos.value().first);
+  }
+  NGramValue val;
+  pos.parse_protobuf(&val);
+  return val.position_ids_size();
+}
+
+bool NGramTableReader::Find(
+    const NGram &ngram, PostingIterator *postings, PostingCache *cache,
+    const std::shared_ptr<const DecodedPostingList> *cached) const {
+  if (cache != nullptr) {
+    const std::shared_ptr<const DecodedPostingList> list =
+        cached != nullptr ? *cached : cache->Find(cache_table_, ngram);
+    if (list != nullptr) {
+      // an empty list means that the ngram isn't in the shard
+      if (list->ids.empty()) {
+        return false;
+      }
+      postings->Reset(list);
+      return true;
+    }
+  }
+
+  SSTableReader<NGram>::iterator pos;
+  if (!Lookup(ngram, &pos)) {
+    if (cache != nullptr) {
+      cache->Insert(cache_table_, ngram,
+                    std::make_shared<const DecodedPostingList>());
+    }
     return false;
   }
 
+  const SSTableHeader_ValueFormat format = reader_.hdr().value_format();
+  if (format != SSTableHeader_ValueFormat_PROTOBUF) {
+    std::pair<const char *, std::uint32_t> val = pos.value();
+    postings->Reset(format, val.first, val.second);
+    if (cache != nullptr &&
+        cache->Admits(postings->size() * sizeof(std::uint64_t))) {
+      std::shared_ptr<DecodedPostingList> list(new DecodedPostingList);
+      DecodePostingList(format, val.first, val.second, list.get());
+      cache->Insert(cache_table_, ngram, list);
+      postings->Reset(list);
+    }
+    return true;
+  }
+
+  // This is an index written before block posting lists were added,
+  // where each value is an NGramValue protobuf.
   NGramValue val;
   pos.parse_protobuf(&val);
   assert(val.position_ids_size() > 0);
+  std::vector<std::uint64_t> candidates;
+  candidates.reserve(val.position_ids_size());
   std::uint64_t posting_val = 0;
   for (const auto &delta : val.position_ids()) {
     posting_val += delta;
-    candidates->push_back(posting_val);
+    candidates.push_back(posting_val);
+  }
+  if (cache != nullptr) {
+    std::shared_ptr<DecodedPostingList> list(new DecodedPostingList);
+    std::swap(list->ids, candidates);
+    cache->Insert(cache_table_, ngram, list);
+    postings->Reset(list);
+  } else {
+    postings->Reset(&candidates);
   }
   return true;
 }
@@ -4,30 +4,89 @@
 #ifndef SRC_NGRAM_TABLE_READER_H_
 #define SRC_NGRAM_TABLE_READER_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "./frozen_map.h"
 #include "./ngram.h"
+#include "./ngram_filter.h"
+#include "./posting_cache.h"
+#include "./posting_list.h"
 #include "./sstable_reader.h"
 
 namespace codesearch {
 class NGramTableReader {
  public:
+  // Open a shard of the ngram index named table, e.g. "ngrams". Its
+  // posting lists are cached under cache_table, which must be
+  // different for each shard of each ngram index. Shards that have
+  // neither a dictionary nor their keys in Eytzinger order are
+  // searched from savepoints keys instead.
   NGramTableReader(const std::string &index_directory,
+                   const std::string &table,
                    std::size_t shard_num,
+                   std::size_t cache_table,
                    std::size_t savepoints = 64);
 
-  bool Find(const NGram &ngram,
-            std::vector<std::uint64_t> *candidates) const;
+  // Find the posting list for an ngram, and reset the iterator to
+  // point at the start of it. Returns false if the ngram isn't in the
+  // shard. If cache isn't null, the decoded list is looked up there
+  // first, and lists that have to be read from the shard are decoded
+  // and added to it (as are ngrams that aren't in the shard, as empty
+  // lists). If cached isn't null, it's what Count() found for the
+  // ngram in the same cache, and the cache isn't searched again.
+  bool Find(const NGram &ngram, PostingIterator *postings,
+            PostingCache *cache = nullptr,
+            const std::shared_ptr<const DecodedPostingList> *cached =
+            nullptr) const;
+
+  // The number of lines in the shard that have an ngram, or 0 if the
+  // ngram isn't in the shard. This comes from the shard's stats, and
+  // doesn't read the posting list; shards written without stats count
+  // the lines of the list instead. If cache and cached aren't null,
+  // cached is set to the list for the ngram in the cache, or to
+  // nullptr if it isn't there, so that it can be handed to Find().
+  std::size_t Count(const NGram &ngram, PostingCache *cache = nullptr,
+                    std::shared_ptr<const DecodedPostingList> *cached =
+                    nullptr) const;
+
+  // Returns false if the ngram definitely isn't in the shard, which is
+  // checked with the shard's filter, without searching the shard
+  bool MayContain(const NGram &ngram) const {
+    return filter_.MayContain(ngram);
+  }
 
   std::string shard_name() const { return reader_.shard_name(); }
+  std::size_t shard_num() const { return shard_num_; }
+
+  SSTableHeader_ValueFormat value_format() const {
+    return reader_.hdr().value_format();
+  }
 
  private:
   SSTableReader<NGram> reader_;
   std::string name_;
+  std::size_t shard_num_;
+  std::size_t cache_table_;
   //FrozenMap<NGram, SSTableReader<NGram>::iterator> savepoints_;
   FrozenMap<NGram, std::size_t> savepoints_;
+
+  // The "dict" file of the shard, which has the index of the first key
+  // with each two byte prefix as a 4-byte BE integer, or nullptr if
+  // the shard doesn't have one
+  const char *dict_;
+
+  // The "stats" file of the shard, which has a 4-byte BE line count
+  // for each key, or nullptr if the shard doesn't have one
+  const char *stats_;
+
+  // The filter of the ngrams in the shard, which is empty if the shard
+  // doesn't have a "filter" file
+  NGramFilter filter_;
+
+  // Find the key for an ngram, returning false if it isn't there
+  bool Lookup(const NGram &ngram, SSTableReader<NGram>::iterator *pos) const;
 };
 }
 
@@ -0,0 +1,50 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// A memory-bounded cache of decoded posting lists, keyed by the shard
+// of the ngram index (see NGramTableReader) and the ngram. The query
+// mix tends to be very skewed towards a small set of ngrams, so one
+// cache is shared by all of the readers of an index (see
+// Context::posting_cache()), which saves decoding the same hot posting
+// lists over and over. See clock_cache.h for how entries are evicted.
+
+#ifndef SRC_POSTING_CACHE_H_
+#define SRC_POSTING_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+
+#include "./clock_cache.h"
+#include "./ngram.h"
+#include "./posting_list.h"
+
+namespace codesearch {
+class PostingCache : public ClockCache<DecodedPostingList> {
+ public:
+  explicit PostingCache(std::size_t max_bytes, std::size_t num_shards = 16)
+      :ClockCache<DecodedPostingList>(max_bytes, num_shards) {}
+
+  // Look up the posting list of an ngram in a shard of an ngram
+  // index. Returns a null pointer on a miss. Callers may cache empty
+  // lists, to remember that an ngram isn't in a shard.
+  std::shared_ptr<const DecodedPostingList> Find(std::size_t table,
+                                                 const NGram &ngram) {
+    return ClockCache<DecodedPostingList>::Find(Key(table, ngram));
+  }
+
+  // Add a posting list to the cache, evicting other lists to make room
+  // for it. Lists that aren't admitted are ignored.
+  void Insert(std::size_t table, const NGram &ngram,
+              const std::shared_ptr<const DecodedPostingList> &list) {
+    ClockCache<DecodedPostingList>::Insert(Key(table, ngram), list,
+                                           list->ByteSize());
+  }
+
+ private:
+  inline std::uint64_t Key(std::size_t table, const NGram &ngram) const {
+    return static_cast<std::uint64_t>(table) << 32 | ngram.num();
+  }
+};
+}
+
+#endif  // SRC_POSTING_CACHE_H_
@@ -0,0 +1,1011 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./posting_list.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+
+#include <endian.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "./intersect.h"
+#include "./util.h"
+
+namespace {
+const std::size_t lanes = 4;
+const std::size_t vectors_per_block = codesearch::posting_block_size / lanes;
+
+static_assert(codesearch::posting_block_size % lanes == 0,
+              "posting blocks must be a whole number of registers");
+
+// The number of bits needed to represent val
+inline std::uint8_t BitWidth(std::uint32_t val) {
+  return val ? 32 - __builtin_clz(val) : 0;
+}
+
+// The first byte of each container in a HYBRID_POSTINGS list
+enum class ContainerType : std::uint8_t {
+  PACKED = 0,
+  VARINT = 1,
+  BITMAP = 2
+};
+
+inline void AppendContainerType(ContainerType type, std::string *out) {
+  out->push_back(static_cast<char>(type));
+}
+
+inline std::uint64_t BitmapWord(const char *words, std::size_t i) {
+  std::uint64_t word;
+  memcpy(&word, words + i * sizeof(word), sizeof(word));
+  return le64toh(word);
+}
+
+inline bool TestBit(const char *words, std::size_t bit) {
+  return (BitmapWord(words, bit / 64) >> (bit % 64)) & 1;
+}
+
+void AppendVarint(std::uint64_t val, std::string *out) {
+  while (val >= 0x80) {
+    out->push_back(static_cast<char>((val & 0x7f) | 0x80));
+    val >>= 7;
+  }
+  out->push_back(static_cast<char>(val));
+}
+
+inline std::uint64_t ReadVarint(const char **data) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(*data);
+  std::uint64_t val = 0;
+  for (unsigned shift = 0; ; shift += 7) {
+    val |= static_cast<std::uint64_t>(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) {
+      break;
+    }
+  }
+  *data = reinterpret_cast<const char *>(p);
+  return val;
+}
+
+// Get the HYBRID_POSTINGS list at the start of a list with payloads,
+// and its size
+inline const char* PayloadListPostings(const char *data,
+                                       std::size_t *postings_size) {
+  *postings_size = ReadVarint(&data);
+  return data;
+}
+
+// Read the header of a HYBRID_POSTINGS list, returning a pointer to
+// its skip entries. A list of fewer than posting_block_size ids can't
+// have any containers, so it's just a tail, and its header is only
+// the count.
+inline const char* ReadHybridHeader(const char *data, std::size_t *count,
+                                    std::size_t *num_containers) {
+  *count = ReadVarint(&data);
+  *num_containers = 0;
+  if (*count >= codesearch::posting_block_size) {
+    *num_containers = ReadVarint(&data);
+  }
+  return data;
+}
+
+// Read the size of the tail of a HYBRID_POSTINGS list with count ids,
+// moving data past it. A list that's just a tail doesn't store it.
+inline std::size_t ReadTailSize(const char **data, std::size_t count) {
+  if (count < codesearch::posting_block_size) {
+    return count;
+  }
+  return static_cast<std::uint8_t>(*(*data)++);
+}
+
+// Pack a block of ids into the output string (see the comment in
+// posting_list.h for a description of the layout).
+void EncodeBlock(const std::uint64_t *ids, std::string *out) {
+  const std::uint64_t base = ids[0];
+  std::uint32_t deltas[codesearch::posting_block_size];
+  std::uint8_t bits = 0;
+  for (std::size_t i = 0; i < codesearch::posting_block_size; i++) {
+    assert(ids[i] - base <= UINT32_MAX);
+    std::uint32_t off = static_cast<std::uint32_t>(ids[i] - base);
+    if (i >= lanes) {
+      off -= static_cast<std::uint32_t>(ids[i - lanes] - base);
+    }
+    deltas[i] = off;
+    bits = std::max(bits, BitWidth(off));
+  }
+
+  out->append(codesearch::Uint64ToString(base));
+  out->push_back(static_cast<char>(bits));
+  if (!bits) {
+    return;
+  }
+
+  std::uint32_t words[lanes * 32] = {0};
+  for (std::size_t lane = 0; lane < lanes; lane++) {
+    std::size_t bit_pos = 0;
+    for (std::size_t i = 0; i < vectors_per_block; i++) {
+      const std::uint32_t delta = deltas[i * lanes + lane];
+      const std::size_t word = bit_pos / 32;
+      const std::size_t shift = bit_pos % 32;
+      words[word * lanes + lane] |= delta << shift;
+      if (shift + bits > 32) {
+        words[(word + 1) * lanes + lane] |= delta >> (32 - shift);
+      }
+      bit_pos += bits;
+    }
+  }
+  for (std::size_t i = 0; i < lanes * bits; i++) {
+    const std::uint32_t le_word = htole32(words[i]);
+    out->append(reinterpret_cast<const char *>(&le_word), sizeof(le_word));
+  }
+}
+
+// Encode the ids in the span starting at base as a bitmap container
+void EncodeBitmap(const std::uint64_t *ids, std::size_t count,
+                  std::uint64_t base, std::string *out) {
+  std::uint64_t words[codesearch::posting_bitmap_words] = {0};
+  for (std::size_t i = 0; i < count; i++) {
+    const std::uint64_t bit = ids[i] - base;
+    assert(bit < codesearch::posting_bitmap_span);
+    words[bit / 64] |= static_cast<std::uint64_t>(1) << (bit % 64);
+  }
+  AppendContainerType(ContainerType::BITMAP, out);
+  out->append(codesearch::Uint64ToString(base));
+  for (std::size_t i = 0; i < codesearch::posting_bitmap_words; i++) {
+    const std::uint64_t le_word = htole64(words[i]);
+    out->append(reinterpret_cast<const char *>(&le_word), sizeof(le_word));
+  }
+}
+
+// The index of the first id in ids[i, size) that is past the span
+// holding ids[i]
+inline std::size_t SpanEnd(const std::vector<std::uint64_t> &ids,
+                           std::size_t i) {
+  const std::uint64_t span_end = (ids[i] / codesearch::posting_bitmap_span +
+                                  1) * codesearch::posting_bitmap_span;
+  return std::lower_bound(ids.begin() + i, ids.end(), span_end) -
+      ids.begin();
+}
+
+#ifdef __SSE2__
+// Unpack and prefix sum a block of Bits-wide deltas. Since Bits is a
+// template parameter the shifts and the word loads are all resolved at
+// compile time, and the compiler fully unrolls the loop.
+template <unsigned Bits>
+void DecodeBlockKernel(const char *data, std::uint64_t base,
+                       std::uint64_t *out) {
+  const __m128i *in = reinterpret_cast<const __m128i *>(data);
+  const __m128i mask = _mm_set1_epi32(
+      Bits == 32 ? -1 : static_cast<int>((1U << Bits) - 1));
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i base_vec = _mm_set1_epi64x(static_cast<long long>(base));
+
+  __m128i acc = zero;
+  __m128i word = Bits ? _mm_loadu_si128(in) : zero;
+  unsigned shift = 0;
+  for (std::size_t i = 0; i < vectors_per_block; i++) {
+    __m128i val = _mm_srli_epi32(word, shift);
+    shift += Bits;
+    if (shift >= 32) {
+      shift -= 32;
+      if (i != vectors_per_block - 1) {
+        word = _mm_loadu_si128(++in);
+      }
+      if (shift) {
+        val = _mm_or_si128(val, _mm_slli_epi32(word, Bits - shift));
+      }
+    }
+    acc = _mm_add_epi32(acc, _mm_and_si128(val, mask));
+
+    // widen the four 32-bit offsets to 64 bits, and add the base
+    __m128i lo = _mm_add_epi64(_mm_unpacklo_epi32(acc, zero), base_vec);
+    __m128i hi = _mm_add_epi64(_mm_unpackhi_epi32(acc, zero), base_vec);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * lanes), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * lanes + 2), hi);
+  }
+}
+#else
+template <unsigned Bits>
+void DecodeBlockKernel(const char *data, std::uint64_t base,
+                       std::uint64_t *out) {
+  const std::uint32_t mask = Bits == 32 ? UINT32_MAX : (1U << Bits) - 1;
+  for (std::size_t lane = 0; lane < lanes; lane++) {
+    std::uint32_t acc = 0;
+    std::size_t bit_pos = 0;
+    for (std::size_t i = 0; i < vectors_per_block; i++) {
+      std::uint32_t val = 0;
+      if (Bits) {
+        const std::size_t word = bit_pos / 32;
+        const std::size_t shift = bit_pos % 32;
+        std::uint32_t w;
+        memcpy(&w, data + (word * lanes + lane) * sizeof(w), sizeof(w));
+        val = le32toh(w) >> shift;
+        if (shift + Bits > 32) {
+          memcpy(&w, data + ((word + 1) * lanes + lane) * sizeof(w),
+                 sizeof(w));
+          val |= le32toh(w) << (32 - shift);
+        }
+      }
+      acc += val & mask;
+      out[i * lanes + lane] = base + acc;
+      bit_pos += Bits;
+    }
+  }
+}
+#endif
+
+// Intersect the sorted candidates with the ids in list that fall in
+// the candidates' range, leaving the result in candidates. Afterwards
+// the list is positioned after the last of the original candidates
+// (or is exhausted).
+void IntersectCandidates(codesearch::PostingIterator *list, bool gallop,
+                         std::vector<std::uint64_t> *candidates,
+                         std::vector<std::uint64_t> *scratch) {
+  assert(!candidates->empty());
+  const std::uint64_t hi = candidates->back();
+  scratch->clear();
+
+  if (gallop) {
+    for (const auto &candidate : *candidates) {
+      if (!list->advance_to(candidate)) {
+        break;
+      }
+      if (list->value() == candidate) {
+        scratch->push_back(candidate);
+      }
+    }
+    list->advance_to(hi + 1);
+    std::swap(*candidates, *scratch);
+    return;
+  }
+
+  const std::uint64_t *a = candidates->data();
+  const std::uint64_t *a_end = a + candidates->size();
+  scratch->resize(candidates->size());
+  std::size_t found = 0;
+  if (list->advance_to(*a)) {
+    while (a != a_end) {
+      if (const char *words = list->bitmap()) {
+        // test the candidates in the bitmap's span directly
+        const std::uint64_t base = list->bitmap_base();
+        const std::uint64_t last = base + codesearch::posting_bitmap_span - 1;
+        for (; a != a_end && *a <= last; ++a) {
+          if (*a >= base && TestBit(words, *a - base)) {
+            (*scratch)[found++] = *a;
+          }
+        }
+        if (last > hi) {
+          list->advance_to(hi + 1);
+          break;
+        }
+        if (!list->next_block()) {
+          break;
+        }
+        continue;
+      }
+
+      const std::uint64_t *b = list->block_begin();
+      const std::uint64_t *b_end = list->block_end();
+      const std::uint64_t b_max = *(b_end - 1);
+      found += codesearch::IntersectSorted(
+          a, a_end - a, b, b_end - b, scratch->data() + found);
+      a = std::upper_bound(a, a_end, b_max);
+      if (b_max > hi) {
+        list->advance_to(hi + 1);
+        break;
+      }
+      if (!list->next_block()) {
+        break;
+      }
+    }
+  }
+  scratch->resize(found);
+  std::swap(*candidates, *scratch);
+}
+
+// AND the ids of list that are in the span starting at base into the
+// bitmap, leaving the list positioned after the span (or exhausted).
+void IntersectBitmap(codesearch::PostingIterator *list, std::uint64_t base,
+                     std::uint64_t *bits) {
+  const std::uint64_t last = base + codesearch::posting_bitmap_span - 1;
+  if (list->advance_to(base) && list->bitmap() != nullptr &&
+      list->bitmap_base() == base) {
+    const char *words = list->bitmap();
+    for (std::size_t i = 0; i < codesearch::posting_bitmap_words; i++) {
+      bits[i] &= BitmapWord(words, i);
+    }
+    list->next_block();
+    return;
+  }
+
+  // The list stores this span in array containers (if it has any ids
+  // in it at all), so build a bitmap of its ids in the span.
+  std::uint64_t present[codesearch::posting_bitmap_words] = {0};
+  while (list->valid() && list->value() <= last) {
+    assert(list->bitmap() == nullptr);
+    const std::uint64_t *b = list->block_begin();
+    const std::uint64_t *b_end = list->block_end();
+    for (; b != b_end && *b <= last; ++b) {
+      const std::uint64_t bit = *b - base;
+      present[bit / 64] |= static_cast<std::uint64_t>(1) << (bit % 64);
+    }
+    if (b != b_end) {
+      list->advance_to(last + 1);
+      break;
+    }
+    if (!list->next_block()) {
+      break;
+    }
+  }
+  for (std::size_t i = 0; i < codesearch::posting_bitmap_words; i++) {
+    bits[i] &= present[i];
+  }
+}
+
+typedef void (*DecodeBlockFunc)(const char *, std::uint64_t, std::uint64_t *);
+
+template <unsigned... Bits>
+struct KernelTable {
+  static const DecodeBlockFunc table[sizeof...(Bits)];
+};
+
+template <unsigned... Bits>
+const DecodeBlockFunc KernelTable<Bits...>::table[sizeof...(Bits)] = {
+  &DecodeBlockKernel<Bits>...
+};
+
+typedef KernelTable<0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28,
+                    29, 30, 31, 32> DecodeKernels;
+
+// Decode the full block at data, returning a pointer to the end of
+// the block.
+inline const char* DecodeBlock(const char *data, std::uint64_t *out) {
+  const std::uint64_t base = codesearch::ReadUint64(data);
+  const std::uint8_t bits = static_cast<std::uint8_t>(data[8]);
+  assert(bits <= 32);
+  data += sizeof(std::uint64_t) + 1;
+  DecodeKernels::table[bits](data, base, out);
+  return data + lanes * sizeof(std::uint32_t) * bits;
+}
+
+// Decode count varint deltas starting from last_val, returning a
+// pointer to the end of the encoded data.
+inline const char* DecodeTail(const char *data, std::size_t count,
+                              std::uint64_t last_val, std::uint64_t *out) {
+  for (std::size_t i = 0; i < count; i++) {
+    last_val += ReadVarint(&data);
+    out[i] = last_val;
+  }
+  return data;
+}
+
+// Decode a HYBRID_POSTINGS container, setting count to the number of
+// ids written to out, and returning a pointer to the end of the
+// container.
+const char* DecodeContainer(const char *data, std::uint64_t *out,
+                            std::size_t *count) {
+  const ContainerType type = static_cast<ContainerType>(*data++);
+  switch (type) {
+    case ContainerType::PACKED:
+      *count = codesearch::posting_block_size;
+      return DecodeBlock(data, out);
+    case ContainerType::VARINT:
+      *count = static_cast<std::uint8_t>(*data++);
+      assert(*count > 0 && *count < codesearch::posting_block_size);
+      out[0] = codesearch::ReadUint64(data);
+      return DecodeTail(data + sizeof(std::uint64_t), *count - 1, out[0],
+                        out + 1);
+    case ContainerType::BITMAP: {
+      const std::uint64_t base = codesearch::ReadUint64(data);
+      data += sizeof(std::uint64_t);
+      *count = 0;
+      for (std::size_t i = 0; i < codesearch::posting_bitmap_words; i++) {
+        std::uint64_t word = BitmapWord(data, i);
+        while (word) {
+          out[(*count)++] = base + i * 64 + __builtin_ctzll(word);
+          word &= word - 1;
+        }
+      }
+      return data + codesearch::posting_bitmap_words * sizeof(std::uint64_t);
+    }
+  }
+  assert(false);
+  return data;
+}
+
+// Returns a pointer to the end of a HYBRID_POSTINGS container, without
+// decoding it.
+const char* ContainerEnd(const char *data) {
+  const ContainerType type = static_cast<ContainerType>(*data++);
+  switch (type) {
+    case ContainerType::PACKED: {
+      const std::uint8_t bits = static_cast<std::uint8_t>(data[8]);
+      return data + sizeof(std::uint64_t) + 1 +
+          lanes * sizeof(std::uint32_t) * bits;
+    }
+    case ContainerType::VARINT: {
+      const std::size_t count = static_cast<std::uint8_t>(*data++);
+      data += sizeof(std::uint64_t);
+      for (std::size_t i = 1; i < count; i++) {
+        ReadVarint(&data);
+      }
+      return data;
+    }
+    case ContainerType::BITMAP:
+      return data + sizeof(std::uint64_t) +
+          codesearch::posting_bitmap_words * sizeof(std::uint64_t);
+  }
+  assert(false);
+  return data;
+}
+}
+
+namespace codesearch {
+void EncodePostingList(const std::vector<std::uint64_t> &ids,
+                       std::string *out,
+                       std::vector<std::size_t> *container_starts) {
+  assert(ids.size() <= UINT32_MAX);
+
+  // The containers are encoded first, so that the skip entries can be
+  // written with the container offsets in front of them.
+  std::string skips;
+  std::string containers;
+  std::size_t num_containers = 0;
+  auto add_skip = [&](std::size_t first, std::size_t last,
+                      std::size_t offset) {
+    assert(offset <= UINT32_MAX);
+    if (container_starts != nullptr) {
+      container_starts->push_back(first);
+    }
+    skips.append(Uint64ToString(ids[last]));
+    skips.append(Uint32ToString(offset));
+    num_containers++;
+  };
+
+  std::size_t i = 0;
+  while (i < ids.size()) {
+    // Find the run of sparse spans starting at i; if there isn't one,
+    // the span at i is dense and is stored as a bitmap.
+    std::size_t run_end = i;
+    while (run_end < ids.size()) {
+      const std::size_t span_end = SpanEnd(ids, run_end);
+      if (span_end - run_end >= posting_bitmap_min_ids) {
+        break;
+      }
+      run_end = span_end;
+    }
+    if (run_end == i) {
+      const std::size_t span_end = SpanEnd(ids, i);
+      add_skip(i, span_end - 1, containers.size());
+      EncodeBitmap(ids.data() + i, span_end - i,
+                   ids[i] - ids[i] % posting_bitmap_span, &containers);
+      i = span_end;
+      continue;
+    }
+
+    // The run is stored as packed containers, and any leftover ids go
+    // in a varint container (or in the tail, at the end of the list).
+    for (; i + posting_block_size <= run_end; i += posting_block_size) {
+      add_skip(i, i + posting_block_size - 1, containers.size());
+      AppendContainerType(ContainerType::PACKED, &containers);
+      EncodeBlock(ids.data() + i, &containers);
+    }
+    if (run_end == ids.size()) {
+      break;
+    }
+    if (i < run_end) {
+      add_skip(i, run_end - 1, containers.size());
+      AppendContainerType(ContainerType::VARINT, &containers);
+      containers.push_back(static_cast<char>(run_end - i));
+      containers.append(Uint64ToString(ids[i]));
+      for (std::size_t j = i + 1; j < run_end; j++) {
+        AppendVarint(ids[j] - ids[j - 1], &containers);
+      }
+      i = run_end;
+    }
+  }
+
+  // Lists that are just a tail leave out the number of containers and
+  // the size of the tail, since they're both implied by the count.
+  AppendVarint(ids.size(), out);
+  if (ids.size() >= posting_block_size) {
+    AppendVarint(num_containers, out);
+  } else {
+    assert(num_containers == 0);
+  }
+  out->append(skips);
+  out->append(containers);
+
+  // The rest of the ids are the tail of the list
+  assert(ids.size() - i < posting_block_size);
+  if (container_starts != nullptr) {
+    container_starts->push_back(i);
+  }
+  if (ids.size() >= posting_block_size) {
+    out->push_back(static_cast<char>(ids.size() - i));
+  }
+  std::uint64_t last_val = i ? ids[i - 1] : 0;
+  for (; i < ids.size(); i++) {
+    AppendVarint(ids[i] - last_val, out);
+    last_val = ids[i];
+  }
+}
+
+void EncodePayloadPostingList(
+    const std::vector<std::uint64_t> &ids,
+    const std::vector<std::vector<std::uint32_t> > &payloads,
+    std::string *out) {
+  assert(ids.size() == payloads.size());
+  std::string postings;
+  std::vector<std::size_t> container_starts;
+  EncodePostingList(ids, &postings, &container_starts);
+  AppendVarint(postings.size(), out);
+  out->append(postings);
+
+  // The first container's payloads start at 0, so it has no entry
+  std::string encoded_payloads;
+  std::size_t container = 0;
+  for (std::size_t i = 0; i < ids.size(); i++) {
+    for (; container < container_starts.size() &&
+             container_starts[container] == i; container++) {
+      assert(encoded_payloads.size() <= UINT32_MAX);
+      if (container > 0) {
+        out->append(Uint32ToString(encoded_payloads.size()));
+      }
+    }
+    AppendVarint(payloads[i].size(), &encoded_payloads);
+    std::uint32_t last_val = 0;
+    for (const auto &val : payloads[i]) {
+      assert(val >= last_val);
+      AppendVarint(val - last_val, &encoded_payloads);
+      last_val = val;
+    }
+  }
+  // an empty tail still has an entry
+  for (; container < container_starts.size(); container++) {
+    if (container > 0) {
+      out->append(Uint32ToString(encoded_payloads.size()));
+    }
+  }
+  out->append(encoded_payloads);
+}
+
+void DecodePostingList(SSTableHeader_ValueFormat format,
+                       const char *data, std::size_t size,
+                       std::vector<std::uint64_t> *out) {
+  if (format == SSTableHeader_ValueFormat_POSITIONAL_POSTINGS ||
+      format == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+    std::size_t postings_size;
+    const char *postings = PayloadListPostings(data, &postings_size);
+    assert(postings + postings_size <= data + size);
+    DecodePostingList(SSTableHeader_ValueFormat_HYBRID_POSTINGS,
+                      postings, postings_size, out);
+    return;
+  }
+  const char *end = data + size;
+  if (format == SSTableHeader_ValueFormat_HYBRID_POSTINGS) {
+    std::size_t count, num_containers;
+    data = ReadHybridHeader(data, &count, &num_containers);
+    const std::size_t start = out->size();
+    out->resize(start + count);
+    std::uint64_t *ids = out->data() + start;
+
+    data += num_containers * posting_skip_size;
+    for (std::size_t i = 0; i < num_containers; i++) {
+      std::size_t container_size;
+      data = DecodeContainer(data, ids, &container_size);
+      ids += container_size;
+    }
+    const std::size_t tail_size = ReadTailSize(&data, count);
+    std::uint64_t last_val = num_containers ? *(ids - 1) : 0;
+    data = DecodeTail(data, tail_size, last_val, ids);
+    assert(ids + tail_size == out->data() + out->size());
+    assert(data <= end);
+    return;
+  }
+
+  assert(format == SSTableHeader_ValueFormat_BLOCK_POSTINGS ||
+         format == SSTableHeader_ValueFormat_SKIP_BLOCK_POSTINGS);
+  const std::size_t count = ReadUint32(data);
+  data += sizeof(std::uint32_t);
+
+  const std::size_t start = out->size();
+  out->resize(start + count);
+  std::uint64_t *ids = out->data() + start;
+  const std::size_t full_blocks = count / posting_block_size;
+  if (format == SSTableHeader_ValueFormat_SKIP_BLOCK_POSTINGS) {
+    data += full_blocks * posting_skip_size;
+  }
+  for (std::size_t i = 0; i < full_blocks; i++) {
+    data = DecodeBlock(data, ids);
+    ids += posting_block_size;
+  }
+
+  std::uint64_t last_val = full_blocks ? *(ids - 1) : 0;
+  data = DecodeTail(data, count - full_blocks * posting_block_size,
+                    last_val, ids);
+  assert(data <= end);
+}
+
+std::size_t PostingListSize(SSTableHeader_ValueFormat format,
+                            const char *data) {
+  if (format == SSTableHeader_ValueFormat_POSITIONAL_POSTINGS ||
+      format == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+    std::size_t postings_size;
+    data = PayloadListPostings(data, &postings_size);
+    format = SSTableHeader_ValueFormat_HYBRID_POSTINGS;
+  }
+  if (format == SSTableHeader_ValueFormat_HYBRID_POSTINGS) {
+    return ReadVarint(&data);
+  }
+  return ReadUint32(data);
+}
+
+void DecodePostingList(SSTableHeader_ValueFormat format,
+                       const char *data, std::size_t size,
+                       DecodedPostingList *out) {
+  out->ids.clear();
+  out->payload_starts.clear();
+  out->payloads.clear();
+  DecodePostingList(format, data, size, &out->ids);
+  if (format != SSTableHeader_ValueFormat_POSITIONAL_POSTINGS &&
+      format != SSTableHeader_ValueFormat_FILE_POSTINGS) {
+    return;
+  }
+
+  // The payloads are stored in the same order as the ids, after the
+  // table of where each container's payloads start.
+  std::size_t postings_size;
+  const char *postings = PayloadListPostings(data, &postings_size);
+  std::size_t count, num_containers;
+  ReadHybridHeader(postings, &count, &num_containers);
+  const char *p = postings + postings_size +
+      num_containers * sizeof(std::uint32_t);
+  out->payload_starts.reserve(out->ids.size() + 1);
+  for (std::size_t i = 0; i < out->ids.size(); i++) {
+    out->payload_starts.push_back(out->payloads.size());
+    std::uint32_t val = 0;
+    for (std::size_t count = ReadVarint(&p); count; count--) {
+      val += static_cast<std::uint32_t>(ReadVarint(&p));
+      out->payloads.push_back(val);
+    }
+  }
+  out->payload_starts.push_back(out->payloads.size());
+  assert(p <= data + size);
+}
+
+PostingIntersection::PostingIntersection(
+    const std::vector<PostingIterator*> &lists)
+    :lists_(lists), done_(false), pos_(0) {
+  assert(!lists.empty());
+  for (const auto &list : lists) {
+    gallop_.push_back(
+        list->size() > posting_gallop_ratio * lists.front()->size());
+  }
+}
+
+bool PostingIntersection::Fill() {
+  PostingIterator *lead = lists_.front();
+  buf_.clear();
+  pos_ = 0;
+  if (done_ || !lead->valid()) {
+    return false;
+  }
+
+  std::uint64_t next;
+  if (lead->bitmap() != nullptr) {
+    // Copy the rest of the lead's bitmap, and AND the other lists into
+    // it.
+    std::uint64_t bits[posting_bitmap_words];
+    const std::uint64_t base = lead->bitmap_base();
+    const std::size_t first_bit = lead->value() - base;
+    for (std::size_t i = 0; i < posting_bitmap_words; i++) {
+      bits[i] = BitmapWord(lead->bitmap(), i);
+    }
+    for (std::size_t i = 0; i < first_bit / 64; i++) {
+      bits[i] = 0;
+    }
+    bits[first_bit / 64] &= ~static_cast<std::uint64_t>(0) <<
+        (first_bit % 64);
+    for (std::size_t i = 1; i < lists_.size(); i++) {
+      IntersectBitmap(lists_[i], base, bits);
+    }
+    for (std::size_t i = 0; i < posting_bitmap_words; i++) {
+      std::uint64_t word = bits[i];
+      while (word) {
+        buf_.push_back(base + i * 64 + __builtin_ctzll(word));
+        word &= word - 1;
+      }
+    }
+    next = base + posting_bitmap_span;
+  } else {
+    buf_.assign(lead->block_begin(), lead->block_end());
+    next = buf_.back() + 1;
+    for (std::size_t i = 1; i < lists_.size() && !buf_.empty(); i++) {
+      IntersectCandidates(lists_[i], gallop_[i], &buf_, &scratch_);
+    }
+  }
+
+  // Every list is now positioned past the ids that were just checked;
+  // no id before the furthest of them can be in all of the lists, so
+  // the lead can skip straight there.
+  for (std::size_t i = 1; i < lists_.size(); i++) {
+    if (!lists_[i]->valid()) {
+      done_ = true;
+      return true;
+    }
+    next = std::max(next, lists_[i]->value());
+  }
+  lead->advance_to(next);
+  return true;
+}
+
+FilePostingIntersection::FilePostingIntersection(
+    const std::vector<PostingIterator*> &lists)
+    :files_(lists) {
+  for (const auto &list : lists) {
+    assert(list->has_payload());
+    payload_lists_.push_back(*list);
+  }
+}
+
+bool FilePostingIntersection::next(std::uint64_t *file_id,
+                                   std::vector<std::uint32_t> *ordinals) {
+  std::uint64_t file;
+  while (files_.next(&file)) {
+    for (std::size_t i = 0; i < payload_lists_.size(); i++) {
+      PostingIterator &list = payload_lists_[i];
+      list.advance_to(file);
+      assert(list.valid() && list.value() == file);
+      if (i == 0) {
+        list.payload(ordinals);
+        continue;
+      }
+      list.payload(&lines_);
+      scratch_.clear();
+      std::set_intersection(ordinals->begin(), ordinals->end(),
+                            lines_.begin(), lines_.end(),
+                            std::back_inserter(scratch_));
+      std::swap(*ordinals, scratch_);
+      if (ordinals->empty()) {
+        break;
+      }
+    }
+    if (!ordinals->empty()) {
+      *file_id = file;
+      return true;
+    }
+  }
+  return false;
+}
+
+void PostingIterator::Reset(SSTableHeader_ValueFormat format,
+                            const char *data, std::size_t size) {
+  block_ = 0;
+  pos_ = 0;
+  bitmap_ = nullptr;
+  payload_table_ = nullptr;
+  decoded_.reset();
+  block_ids_ = nullptr;
+  if (format == SSTableHeader_ValueFormat_POSITIONAL_POSTINGS ||
+      format == SSTableHeader_ValueFormat_FILE_POSTINGS) {
+    std::size_t postings_size;
+    data = PayloadListPostings(data, &postings_size);
+    Reset(SSTableHeader_ValueFormat_HYBRID_POSTINGS, data, postings_size);
+    payload_table_ = data + postings_size;
+    return;
+  }
+  if (format == SSTableHeader_ValueFormat_HYBRID_POSTINGS) {
+    hybrid_ = true;
+    skips_ = ReadHybridHeader(data, &count_, &num_blocks_);
+    blocks_ = skips_ + num_blocks_ * posting_skip_size;
+    LoadBlock(0);
+    return;
+  }
+  if (format != SSTableHeader_ValueFormat_SKIP_BLOCK_POSTINGS) {
+    // Without skip entries there's no way to find a block without
+    // decoding everything before it, so just decode the whole list.
+    std::vector<std::uint64_t> ids;
+    DecodePostingList(format, data, size, &ids);
+    Reset(&ids);
+    return;
+  }
+  hybrid_ = false;
+  count_ = ReadUint32(data);
+  num_blocks_ = count_ / posting_block_size;
+  skips_ = data + sizeof(std::uint32_t);
+  blocks_ = skips_ + num_blocks_ * posting_skip_size;
+  LoadBlock(0);
+}
+
+void PostingIterator::Reset(std::vector<std::uint64_t> *ids) {
+  hybrid_ = false;
+  count_ = ids->size();
+  num_blocks_ = 0;
+  skips_ = nullptr;
+  blocks_ = nullptr;
+  block_ = 0;
+  pos_ = 0;
+  bitmap_ = nullptr;
+  payload_table_ = nullptr;
+  decoded_.reset();
+  block_ids_ = nullptr;
+  buf_.clear();
+  std::swap(buf_, *ids);
+  block_size_ = buf_.size();
+}
+
+void PostingIterator::Reset(
+    const std::shared_ptr<const DecodedPostingList> &list) {
+  hybrid_ = false;
+  count_ = list->ids.size();
+  num_blocks_ = count_ ? (count_ - 1) / posting_block_size : 0;
+  skips_ = nullptr;
+  blocks_ = nullptr;
+  payload_table_ = nullptr;
+  decoded_ = list;
+  buf_.clear();
+  LoadBlock(0);
+}
+std::size_t PostingIterator::FindBlock(std::uint64_t target) const {
+  // Gallop forward through the skip entries to bound the search, and
+  // then binary search within that bound. Every block before lo is
+  // known to end before target, and block hi (if it's a real block)
+  // is known to end at or after target.
+  std::size_t lo = block_ + 1;
+  std::size_t hi = lo;
+  std::size_t step = 1;
+  while (hi < num_blocks_ && BlockLastId(hi) < target) {
+    lo = hi + 1;
+    hi += step;
+    step *= 2;
+  }
+  hi = std::min(hi, num_blocks_);
+  while (lo < hi) {
+    std::size_t mid = lo + (hi - lo) / 2;
+    if (BlockLastId(mid) < target) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void PostingIterator::LoadBlock(std::size_t block) {
+  assert(block <= num_blocks_);
+  block_ = block;
+  pos_ = 0;
+  bitmap_ = nullptr;
+  payload_ = nullptr;
+  if (decoded_) {
+    // The blocks of a decoded list are just runs of its ids
+    const std::size_t start = block * posting_block_size;
+    block_ids_ = decoded_->ids.data() + start;
+    block_size_ = std::min(posting_block_size, count_ - start);
+    return;
+  }
+  if (block < num_blocks_) {
+    const char *data = blocks_ + SkipOffset(block);
+    if (!hybrid_) {
+      buf_.resize(posting_block_size);
+      DecodeBlock(data, buf_.data());
+      block_size_ = buf_.size();
+      return;
+    }
+    if (static_cast<ContainerType>(*data) == ContainerType::BITMAP) {
+      bitmap_base_ = ReadUint64(data + 1);
+      bitmap_ = data + 1 + sizeof(std::uint64_t);
+      pos_ = NextBit(0);
+      assert(pos_ < posting_bitmap_span);
+      return;
+    }
+    std::size_t size;
+    buf_.resize(posting_block_size);
+    DecodeContainer(data, buf_.data(), &size);
+    buf_.resize(size);
+    block_size_ = buf_.size();
+    return;
+  }
+
+  if (hybrid_) {
+    // The tail starts where the last container ends, and is prefixed
+    // with its size (unless it's the whole list).
+    const char *tail = blocks_;
+    std::uint64_t last_val = 0;
+    if (num_blocks_) {
+      tail = ContainerEnd(blocks_ + SkipOffset(num_blocks_ - 1));
+      last_val = SkipLastId(num_blocks_ - 1);
+    }
+    buf_.resize(ReadTailSize(&tail, count_));
+    DecodeTail(tail, buf_.size(), last_val, buf_.data());
+    block_size_ = buf_.size();
+    return;
+  }
+
+  // This is the tail of the list, which starts where the last full
+  // block ends.
+  const char *tail = blocks_;
+  std::uint64_t last_val = 0;
+  if (num_blocks_) {
+    const char *last_block = blocks_ + SkipOffset(num_blocks_ - 1);
+    const std::uint8_t bits = static_cast<std::uint8_t>(last_block[8]);
+    tail = last_block + sizeof(std::uint64_t) + 1 +
+        lanes * sizeof(std::uint32_t) * bits;
+    last_val = SkipLastId(num_blocks_ - 1);
+  }
+  buf_.resize(count_ - num_blocks_ * posting_block_size);
+  DecodeTail(tail, buf_.size(), last_val, buf_.data());
+  block_size_ = buf_.size();
+}
+
+void PostingIterator::payload(std::vector<std::uint32_t> *out) {
+  assert(has_payload() && valid());
+  if (decoded_) {
+    const std::size_t i = block_ * posting_block_size + pos_;
+    out->assign(decoded_->payloads.begin() + decoded_->payload_starts[i],
+                decoded_->payloads.begin() + decoded_->payload_starts[i + 1]);
+    return;
+  }
+  if (payload_ == nullptr) {
+    // The first container has no entry in the table
+    const char *table_end = payload_table_ +
+        num_blocks_ * sizeof(std::uint32_t);
+    payload_ = table_end;
+    if (block_ > 0) {
+      payload_ += ReadUint32(payload_table_ +
+                             (block_ - 1) * sizeof(std::uint32_t));
+    }
+    payload_rank_ = 0;
+  }
+
+  // The rank of the current id within its block
+  std::size_t rank = pos_;
+  if (bitmap_) {
+    rank = 0;
+    for (std::size_t i = 0; i < pos_ / 64; i++) {
+      rank += __builtin_popcountll(BitmapWord(bitmap_, i));
+    }
+    rank += __builtin_popcountll(BitmapWord(bitmap_, pos_ / 64) &
+                                 ((static_cast<std::uint64_t>(1) <<
+                                   (pos_ % 64)) - 1));
+  }
+
+  // The iterator only moves forwards, so the payload for this id is
+  // at or after the one that was last looked at.
+  assert(rank >= payload_rank_);
+  for (; payload_rank_ < rank; payload_rank_++) {
+    for (std::size_t count = ReadVarint(&payload_); count; count--) {
+      ReadVarint(&payload_);
+    }
+  }
+
+  out->clear();
+  const char *p = payload_;
+  std::uint32_t val = 0;
+  for (std::size_t count = ReadVarint(&p); count; count--) {
+    val += static_cast<std::uint32_t>(ReadVarint(&p));
+    out->push_back(val);
+  }
+}
+
+std::size_t PostingIterator::NextBit(std::size_t bit) const {
+  if (bit >= posting_bitmap_span) {
+    return posting_bitmap_span;
+  }
+  std::size_t i = bit / 64;
+  std::uint64_t word = BitmapWord(bitmap_, i) &
+      (~static_cast<std::uint64_t>(0) << (bit % 64));
+  while (!word) {
+    if (++i == posting_bitmap_words) {
+      return posting_bitmap_span;
+    }
+    word = BitmapWord(bitmap_, i);
+  }
+  return i * 64 + __builtin_ctzll(word);
+}
+}  // namespace codesearch
@@ -0,0 +1,453 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// Encoding and decoding of posting lists, which is the value format
+// used by the ngrams index. A posting list is a sorted list of unique
+// position ids. Lists are written with a value_format of
+// HYBRID_POSTINGS, and are encoded like this:
+//
+//  - varint, the number of ids in the list
+//  - varint, the number of containers
+//  - one skip entry per container
+//  - the containers
+//  - the tail: a 1-byte count of the remaining ids (fewer than
+//    posting_block_size of them), and then the ids as varint deltas
+//    from the last id of the last container
+//
+// A list of fewer than posting_block_size ids never has any
+// containers, so it's stored as just the number of ids and the ids of
+// the tail. Most lists are this short.
+//
+// A skip entry is an 8-byte BE integer holding the last id in the
+// container, followed by a 4-byte BE integer holding the offset of
+// the container, relative to the end of the skip entries. This lets a
+// reader find the container that might hold some id without decoding
+// (or even touching) any of the containers before it.
+//
+// The id space is divided into aligned spans of posting_bitmap_span
+// ids. If a list has at least posting_bitmap_min_ids ids in a span
+// then all of them are stored in one bitmap container; this is the
+// same idea as the containers in a Roaring bitmap. All other ids are
+// stored in array containers, which hold up to posting_block_size
+// consecutive ids of the list, or in the tail. Each container starts
+// with a 1-byte container type, and is followed by:
+//
+//  - packed (exactly posting_block_size ids): a full block, see below
+//  - varint (fewer ids): a 1-byte count, an 8-byte BE integer holding
+//    the first id, and then varint deltas from the previous id
+//  - bitmap: an 8-byte BE integer holding the first id of the span,
+//    and then posting_bitmap_words little-endian 64-bit words, in
+//    which bit i is set if the id (first id + i) is in the list
+//
+// A full block is stored as:
+//
+//  - 8-byte BE integer, the first id in the block (the "base")
+//  - 1-byte integer, the bit width of the packed deltas
+//  - 4 * bit width little-endian 32-bit words of packed deltas
+//
+// Within a block, each id is stored as an offset from the base, and
+// the offsets are then delta encoded against the offset four
+// positions earlier (i.e. one SSE register earlier). The deltas are
+// bit-packed "vertically": lane i of each 128-bit word holds the
+// deltas for ids i, i+4, i+8, etc. This layout means that decoding
+// is a series of shifts and masks on whole registers, followed by a
+// single vector add to undo the delta encoding. This is the same
+// scheme as SIMD-BP128, as described by Lemire and Boytsov.
+//
+// Some lists store a "payload" with each id, which is a sorted list of
+// small integers:
+//
+//  - POSITIONAL_POSTINGS (for indexes built with positions): the ids
+//    are line ids, and the payload is the byte offsets at which the
+//    ngram occurs in the line
+//  - FILE_POSTINGS: the ids are file ids, and the payload is the
+//    ordinals of the lines in the file that hold the ngram, relative
+//    to the first line of the file
+//
+// These are encoded like this:
+//
+//  - varint, the size of the HYBRID_POSTINGS list
+//  - the HYBRID_POSTINGS list
+//  - one 4-byte BE integer per container after the first (and one for
+//    the tail, unless it's the only container), the offset of the
+//    container's payloads, relative to the end of these integers. The
+//    payloads of the first container start at offset 0, so a list
+//    that's just a tail, which most lists are, has none of these.
+//  - for each id, a varint count of the payload, followed by the
+//    payload as varint deltas from the previous value (or from 0)
+//
+// Older indexes use BLOCK_POSTINGS or SKIP_BLOCK_POSTINGS, which have
+// no containers: the count (a 4-byte BE integer) is followed by a skip
+// entry per full block (SKIP_BLOCK_POSTINGS only), the full blocks,
+// and then the remaining ids as varint deltas from the last id of the
+// last full block.
+
+#ifndef SRC_POSTING_LIST_H_
+#define SRC_POSTING_LIST_H_
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./index.pb.h"
+#include "./util.h"
+
+namespace codesearch {
+
+// The number of ids in a full block
+const std::size_t posting_block_size = 128;
+
+// The size of a skip entry
+const std::size_t posting_skip_size = sizeof(std::uint64_t) +
+    sizeof(std::uint32_t);
+
+// The number of ids covered by a bitmap container
+const std::size_t posting_bitmap_span = 4096;
+
+// The size of a bitmap container's bitmap, in 64-bit words
+const std::size_t posting_bitmap_words = posting_bitmap_span / 64;
+
+// A list with at least this many ids in a span stores the span as a
+// bitmap. This is roughly the density at which a bitmap is no larger
+// than the packed blocks would be, and above it intersecting whole
+// bitmaps word by word is much cheaper than merging the ids.
+const std::size_t posting_bitmap_min_ids = posting_bitmap_span / 8;
+
+// When intersecting posting lists, if a list is this many times longer
+// than the shortest list then it is probed with advance_to() for each
+// candidate; otherwise it is merged against the candidates a block at
+// a time.
+const std::size_t posting_gallop_ratio = 16;
+
+// Encode a sorted list of position ids in the HYBRID_POSTINGS
+// format, appending the encoded data to the output string. If
+// container_starts isn't null, the index of the first id of each
+// container (and of the tail) is appended to it.
+void EncodePostingList(const std::vector<std::uint64_t> &ids,
+                       std::string *out,
+                       std::vector<std::size_t> *container_starts = nullptr);
+
+// Encode a sorted list of ids along with their payloads, in the
+// format used by POSITIONAL_POSTINGS and FILE_POSTINGS, appending the
+// encoded data to the output string. The i-th payload belongs to
+// ids[i], and must be sorted.
+void EncodePayloadPostingList(
+    const std::vector<std::uint64_t> &ids,
+    const std::vector<std::vector<std::uint32_t> > &payloads,
+    std::string *out);
+
+// Decode a posting list, appending the ids to the output vector.
+void DecodePostingList(SSTableHeader_ValueFormat format,
+                       const char *data, std::size_t size,
+                       std::vector<std::uint64_t> *out);
+
+// The number of ids in an encoded posting list, which is read from the
+// front of the list without decoding any of it.
+std::size_t PostingListSize(SSTableHeader_ValueFormat format,
+                            const char *data);
+
+// A posting list that has been decoded in full, e.g. to be kept in a
+// PostingCache.
+struct DecodedPostingList {
+  std::vector<std::uint64_t> ids;
+
+  // For lists with payloads, the payload of ids[i] is the values in
+  // payloads from payload_starts[i] up to payload_starts[i + 1];
+  // otherwise both are empty.
+  std::vector<std::uint32_t> payload_starts;
+  std::vector<std::uint32_t> payloads;
+
+  // The memory used by the list
+  std::size_t ByteSize() const {
+    return sizeof(*this) + ids.capacity() * sizeof(std::uint64_t) +
+        (payload_starts.capacity() + payloads.capacity()) *
+        sizeof(std::uint32_t);
+  }
+};
+
+// Decode a posting list in full, including the payloads of lists that
+// have them.
+void DecodePostingList(SSTableHeader_ValueFormat format,
+                       const char *data, std::size_t size,
+                       DecodedPostingList *out);
+
+// An iterator over a posting list. Containers are decoded on demand,
+// one at a time, and advance_to() uses the skip entries to jump over
+// containers that can't hold the target id. This is what makes it
+// cheap to intersect a short posting list with a very long one.
+// Bitmap containers are never expanded; the iterator walks the set
+// bits instead. An iterator over a DecodedPostingList treats each run
+// of posting_block_size ids as a block, and never copies the ids.
+//
+// A newly reset iterator points at the first id in the list.
+class PostingIterator {
+ public:
+  PostingIterator()
+      :hybrid_(false), count_(0), num_blocks_(0), skips_(nullptr),
+       blocks_(nullptr), block_(0), pos_(0), block_ids_(nullptr),
+       block_size_(0), bitmap_(nullptr), bitmap_base_(0),
+       payload_table_(nullptr), payload_(nullptr), payload_rank_(0) {}
+
+  // Iterate over an encoded posting list
+  void Reset(SSTableHeader_ValueFormat format,
+             const char *data, std::size_t size);
+
+  // Iterate over a list of ids that has already been decoded; the
+  // contents of the vector are taken by the iterator.
+  void Reset(std::vector<std::uint64_t> *ids);
+
+  // Iterate over a list that has been decoded in full, which the
+  // iterator shares rather than copies.
+  void Reset(const std::shared_ptr<const DecodedPostingList> &list);
+
+  // The total number of ids in the posting list
+  std::size_t size() const { return count_; }
+
+  // Returns false once the iterator has been advanced past the end
+  inline bool valid() const {
+    return pos_ < (bitmap_ ? posting_bitmap_span : block_size_);
+  }
+
+  inline std::uint64_t value() const {
+    assert(valid());
+    return bitmap_ ? bitmap_base_ + pos_ : ids()[pos_];
+  }
+
+  // True if the list stores a payload with each id
+  inline bool has_payload() const {
+    return payload_table_ != nullptr ||
+        (decoded_ && !decoded_->payload_starts.empty());
+  }
+
+  // Get the payload of the current id. This may only be called if
+  // has_payload() is true.
+  void payload(std::vector<std::uint32_t> *out);
+
+  // If the current container is a bitmap, returns its raw (little
+  // endian) words, and otherwise returns nullptr.
+  inline const char* bitmap() const { return bitmap_; }
+
+  // The first id of the span covered by the current bitmap container
+  inline std::uint64_t bitmap_base() const {
+    assert(bitmap_ != nullptr);
+    return bitmap_base_;
+  }
+
+  // The ids in the current array container, starting at the current
+  // id. This is only valid while the iterator is, and only if the
+  // current container isn't a bitmap.
+  inline const std::uint64_t* block_begin() const {
+    assert(bitmap_ == nullptr);
+    return ids() + pos_;
+  }
+  inline const std::uint64_t* block_end() const {
+    assert(bitmap_ == nullptr);
+    return ids() + block_size_;
+  }
+
+  // Move to the first id of the next container; returns false if
+  // there are no more ids.
+  inline bool next_block() {
+    assert(valid());
+    if (block_ < num_blocks_) {
+      LoadBlock(block_ + 1);
+      return valid();
+    }
+    pos_ = bitmap_ ? posting_bitmap_span : block_size_;
+    return false;
+  }
+
+  // Move to the next id; returns false if there are no more ids.
+  inline bool next() {
+    if (bitmap_) {
+      pos_ = NextBit(pos_ + 1);
+      if (pos_ < posting_bitmap_span) {
+        return true;
+      }
+    } else if (++pos_ < block_size_) {
+      return true;
+    }
+    if (block_ < num_blocks_) {
+      LoadBlock(block_ + 1);
+      return valid();
+    }
+    return false;
+  }
+
+  // Move to the first id that is >= target; returns false if there is
+  // no such id. This never moves the iterator backwards.
+  inline bool advance_to(std::uint64_t target) {
+    if (!valid()) {
+      return false;
+    }
+    if (value() >= target) {
+      return true;
+    }
+    if (block_last() < target) {
+      if (block_ == num_blocks_) {
+        pos_ = bitmap_ ? posting_bitmap_span : block_size_;
+        return false;
+      }
+      LoadBlock(FindBlock(target));
+      if (!valid() || value() >= target) {
+        return valid();
+      }
+    }
+    if (bitmap_) {
+      pos_ = NextBit(target - bitmap_base_);
+    } else {
+      pos_ = std::lower_bound(ids() + pos_, ids() + block_size_, target) -
+          ids();
+    }
+    return valid();
+  }
+
+ private:
+  // True for HYBRID_POSTINGS lists, whose blocks are containers
+  bool hybrid_;
+  std::size_t count_;
+  std::size_t num_blocks_;
+  const char *skips_;
+  const char *blocks_;
+
+  // The current block or container. Array containers and blocks are
+  // decoded into buf_, and pos_ is an index into buf_. For bitmap
+  // containers pos_ is the bit of the current id instead. Block
+  // num_blocks_ is the varint encoded tail of the list.
+  std::size_t block_;
+  std::size_t pos_;
+  std::vector<std::uint64_t> buf_;
+
+  // For decoded lists, the list, and the ids of the current block
+  // within it (buf_ isn't used); otherwise block_ids_ is null. The
+  // size of the current block is block_size_ either way.
+  std::shared_ptr<const DecodedPostingList> decoded_;
+  const std::uint64_t *block_ids_;
+  std::size_t block_size_;
+  const char *bitmap_;
+  std::uint64_t bitmap_base_;
+
+  // For lists with payloads, the table of where each block's payloads
+  // start, and the payload of the id in the current block whose rank
+  // is payload_rank_ (or nullptr, if the payloads for this block
+  // haven't been looked at yet).
+  const char *payload_table_;
+  const char *payload_;
+  std::size_t payload_rank_;
+
+  inline std::uint64_t SkipLastId(std::size_t block) const {
+    return ReadUint64(skips_ + block * posting_skip_size);
+  }
+
+  // The last id in a block other than the tail, from its skip entry
+  // (or from the ids of a decoded list)
+  inline std::uint64_t BlockLastId(std::size_t block) const {
+    if (decoded_) {
+      return decoded_->ids[(block + 1) * posting_block_size - 1];
+    }
+    return SkipLastId(block);
+  }
+
+  // The ids of the current array container or block
+  inline const std::uint64_t* ids() const {
+    return block_ids_ ? block_ids_ : buf_.data();
+  }
+
+  inline std::uint32_t SkipOffset(std::size_t block) const {
+    return ReadUint32(
+        skips_ + block * posting_skip_size + sizeof(std::uint64_t));
+  }
+
+  // The last id in the current block
+  inline std::uint64_t block_last() const {
+    return bitmap_ ? SkipLastId(block_) : ids()[block_size_ - 1];
+  }
+
+  // Find the first block after the current one whose last id is >=
+  // target, or num_blocks_ if no such block exists.
+  std::size_t FindBlock(std::uint64_t target) const;
+
+  // Decode a block into buf_ (or point bitmap_ at it, for bitmap
+  // containers, or block_ids_ at it, for decoded lists), and point at
+  // its first id.
+  void LoadBlock(std::size_t block);
+
+  // The first set bit in the current bitmap at or after bit, or
+  // posting_bitmap_span if there is none.
+  std::size_t NextBit(std::size_t bit) const;
+};
+
+// The intersection of some posting lists, i.e. the ids that are in all
+// of them, which are produced in order by next(). This is lazy: each
+// call to next() only does as much work as is needed to find the next
+// id, so a caller that stops early never decodes the rest of the
+// lists.
+//
+// The first list should be the shortest one, since it drives the
+// intersection: each container of its ids is intersected with the
+// other lists in turn, and then the first list is advanced to the
+// furthest point any other list reached. When the first list is on a
+// bitmap container the other lists are ANDed into a copy of the
+// bitmap, a word at a time. Otherwise lists of similar length are
+// merged with IntersectSorted(), and much longer lists are probed with
+// advance_to(), so that they only decode the containers that might
+// hold a candidate. The lists are consumed by this, and must outlive
+// it.
+class PostingIntersection {
+ public:
+  explicit PostingIntersection(const std::vector<PostingIterator*> &lists);
+
+  // Get the next id that is in all of the lists; returns false once
+  // there are no more.
+  inline bool next(std::uint64_t *id) {
+    while (pos_ == buf_.size()) {
+      if (!Fill()) {
+        return false;
+      }
+    }
+    *id = buf_[pos_++];
+    return true;
+  }
+
+ private:
+  const std::vector<PostingIterator*> &lists_;
+  std::vector<bool> gallop_;
+  bool done_;
+
+  // The ids from the lead list's last container that are in all of
+  // the lists, and the position of the next one to return
+  std::vector<std::uint64_t> buf_;
+  std::size_t pos_;
+  std::vector<std::uint64_t> scratch_;
+
+  // Intersect the next container of the lead list into buf_; returns
+  // false if there are no containers left.
+  bool Fill();
+};
+
+// The intersection of FILE_POSTINGS lists. The files that are in all
+// of the lists are found first, with a PostingIntersection, and only
+// then are the line ordinals of each of those files intersected. The
+// lists are consumed by this, and must outlive it.
+class FilePostingIntersection {
+ public:
+  explicit FilePostingIntersection(
+      const std::vector<PostingIterator*> &lists);
+
+  // Get the next file that has lines in all of the lists, along with
+  // the sorted ordinals of those lines. Returns false once there are
+  // no more such files.
+  bool next(std::uint64_t *file_id, std::vector<std::uint32_t> *ordinals);
+
+ private:
+  // Copies of the lists, that are only used to read payloads, since
+  // the originals are moved ahead by files_
+  std::vector<PostingIterator> payload_lists_;
+  PostingIntersection files_;
+  std::vector<std::uint32_t> lines_;
+  std::vector<std::uint32_t> scratch_;
+};
+}
+
+#endif  // SRC_POSTING_LIST_H_
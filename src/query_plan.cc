@@ -0,0 +1,545 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./query_plan.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <sstream>
+
+#include "./ngram.h"
+#include "./util.h"
+
+namespace codesearch {
+namespace {
+struct Token {
+  enum Kind { WORD, QUOTED, AND, OR, NOT, FILE, LANG };
+
+  Kind kind;
+  bool negated;  // for -file: and -lang:
+  std::string text;
+  std::size_t begin;
+  std::size_t end;
+};
+
+// Split a query into tokens. Returns false if there's a quote without
+// a closing quote.
+bool Tokenize(const std::string &query, std::vector<Token> *tokens) {
+  auto space = [&](std::size_t i) {
+    return isspace(static_cast<unsigned char>(query[i])) != 0;
+  };
+  bool closed = true;
+  std::size_t i = 0;
+  while (true) {
+    while (i < query.size() && space(i)) {
+      i++;
+    }
+    if (i == query.size()) {
+      break;
+    }
+    Token token;
+    token.negated = false;
+    token.begin = i;
+    if (query[i] == '"') {
+      std::size_t close = query.find('"', i + 1);
+      if (close == std::string::npos) {
+        closed = false;
+        close = query.size();
+      }
+      token.kind = Token::QUOTED;
+      token.text = query.substr(i + 1, close - i - 1);
+      i = std::min(close + 1, query.size());
+      token.end = i;
+      tokens->push_back(token);
+      continue;
+    }
+    while (i < query.size() && !space(i)) {
+      i++;
+    }
+    token.end = i;
+    std::string word = query.substr(token.begin, i - token.begin);
+    token.kind = Token::WORD;
+    if (word == "AND") {
+      token.kind = Token::AND;
+    } else if (word == "OR") {
+      token.kind = Token::OR;
+    } else if (word == "NOT") {
+      token.kind = Token::NOT;
+    } else {
+      if (word[0] == '-') {
+        token.negated = true;
+        word = word.substr(1);
+      }
+      if (word.size() > 5 && word.compare(0, 5, "file:") == 0) {
+        token.kind = Token::FILE;
+        token.text = word.substr(5);
+      } else if (word.size() > 5 && word.compare(0, 5, "lang:") == 0) {
+        token.kind = Token::LANG;
+        token.text = word.substr(5);
+        for (auto &c : token.text) {
+          c = tolower(static_cast<unsigned char>(c));
+        }
+      } else {
+        token.negated = false;
+      }
+    }
+    tokens->push_back(token);
+  }
+
+  // An operator without a term to work on is just a word, so that
+  // queries like "NOT" or "foo OR" are searched for as they are. A NOT
+  // needs a term after it, which may be another NOT, and an AND or OR
+  // needs a term on each side.
+  auto operand = [&](std::size_t j) {
+    return j < tokens->size() && (*tokens)[j].kind != Token::AND &&
+        (*tokens)[j].kind != Token::OR;
+  };
+  for (std::size_t j = tokens->size(); j-- > 0; ) {
+    if ((*tokens)[j].kind == Token::NOT && !operand(j + 1)) {
+      (*tokens)[j].kind = Token::WORD;
+    }
+  }
+  for (std::size_t j = 0; j < tokens->size(); j++) {
+    Token &token = (*tokens)[j];
+    if ((token.kind == Token::AND || token.kind == Token::OR) &&
+        (j == 0 || !operand(j - 1) || !operand(j + 1))) {
+      token.kind = Token::WORD;
+    }
+  }
+  return closed;
+}
+
+// True if none of the tokens are operators, so that a query made of
+// them is just a string
+bool AllWords(const std::vector<Token> &tokens) {
+  for (const auto &token : tokens) {
+    if (token.kind != Token::WORD && token.kind != Token::QUOTED) {
+      return false;
+    }
+  }
+  return true;
+}
+
+class Parser {
+ public:
+  Parser(const std::string &query, const std::vector<Token> &tokens,
+         bool case_insensitive)
+      :query_(query), tokens_(tokens), case_insensitive_(case_insensitive),
+       pos_(0), num_files_(0) {}
+
+  std::unique_ptr<QueryNode> Parse(std::string *error) {
+    std::unique_ptr<QueryNode> root = ParseOr();
+    if (root != nullptr && pos_ < tokens_.size()) {
+      error_ = "unexpected " + Describe(tokens_[pos_]);
+    } else if (root == nullptr && error_.empty()) {
+      error_ = "empty query";
+    }
+    *error = error_;
+    return error_.empty() ? std::move(root) : nullptr;
+  }
+
+  int num_files() const { return num_files_; }
+
+ private:
+  const std::string &query_;
+  const std::vector<Token> &tokens_;
+  const bool case_insensitive_;
+  std::size_t pos_;
+  int num_files_;
+  std::string error_;
+
+  bool Peek(Token::Kind kind) const {
+    return pos_ < tokens_.size() && tokens_[pos_].kind == kind;
+  }
+
+  std::string Describe(const Token &token) const {
+    return "\"" + query_.substr(token.begin, token.end - token.begin) + "\"";
+  }
+
+  std::unique_ptr<QueryNode> Combine(QueryNode::Op op,
+                                     std::vector<std::unique_ptr<QueryNode> >
+                                     *subs) {
+    if (subs->size() == 1) {
+      return std::move((*subs)[0]);
+    }
+    std::unique_ptr<QueryNode> node(new QueryNode(op));
+    node->subs.swap(*subs);
+    return node;
+  }
+
+  std::unique_ptr<QueryNode> ParseOr() {
+    std::vector<std::unique_ptr<QueryNode> > subs;
+    while (true) {
+      std::unique_ptr<QueryNode> sub = ParseAnd();
+      if (sub == nullptr) {
+        if (error_.empty() && (!subs.empty() || Peek(Token::OR))) {
+          error_ = "OR needs a term on each side";
+        }
+        return nullptr;
+      }
+      subs.push_back(std::move(sub));
+      if (!Peek(Token::OR)) {
+        break;
+      }
+      pos_++;
+    }
+    return Combine(QueryNode::OR, &subs);
+  }
+
+  std::unique_ptr<QueryNode> ParseAnd() {
+    std::vector<std::unique_ptr<QueryNode> > subs;
+    while (pos_ < tokens_.size() && !Peek(Token::OR)) {
+      if (Peek(Token::AND)) {
+        if (subs.empty()) {
+          error_ = "AND needs a term on each side";
+          return nullptr;
+        }
+        pos_++;
+      }
+      std::unique_ptr<QueryNode> sub = ParseUnary();
+      if (sub == nullptr) {
+        if (error_.empty()) {
+          error_ = "AND needs a term on each side";
+        }
+        return nullptr;
+      }
+      subs.push_back(std::move(sub));
+    }
+    if (subs.empty()) {
+      return nullptr;
+    }
+    return Combine(QueryNode::AND, &subs);
+  }
+
+  std::unique_ptr<QueryNode> ParseUnary() {
+    if (pos_ == tokens_.size() || Peek(Token::AND) || Peek(Token::OR)) {
+      return nullptr;
+    }
+    const Token &token = tokens_[pos_++];
+    std::unique_ptr<QueryNode> node;
+    switch (token.kind) {
+      case Token::NOT:
+        node.reset(new QueryNode(QueryNode::NOT));
+        node->subs.push_back(ParseUnary());
+        if (node->subs[0] == nullptr) {
+          if (error_.empty()) {
+            error_ = "NOT needs a term after it";
+          }
+          return nullptr;
+        }
+        return node;
+      case Token::FILE:
+        node.reset(new QueryNode(QueryNode::FILE));
+        node->text = token.text;
+        node->file_re.reset(new Regexp(token.text));
+        if (!node->file_re->ok()) {
+          error_ = "invalid regexp in " + Describe(token) + ": " +
+              node->file_re->error();
+          return nullptr;
+        }
+        node->file_num = num_files_++;
+        break;
+      case Token::LANG:
+        node.reset(new QueryNode(QueryNode::LANG));
+        node->text = token.text;
+        break;
+      case Token::QUOTED:
+        if (token.text.empty()) {
+          error_ = "empty quotes";
+          return nullptr;
+        }
+        node = Literal(token.text);
+        break;
+      case Token::WORD: {
+        // The words up to the next operator are one string, with the
+        // spaces between them
+        std::size_t end = token.end;
+        while (Peek(Token::WORD)) {
+          end = tokens_[pos_++].end;
+        }
+        node = Literal(query_.substr(token.begin, end - token.begin));
+        break;
+      }
+      default:
+        assert(false);
+    }
+    if (token.negated) {
+      std::unique_ptr<QueryNode> negated(new QueryNode(QueryNode::NOT));
+      negated->subs.push_back(std::move(node));
+      return negated;
+    }
+    return node;
+  }
+
+  std::unique_ptr<QueryNode> Literal(const std::string &text) {
+    std::unique_ptr<QueryNode> node(new QueryNode(QueryNode::LITERAL));
+    node->text = text;
+    if (case_insensitive_) {
+      node->matcher.reset(new CaseInsensitiveMatcher(text));
+    }
+    return node;
+  }
+};
+
+// Estimate the number of lines that match each node, and order the
+// subs of the AND and OR nodes
+double Estimate(QueryNode *node, Context *ctx, double num_lines,
+                bool case_insensitive) {
+  switch (node->op) {
+    case QueryNode::LITERAL: {
+      // A line with the string has every one of its ngrams. The counts
+      // are of the ngrams as they appear in the lines, so if case
+      // doesn't matter the lines with the folded ngrams count too.
+      node->cost = num_lines;
+      const std::string &text = node->text;
+      const std::string folded = FoldCase(text);
+      for (std::size_t i = 0; i + NGram::ngram_size <= text.size(); i++) {
+        const NGram ngram(text.data() + i);
+        double count = ctx->NGramCount(ngram);
+        if (case_insensitive) {
+          const NGram folded_ngram(folded.data() + i);
+          if (folded_ngram != ngram) {
+            count += ctx->NGramCount(folded_ngram);
+          }
+        }
+        node->cost = std::min(node->cost, count);
+      }
+      break;
+    }
+    case QueryNode::FILE:
+    case QueryNode::LANG:
+      // The ngram counts don't say anything about these
+      node->cost = num_lines;
+      break;
+    case QueryNode::NOT:
+      node->cost = num_lines - Estimate(node->subs[0].get(), ctx, num_lines,
+                                        case_insensitive);
+      break;
+    case QueryNode::AND: {
+      // The most selective terms go first, so that checking a line can
+      // stop as soon as possible, and the negated terms go last. The
+      // negated terms only bound the cost if there's nothing else.
+      double positive_cost = num_lines;
+      double negated_cost = num_lines;
+      for (auto &sub : node->subs) {
+        const double cost = Estimate(sub.get(), ctx, num_lines,
+                                     case_insensitive);
+        if (sub->op == QueryNode::NOT) {
+          negated_cost = std::min(negated_cost, cost);
+        } else {
+          positive_cost = std::min(positive_cost, cost);
+        }
+      }
+      node->cost = positive_cost;
+      if (std::all_of(node->subs.begin(), node->subs.end(),
+                      [](const std::unique_ptr<QueryNode> &sub) {
+                        return sub->op == QueryNode::NOT;
+                      })) {
+        node->cost = negated_cost;
+      }
+      std::stable_sort(node->subs.begin(), node->subs.end(),
+                       [](const std::unique_ptr<QueryNode> &a,
+                          const std::unique_ptr<QueryNode> &b) {
+                         const bool a_not = a->op == QueryNode::NOT;
+                         const bool b_not = b->op == QueryNode::NOT;
+                         if (a_not != b_not) {
+                           return b_not;
+                         }
+                         return a->cost < b->cost;
+                       });
+      break;
+    }
+    case QueryNode::OR:
+      // The terms that match the most lines go first, so that checking
+      // a line that matches can stop as soon as possible
+      node->cost = 0;
+      for (auto &sub : node->subs) {
+        node->cost += Estimate(sub.get(), ctx, num_lines, case_insensitive);
+      }
+      node->cost = std::min(node->cost, num_lines);
+      std::stable_sort(node->subs.begin(), node->subs.end(),
+                       [](const std::unique_ptr<QueryNode> &a,
+                          const std::unique_ptr<QueryNode> &b) {
+                         return a->cost > b->cost;
+                       });
+      break;
+  }
+  return node->cost;
+}
+
+NGramQuery NGramQueryFor(const QueryNode &node, bool case_insensitive,
+                         bool folded) {
+  switch (node.op) {
+    case QueryNode::LITERAL:
+      if (!case_insensitive) {
+        return NGramQuery::ForStrings({node.text});
+      } else if (folded) {
+        return NGramQuery::ForStrings({FoldCase(node.text)});
+      } else {
+        const Regexp re(CaseInsensitiveRegexp(node.text));
+        return re.ok() ? NGramQuery(re) : NGramQuery(NGramQuery::ALL);
+      }
+    case QueryNode::AND: {
+      NGramQuery query(NGramQuery::ALL);
+      for (const auto &sub : node.subs) {
+        query = query.And(NGramQueryFor(*sub, case_insensitive, folded));
+      }
+      return query;
+    }
+    case QueryNode::OR: {
+      NGramQuery query(NGramQuery::NONE);
+      for (const auto &sub : node.subs) {
+        query = query.Or(NGramQueryFor(*sub, case_insensitive, folded));
+      }
+      return query;
+    }
+    default:
+      // A line can match these whatever ngrams it has
+      return NGramQuery(NGramQuery::ALL);
+  }
+}
+
+void Print(const QueryNode &node, std::ostream *out) {
+  switch (node.op) {
+    case QueryNode::LITERAL:
+      *out << "\"" << PrintBinaryString(node.text) << "\"";
+      break;
+    case QueryNode::FILE:
+      *out << "file:" << node.text;
+      break;
+    case QueryNode::LANG:
+      *out << "lang:" << node.text;
+      break;
+    case QueryNode::NOT:
+      *out << "NOT ";
+      Print(*node.subs[0], out);
+      break;
+    case QueryNode::AND:
+    case QueryNode::OR:
+      *out << "(";
+      for (std::size_t i = 0; i < node.subs.size(); i++) {
+        if (i) {
+          *out << (node.op == QueryNode::AND ? " AND " : " OR ");
+        }
+        Print(*node.subs[i], out);
+      }
+      *out << ")";
+      break;
+  }
+  *out << "[" << static_cast<std::uint64_t>(node.cost) << "]";
+}
+}
+
+QueryPlan::QueryPlan(const std::string &query, bool case_insensitive)
+    :case_insensitive_(case_insensitive), literal_(true), num_files_(0) {
+  std::vector<Token> tokens;
+  const bool closed = Tokenize(query, &tokens);
+  literal_ = AllWords(tokens);
+  if (literal_) {
+    // A query that's all one quoted string is searched for without
+    // its quotes if the string would otherwise be parsed as operators,
+    // which is how the operators can be searched for; otherwise the
+    // quotes are part of the string, as they always were.
+    root_.reset(new QueryNode(QueryNode::LITERAL));
+    root_->text = query;
+    if (closed && tokens.size() == 1 && tokens[0].kind == Token::QUOTED) {
+      std::vector<Token> unquoted;
+      Tokenize(tokens[0].text, &unquoted);
+      if (!AllWords(unquoted)) {
+        root_->text = tokens[0].text;
+      }
+    }
+    if (case_insensitive) {
+      root_->matcher.reset(new CaseInsensitiveMatcher(root_->text));
+    }
+    return;
+  } else if (!closed) {
+    error_ = "missing closing quote";
+    return;
+  }
+  Parser parser(query, tokens, case_insensitive);
+  root_ = parser.Parse(&error_);
+  num_files_ = parser.num_files();
+}
+
+void QueryPlan::Optimize(Context *ctx, std::uint64_t num_lines) {
+  assert(ok());
+  Estimate(root_.get(), ctx, num_lines, case_insensitive_);
+}
+
+NGramQuery QueryPlan::ngram_query(bool folded) const {
+  assert(ok());
+  return NGramQueryFor(*root_, case_insensitive_, folded);
+}
+
+std::string QueryPlan::ToString() const {
+  assert(ok());
+  std::ostringstream out;
+  Print(*root_, &out);
+  return out.str();
+}
+
+QueryMatcher::QueryMatcher(const QueryPlan &plan,
+                           const IntegerIndexReader &files_index)
+    :plan_(plan), files_index_(files_index),
+     file_matchers_(plan.num_files_), have_file_(false), file_id_(0) {
+  // Find the FILE nodes, to make a matcher for each of their regexps
+  std::vector<const QueryNode*> stack{&plan.root()};
+  while (!stack.empty()) {
+    const QueryNode *node = stack.back();
+    stack.pop_back();
+    if (node->op == QueryNode::FILE) {
+      file_matchers_[node->file_num].reset(new RegexpMatcher(*node->file_re));
+    }
+    for (const auto &sub : node->subs) {
+      stack.push_back(sub.get());
+    }
+  }
+}
+
+bool QueryMatcher::Match(const Line &line) {
+  return Match(plan_.root(), line);
+}
+
+bool QueryMatcher::Match(const QueryNode &node, const Line &line) {
+  switch (node.op) {
+    case QueryNode::LITERAL:
+      if (node.matcher != nullptr) {
+        return node.matcher->Match(line.line());
+      }
+      return line.line().find(node.text) != std::string::npos;
+    case QueryNode::FILE:
+      return file_matchers_[node.file_num]->Match(
+          File(line.file_id()).filename());
+    case QueryNode::LANG:
+      return File(line.file_id()).lang() == node.text;
+    case QueryNode::NOT:
+      return !Match(*node.subs[0], line);
+    case QueryNode::AND:
+      for (const auto &sub : node.subs) {
+        if (!Match(*sub, line)) {
+          return false;
+        }
+      }
+      return true;
+    case QueryNode::OR:
+      for (const auto &sub : node.subs) {
+        if (Match(*sub, line)) {
+          return true;
+        }
+      }
+      return false;
+  }
+  return false;
+}
+
+const FileValue& QueryMatcher::File(std::uint64_t file_id) {
+  if (!have_file_ || file_id != file_id_) {
+    const bool found = files_index_.Find(file_id, &file_);
+    assert(found);
+    file_id_ = file_id;
+    have_file_ = true;
+  }
+  return file_;
+}
+}
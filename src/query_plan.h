@@ -0,0 +1,154 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// The boolean query language. A query is made of terms, which are
+// matched against each line:
+//
+//   foo bar       lines that contain the string "foo bar"
+//   "foo AND"     lines that contain the string in the quotes
+//   file:regexp   lines of the files whose names match the regexp
+//   lang:name     lines of the files in a language, e.g. lang:c++
+//
+// Terms can be negated with NOT (and -file:regexp and -lang:name are
+// short for NOT file:regexp and NOT lang:name), and combined with AND
+// and OR. NOT binds tightest and OR loosest. Terms that are next to
+// each other are ANDed, except for words that aren't operators, which
+// make up one string as in the first example. For instance
+//
+//   mmap OR munmap file:\.cc$ -file:test
+//
+// finds the lines that contain "mmap", or that contain "munmap" and are
+// in a .cc file whose name doesn't contain "test". A query that doesn't
+// use any of the operators is just a string, so plain queries (even
+// ones with quotes or spaces in them) mean what they always have. The
+// one exception is a query that's all one quoted string whose text
+// would be parsed as operators without the quotes, like "a OR b":
+// that searches for the text without the quotes.
+//
+// Before it's run, a plan is optimized using the ngram counts: the
+// number of lines that each term matches is estimated, so that the
+// terms of each AND are evaluated from the most selective to the
+// least, with the negated terms after all of the others.
+
+#ifndef SRC_QUERY_PLAN_H_
+#define SRC_QUERY_PLAN_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./case_fold.h"
+#include "./context.h"
+#include "./index.pb.h"
+#include "./integer_index_reader.h"
+#include "./lines_reader.h"
+#include "./ngram_query.h"
+#include "./regexp.h"
+
+namespace codesearch {
+
+// A node of the plan of a query
+struct QueryNode {
+  enum Op {
+    LITERAL,  // lines that contain text
+    FILE,     // lines of files whose names match the regexp text
+    LANG,     // lines of files in the language text
+    AND,      // lines that match all of subs
+    OR,       // lines that match any of subs
+    NOT       // lines that don't match subs[0]
+  };
+
+  explicit QueryNode(Op o) :op(o), cost(0), file_num(-1) {}
+
+  Op op;
+  std::string text;
+
+  // The estimated number of lines that match the node
+  double cost;
+
+  std::vector<std::unique_ptr<QueryNode> > subs;
+
+  // For case-insensitive LITERAL nodes, the matcher for the lines
+  std::unique_ptr<CaseInsensitiveMatcher> matcher;
+
+  // For FILE nodes, the regexp, and its number among the plan's
+  // FILE nodes
+  std::unique_ptr<Regexp> file_re;
+  int file_num;
+};
+
+class QueryPlan {
+ public:
+  // Parse a query. If the query isn't valid, ok() returns false and
+  // error() says why. If case_insensitive is set, the LITERAL terms
+  // match regardless of case.
+  explicit QueryPlan(const std::string &query, bool case_insensitive = false);
+
+  QueryPlan(const QueryPlan &other) = delete;
+  QueryPlan& operator=(const QueryPlan &other) = delete;
+
+  bool ok() const { return error_.empty(); }
+  const std::string& error() const { return error_; }
+
+  // True if the query doesn't use any operators, i.e. it's just a
+  // string to find, which is the text of the root
+  bool literal() const { return literal_; }
+
+  bool case_insensitive() const { return case_insensitive_; }
+
+  const QueryNode& root() const { return *root_; }
+
+  // Estimate the cost of each node, and order the subs of each AND
+  // and OR node, using the ngram counts of the index. num_lines is the
+  // number of lines in the index.
+  void Optimize(Context *ctx, std::uint64_t num_lines);
+
+  // The query for the ngrams that the lines that match must have. If
+  // folded is set, the ngrams are those of the case folded literals,
+  // for the "ngrams_folded" index.
+  NGramQuery ngram_query(bool folded) const;
+
+  // A readable form of the plan, for logging
+  std::string ToString() const;
+
+ private:
+  friend class QueryMatcher;
+
+  const bool case_insensitive_;
+  std::string error_;
+  bool literal_;
+  std::unique_ptr<QueryNode> root_;
+  int num_files_;
+};
+
+// Checks lines against a plan. A QueryMatcher shouldn't be shared
+// between threads, but any number of matchers can use the same plan.
+class QueryMatcher {
+ public:
+  QueryMatcher(const QueryPlan &plan, const IntegerIndexReader &files_index);
+
+  QueryMatcher(const QueryMatcher &other) = delete;
+  QueryMatcher& operator=(const QueryMatcher &other) = delete;
+
+  // Returns true if the line matches the plan
+  bool Match(const Line &line);
+
+ private:
+  const QueryPlan &plan_;
+  const IntegerIndexReader &files_index_;
+  std::vector<std::unique_ptr<RegexpMatcher> > file_matchers_;
+
+  // The file of the last line that needed one, since the lines of a
+  // file are checked one after the other
+  bool have_file_;
+  std::uint64_t file_id_;
+  FileValue file_;
+
+  bool Match(const QueryNode &node, const Line &line);
+
+  const FileValue& File(std::uint64_t file_id);
+};
+}
+
+#endif  // SRC_QUERY_PLAN_H_
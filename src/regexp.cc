@@ -0,0 +1,912 @@
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+
+#include "./regexp.h"
+
+#include "./case_fold.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstring>
+
+namespace codesearch {
+namespace {
+typedef std::vector<std::pair<std::uint32_t, std::uint32_t> > Ranges;
+typedef std::vector<std::pair<std::uint8_t, std::uint8_t> > ByteRanges;
+
+const std::uint32_t max_code_point = 0x10FFFF;
+
+// The largest count allowed in a {n,m} repetition
+const int max_repeat = 1000;
+
+// The largest NFA that will be built, and the most DFA states that a
+// matcher will keep at once
+const std::size_t max_insts = 100000;
+const std::size_t max_dfa_states = 10000;
+
+// Decode the code point that starts at str[*pos], and move pos past
+// it. Returns false if it isn't valid UTF-8.
+bool DecodeUtf8(const std::string &str, std::size_t *pos, std::uint32_t *c) {
+  const std::uint8_t lead = static_cast<std::uint8_t>(str[*pos]);
+  std::size_t n;
+  if (lead < 0x80) {
+    *c = lead;
+    n = 0;
+  } else if ((lead & 0xE0) == 0xC0) {
+    *c = lead & 0x1F;
+    n = 1;
+  } else if ((lead & 0xF0) == 0xE0) {
+    *c = lead & 0x0F;
+    n = 2;
+  } else if ((lead & 0xF8) == 0xF0) {
+    *c = lead & 0x07;
+    n = 3;
+  } else {
+    return false;
+  }
+  if (*pos + n >= str.size()) {
+    return false;
+  }
+  for (std::size_t i = 1; i <= n; i++) {
+    const std::uint8_t b = static_cast<std::uint8_t>(str[*pos + i]);
+    if ((b & 0xC0) != 0x80) {
+      return false;
+    }
+    *c = (*c << 6) | (b & 0x3F);
+  }
+  *pos += n + 1;
+  return *c <= max_code_point;
+}
+
+// Sort the ranges, and merge the ones that overlap or are adjacent
+void CleanRanges(Ranges *ranges) {
+  std::sort(ranges->begin(), ranges->end());
+  Ranges merged;
+  for (const auto &r : *ranges) {
+    if (!merged.empty() && r.first <= merged.back().second + 1) {
+      merged.back().second = std::max(merged.back().second, r.second);
+    } else {
+      merged.push_back(r);
+    }
+  }
+  ranges->swap(merged);
+}
+
+// The code points that aren't in the (clean) ranges
+Ranges NegateRanges(const Ranges &ranges) {
+  Ranges negated;
+  std::uint32_t next = 0;
+  for (const auto &r : ranges) {
+    if (r.first > next) {
+      negated.push_back({next, r.first - 1});
+    }
+    next = r.second + 1;
+  }
+  if (next <= max_code_point) {
+    negated.push_back({next, max_code_point});
+  }
+  return negated;
+}
+
+// Split a range of code points into sequences of byte ranges, such
+// that the UTF-8 encoding of each code point in the range matches one
+// of the sequences. Surrogates aren't valid UTF-8, so they're skipped.
+void Utf8Sequences(std::uint32_t lo, std::uint32_t hi,
+                   std::vector<ByteRanges> *out) {
+  if (lo > hi) {
+    return;
+  }
+  if (lo < 0xD800 && hi > 0xDFFF) {
+    Utf8Sequences(lo, 0xD7FF, out);
+    Utf8Sequences(0xE000, hi, out);
+    return;
+  }
+  if (lo >= 0xD800 && lo <= 0xDFFF) {
+    Utf8Sequences(0xE000, hi, out);
+    return;
+  }
+  if (hi >= 0xD800 && hi <= 0xDFFF) {
+    Utf8Sequences(lo, 0xD7FF, out);
+    return;
+  }
+
+  // Split where the length of the encoding changes
+  static const std::uint32_t max_for_length[] = {0x7F, 0x7FF, 0xFFFF};
+  for (const auto &max : max_for_length) {
+    if (lo <= max && hi > max) {
+      Utf8Sequences(lo, max, out);
+      Utf8Sequences(max + 1, hi, out);
+      return;
+    }
+  }
+
+  // Split until each continuation byte covers a full range
+  std::string lo_bytes, hi_bytes;
+  AppendUtf8(lo, &lo_bytes);
+  AppendUtf8(hi, &hi_bytes);
+  const std::size_t n = lo_bytes.size();
+  for (std::size_t i = 1; i < n; i++) {
+    const std::uint32_t m = (1U << (6 * i)) - 1;
+    if ((lo & ~m) != (hi & ~m)) {
+      if ((lo & m) != 0) {
+        Utf8Sequences(lo, lo | m, out);
+        Utf8Sequences((lo | m) + 1, hi, out);
+        return;
+      }
+      if ((hi & m) != m) {
+        Utf8Sequences(lo, (hi & ~m) - 1, out);
+        Utf8Sequences(hi & ~m, hi, out);
+        return;
+      }
+    }
+  }
+
+  ByteRanges seq;
+  for (std::size_t i = 0; i < n; i++) {
+    seq.push_back({static_cast<std::uint8_t>(lo_bytes[i]),
+                   static_cast<std::uint8_t>(hi_bytes[i])});
+  }
+  out->push_back(seq);
+}
+
+struct NamedClass {
+  const char *name;
+  Ranges ranges;
+};
+
+// The POSIX classes, as in [[:alpha:]]
+const std::vector<NamedClass> posix_classes{
+  {"alnum", {{'0', '9'}, {'A', 'Z'}, {'a', 'z'}}},
+  {"alpha", {{'A', 'Z'}, {'a', 'z'}}},
+  {"ascii", {{0, 0x7F}}},
+  {"blank", {{'\t', '\t'}, {' ', ' '}}},
+  {"cntrl", {{0, 0x1F}, {0x7F, 0x7F}}},
+  {"digit", {{'0', '9'}}},
+  {"graph", {{'!', '~'}}},
+  {"lower", {{'a', 'z'}}},
+  {"print", {{' ', '~'}}},
+  {"punct", {{'!', '/'}, {':', '@'}, {'[', '`'}, {'{', '~'}}},
+  {"space", {{'\t', '\r'}, {' ', ' '}}},
+  {"upper", {{'A', 'Z'}}},
+  {"word", {{'0', '9'}, {'A', 'Z'}, {'_', '_'}, {'a', 'z'}}},
+  {"xdigit", {{'0', '9'}, {'A', 'F'}, {'a', 'f'}}}};
+
+class Parser {
+ public:
+  explicit Parser(const std::string &pattern) :str_(pattern), pos_(0) {}
+
+  // Parse the pattern; on failure, returns nullptr and sets error
+  std::unique_ptr<RegexpNode> Parse(std::string *error) {
+    std::unique_ptr<RegexpNode> node = ParseAlternate();
+    if (node != nullptr && pos_ < str_.size()) {
+      assert(str_[pos_] == ')');
+      node = Fail("unexpected )");
+    }
+    *error = error_;
+    return node;
+  }
+
+ private:
+  const std::string &str_;
+  std::size_t pos_;
+  std::string error_;
+
+  std::unique_ptr<RegexpNode> Fail(const std::string &error) {
+    if (error_.empty()) {
+      error_ = error;
+    }
+    return nullptr;
+  }
+
+  inline bool AtEnd() const { return pos_ >= str_.size(); }
+
+  inline bool Consume(char c) {
+    if (!AtEnd() && str_[pos_] == c) {
+      pos_++;
+      return true;
+    }
+    return false;
+  }
+
+  std::unique_ptr<RegexpNode> ParseAlternate();
+  std::unique_ptr<RegexpNode> ParseConcat();
+  std::unique_ptr<RegexpNode> ParseRepeat();
+  std::unique_ptr<RegexpNode> ParseAtom();
+  std::unique_ptr<RegexpNode> ParseClass();
+
+  // Parse a {n}, {n,} or {n,m} repetition. Returns false, without
+  // consuming anything, if there isn't one at pos_.
+  bool ParseBounds(int *min, int *max);
+  bool ParseInt(int *val);
+
+  // Parse the escape sequence after a backslash, which is either a
+  // single code point (in which case ranges is left empty) or a class.
+  bool ParseEscape(std::uint32_t *c, Ranges *ranges);
+};
+
+std::unique_ptr<RegexpNode> Parser::ParseAlternate() {
+  std::unique_ptr<RegexpNode> node = ParseConcat();
+  if (node == nullptr || AtEnd() || str_[pos_] != '|') {
+    return node;
+  }
+  std::unique_ptr<RegexpNode> alt(new RegexpNode(RegexpNode::ALTERNATE));
+  alt->subs.push_back(std::move(node));
+  while (Consume('|')) {
+    node = ParseConcat();
+    if (node == nullptr) {
+      return nullptr;
+    }
+    alt->subs.push_back(std::move(node));
+  }
+  return alt;
+}
+
+std::unique_ptr<RegexpNode> Parser::ParseConcat() {
+  std::unique_ptr<RegexpNode> concat(new RegexpNode(RegexpNode::CONCAT));
+  while (!AtEnd() && str_[pos_] != '|' && str_[pos_] != ')') {
+    std::unique_ptr<RegexpNode> node = ParseRepeat();
+    if (node == nullptr) {
+      return nullptr;
+    }
+    // Runs of literals are kept as one string
+    if (node->op == RegexpNode::LITERAL && !concat->subs.empty() &&
+        concat->subs.back()->op == RegexpNode::LITERAL) {
+      concat->subs.back()->literal += node->literal;
+    } else {
+      concat->subs.push_back(std::move(node));
+    }
+  }
+  if (concat->subs.empty()) {
+    return std::unique_ptr<RegexpNode>(
+        new RegexpNode(RegexpNode::EMPTY_MATCH));
+  } else if (concat->subs.size() == 1) {
+    return std::move(concat->subs[0]);
+  }
+  return concat;
+}
+
+std::unique_ptr<RegexpNode> Parser::ParseRepeat() {
+  std::unique_ptr<RegexpNode> node = ParseAtom();
+  if (node == nullptr) {
+    return nullptr;
+  }
+  bool repeated = false;
+  while (!AtEnd()) {
+    int min, max;
+    const char c = str_[pos_];
+    if (c == '*') {
+      min = 0;
+      max = -1;
+      pos_++;
+    } else if (c == '+') {
+      min = 1;
+      max = -1;
+      pos_++;
+    } else if (c == '?') {
+      min = 0;
+      max = 1;
+      pos_++;
+    } else if (c == '{' && ParseBounds(&min, &max)) {
+      if (min > max_repeat || max > max_repeat || (max >= 0 && max < min)) {
+        return Fail("invalid repeat count");
+      }
+    } else {
+      break;
+    }
+    if (repeated) {
+      return Fail("invalid nested repetition operator");
+    }
+    repeated = true;
+    Consume('?');  // non-greedy
+
+    // Atoms are single characters, so a repetition never applies to
+    // more than one character of a literal
+    std::unique_ptr<RegexpNode> repeat(new RegexpNode(RegexpNode::REPEAT));
+    repeat->min = min;
+    repeat->max = max;
+    repeat->subs.push_back(std::move(node));
+    node = std::move(repeat);
+  }
+  return node;
+}
+
+std::unique_ptr<RegexpNode> Parser::ParseAtom() {
+  const char c = str_[pos_];
+  switch (c) {
+    case '*':
+    case '+':
+    case '?':
+      return Fail("missing argument to repetition operator");
+    case '(': {
+      pos_++;
+      if (Consume('?')) {
+        if (!Consume(':')) {
+          return Fail("unsupported group flags");
+        }
+      }
+      std::unique_ptr<RegexpNode> node = ParseAlternate();
+      if (node == nullptr) {
+        return nullptr;
+      }
+      if (!Consume(')')) {
+        return Fail("missing )");
+      }
+      return node;
+    }
+    case '.': {
+      pos_++;
+      std::unique_ptr<RegexpNode> node(new RegexpNode(RegexpNode::CHAR_CLASS));
+      node->ranges = NegateRanges({{'\n', '\n'}});
+      return node;
+    }
+    case '^':
+      pos_++;
+      return std::unique_ptr<RegexpNode>(
+          new RegexpNode(RegexpNode::BEGIN_LINE));
+    case '$':
+      pos_++;
+      return std::unique_ptr<RegexpNode>(
+          new RegexpNode(RegexpNode::END_LINE));
+    case '[':
+      pos_++;
+      return ParseClass();
+    case '\\': {
+      pos_++;
+      if (Consume('A')) {
+        return std::unique_ptr<RegexpNode>(
+            new RegexpNode(RegexpNode::BEGIN_LINE));
+      } else if (Consume('z')) {
+        return std::unique_ptr<RegexpNode>(
+            new RegexpNode(RegexpNode::END_LINE));
+      }
+      std::uint32_t code_point;
+      Ranges ranges;
+      if (!ParseEscape(&code_point, &ranges)) {
+        return nullptr;
+      }
+      if (!ranges.empty()) {
+        std::unique_ptr<RegexpNode> node(
+            new RegexpNode(RegexpNode::CHAR_CLASS));
+        node->ranges.swap(ranges);
+        return node;
+      }
+      std::unique_ptr<RegexpNode> node(new RegexpNode(RegexpNode::LITERAL));
+      AppendUtf8(code_point, &node->literal);
+      return node;
+    }
+    default: {
+      std::unique_ptr<RegexpNode> node(new RegexpNode(RegexpNode::LITERAL));
+      std::uint32_t code_point;
+      if (!DecodeUtf8(str_, &pos_, &code_point)) {
+        return Fail("invalid UTF-8");
+      }
+      AppendUtf8(code_point, &node->literal);
+      return node;
+    }
+  }
+}
+
+std::unique_ptr<RegexpNode> Parser::ParseClass() {
+  const bool negated = Consume('^');
+  Ranges ranges;
+  bool first = true;
+  while (true) {
+    if (AtEnd()) {
+      return Fail("missing ]");
+    }
+    // A ] at the start of the class is just a ]
+    if (str_[pos_] == ']' && !first) {
+      pos_++;
+      break;
+    }
+    first = false;
+
+    if (str_.compare(pos_, 2, "[:") == 0) {
+      const std::size_t end = str_.find(":]", pos_ + 2);
+      if (end != std::string::npos) {
+        std::string name = str_.substr(pos_ + 2, end - pos_ - 2);
+        const bool negate_class = !name.empty() && name[0] == '^';
+        if (negate_class) {
+          name.erase(0, 1);
+        }
+        auto it = std::find_if(
+            posix_classes.begin(), posix_classes.end(),
+            [&](const NamedClass &c) { return name == c.name; });
+        if (it == posix_classes.end()) {
+          return Fail("invalid character class");
+        }
+        const Ranges &cls = negate_class ? NegateRanges(it->ranges) :
+            it->ranges;
+        ranges.insert(ranges.end(), cls.begin(), cls.end());
+        pos_ = end + 2;
+        continue;
+      }
+    }
+
+    std::uint32_t lo;
+    if (Consume('\\')) {
+      Ranges cls;
+      if (!ParseEscape(&lo, &cls)) {
+        return nullptr;
+      }
+      if (!cls.empty()) {
+        ranges.insert(ranges.end(), cls.begin(), cls.end());
+        continue;
+      }
+    } else if (!DecodeUtf8(str_, &pos_, &lo)) {
+      return Fail("invalid UTF-8");
+    }
+
+    std::uint32_t hi = lo;
+    if (pos_ + 1 < str_.size() && str_[pos_] == '-' && str_[pos_ + 1] != ']') {
+      pos_++;
+      if (Consume('\\')) {
+        Ranges cls;
+        if (!ParseEscape(&hi, &cls)) {
+          return nullptr;
+        }
+        if (!cls.empty()) {
+          return Fail("invalid character class range");
+        }
+      } else if (!DecodeUtf8(str_, &pos_, &hi)) {
+        return Fail("invalid UTF-8");
+      }
+      if (hi < lo) {
+        return Fail("invalid character class range");
+      }
+    }
+    ranges.push_back({lo, hi});
+  }
+
+  CleanRanges(&ranges);
+  if (negated) {
+    ranges = NegateRanges(ranges);
+  }
+  std::unique_ptr<RegexpNode> node(new RegexpNode(
+      ranges.empty() ? RegexpNode::NO_MATCH : RegexpNode::CHAR_CLASS));
+  node->ranges.swap(ranges);
+  return node;
+}
+
+bool Parser::ParseBounds(int *min, int *max) {
+  const std::size_t start = pos_;
+  assert(str_[pos_] == '{');
+  pos_++;
+  if (ParseInt(min)) {
+    if (Consume('}')) {
+      *max = *min;
+      return true;
+    } else if (Consume(',')) {
+      if (Consume('}')) {
+        *max = -1;
+        return true;
+      } else if (ParseInt(max) && Consume('}')) {
+        return true;
+      }
+    }
+  }
+  pos_ = start;
+  return false;
+}
+
+bool Parser::ParseInt(int *val) {
+  const std::size_t start = pos_;
+  *val = 0;
+  while (!AtEnd() && str_[pos_] >= '0' && str_[pos_] <= '9') {
+    // anything this large is rejected as a repeat count anyway
+    if (*val <= max_repeat) {
+      *val = *val * 10 + (str_[pos_] - '0');
+    }
+    pos_++;
+  }
+  return pos_ > start;
+}
+
+bool Parser::ParseEscape(std::uint32_t *c, Ranges *ranges) {
+  if (AtEnd()) {
+    Fail("trailing backslash");
+    return false;
+  }
+  const char e = str_[pos_++];
+  switch (e) {
+    case 'a': *c = '\a'; return true;
+    case 'f': *c = '\f'; return true;
+    case 'n': *c = '\n'; return true;
+    case 'r': *c = '\r'; return true;
+    case 't': *c = '\t'; return true;
+    case 'v': *c = '\v'; return true;
+    case 'd':
+    case 'D':
+      *ranges = {{'0', '9'}};
+      break;
+    case 's':
+    case 'S':
+      *ranges = {{'\t', '\n'}, {'\f', '\r'}, {' ', ' '}};
+      break;
+    case 'w':
+    case 'W':
+      *ranges = {{'0', '9'}, {'A', 'Z'}, {'_', '_'}, {'a', 'z'}};
+      break;
+    case 'x': {
+      // \xHH or \x{HHHH}
+      const bool braces = Consume('{');
+      std::uint32_t val = 0;
+      std::size_t digits = 0;
+      while (!AtEnd() && isxdigit(str_[pos_]) && (braces || digits < 2)) {
+        const char h = str_[pos_++];
+        val = val * 16 + (isdigit(h) ? h - '0' : (tolower(h) - 'a' + 10));
+        if (val > max_code_point) {
+          Fail("invalid escape sequence");
+          return false;
+        }
+        digits++;
+      }
+      if (digits == 0 || (braces && !Consume('}')) ||
+          (!braces && digits != 2)) {
+        Fail("invalid escape sequence");
+        return false;
+      }
+      *c = val;
+      return true;
+    }
+    case 'b':
+    case 'B':
+      Fail("word boundaries aren't supported");
+      return false;
+    default:
+      // Any other punctuation is escaped as itself
+      if (static_cast<std::uint8_t>(e) < 0x80 && ispunct(e)) {
+        *c = static_cast<std::uint8_t>(e);
+        return true;
+      }
+      Fail("invalid escape sequence");
+      return false;
+  }
+  if (isupper(e)) {
+    *ranges = NegateRanges(*ranges);
+  }
+  return true;
+}
+}
+
+void AppendUtf8(std::uint32_t c, std::string *out) {
+  if (c < 0x80) {
+    out->push_back(static_cast<char>(c));
+  } else if (c < 0x800) {
+    out->push_back(static_cast<char>(0xC0 | (c >> 6)));
+    out->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  } else if (c < 0x10000) {
+    out->push_back(static_cast<char>(0xE0 | (c >> 12)));
+    out->push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  } else {
+    out->push_back(static_cast<char>(0xF0 | (c >> 18)));
+    out->push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  }
+}
+
+std::string CaseInsensitiveRegexp(const std::string &str) {
+  std::string pattern;
+  std::size_t i = 0;
+  while (i < str.size()) {
+    const std::uint8_t b = str[i];
+    std::size_t len = 1;
+    std::uint32_t c = b;
+    if (b >= 0x80) {
+      len = (b & 0xE0) == 0xC0 ? 2 : (b & 0xF0) == 0xE0 ? 3 : 4;
+      len = std::min(len, str.size() - i);
+      c = (len == 2 && (str[i + 1] & 0xC0) == 0x80) ?
+          ((b & 0x1F) << 6) | (str[i + 1] & 0x3F) : 0;
+    }
+    const std::vector<std::uint32_t> variants = CaseVariants(c);
+    if (c != 0 && variants.size() > 1) {
+      pattern += '[';
+      for (const auto &variant : variants) {
+        AppendUtf8(variant, &pattern);
+      }
+      pattern += ']';
+    } else if (b < 0x80 && ispunct(b)) {
+      pattern += '\\';
+      pattern += b;
+    } else {
+      pattern.append(str, i, len);
+    }
+    i += len;
+  }
+  return pattern;
+}
+
+Regexp::Regexp(const std::string &pattern)
+    :pattern_(pattern), start_(-1), num_byte_classes_(0) {
+  Parser parser(pattern_);
+  root_ = parser.Parse(&error_);
+  if (!ok()) {
+    return;
+  }
+  const int match = AddInst(Inst(Inst::MATCH, -1));
+  start_ = Compile(*root_, match);
+  if (start_ < 0) {
+    error_ = "regexp is too large";
+    return;
+  }
+  ComputeByteClasses();
+}
+
+int Regexp::AddInst(const Inst &inst) {
+  if (insts_.size() >= max_insts) {
+    return -1;
+  }
+  insts_.push_back(inst);
+  return insts_.size() - 1;
+}
+
+int Regexp::CompileBytes(const ByteRanges &bytes, int next) {
+  for (auto it = bytes.rbegin(); it != bytes.rend() && next >= 0; ++it) {
+    Inst inst(Inst::BYTE_RANGE, next);
+    inst.lo = it->first;
+    inst.hi = it->second;
+    next = AddInst(inst);
+  }
+  return next;
+}
+
+int Regexp::Compile(const RegexpNode &node, int next) {
+  switch (node.op) {
+    case RegexpNode::NO_MATCH:
+      return AddInst(Inst(Inst::FAIL, -1));
+    case RegexpNode::EMPTY_MATCH:
+      return next;
+    case RegexpNode::LITERAL: {
+      ByteRanges bytes;
+      for (const auto &c : node.literal) {
+        bytes.push_back({static_cast<std::uint8_t>(c),
+                         static_cast<std::uint8_t>(c)});
+      }
+      return CompileBytes(bytes, next);
+    }
+    case RegexpNode::CHAR_CLASS: {
+      std::vector<ByteRanges> seqs;
+      for (const auto &r : node.ranges) {
+        Utf8Sequences(r.first, r.second, &seqs);
+      }
+      if (seqs.empty()) {
+        return AddInst(Inst(Inst::FAIL, -1));
+      }
+      int start = -1;
+      for (const auto &seq : seqs) {
+        const int seq_start = CompileBytes(seq, next);
+        if (seq_start < 0) {
+          return -1;
+        }
+        start = start < 0 ? seq_start :
+            AddInst(Inst(Inst::SPLIT, seq_start, start));
+      }
+      return start;
+    }
+    case RegexpNode::BEGIN_LINE:
+      return AddInst(Inst(Inst::BEGIN_LINE, next));
+    case RegexpNode::END_LINE:
+      return AddInst(Inst(Inst::END_LINE, next));
+    case RegexpNode::CONCAT:
+      for (auto it = node.subs.rbegin(); it != node.subs.rend(); ++it) {
+        next = Compile(**it, next);
+        if (next < 0) {
+          return -1;
+        }
+      }
+      return next;
+    case RegexpNode::ALTERNATE: {
+      int start = -1;
+      for (auto it = node.subs.rbegin(); it != node.subs.rend(); ++it) {
+        const int sub_start = Compile(**it, next);
+        if (sub_start < 0) {
+          return -1;
+        }
+        start = start < 0 ? sub_start :
+            AddInst(Inst(Inst::SPLIT, sub_start, start));
+      }
+      return start;
+    }
+    case RegexpNode::REPEAT: {
+      const RegexpNode &sub = *node.subs[0];
+      int start = next;
+      if (node.max < 0) {
+        // loop back to a split that either matches sub again or stops
+        const int split = AddInst(Inst(Inst::SPLIT, -1, next));
+        if (split < 0) {
+          return -1;
+        }
+        const int sub_start = Compile(sub, split);
+        if (sub_start < 0) {
+          return -1;
+        }
+        insts_[split].out = sub_start;
+        start = split;
+      } else {
+        // each of the optional copies may be the last
+        for (int i = node.min; i < node.max && start >= 0; i++) {
+          const int sub_start = Compile(sub, start);
+          start = sub_start < 0 ? -1 :
+              AddInst(Inst(Inst::SPLIT, sub_start, next));
+        }
+      }
+      for (int i = 0; i < node.min && start >= 0; i++) {
+        start = Compile(sub, start);
+      }
+      return start;
+    }
+  }
+  assert(false);
+  return -1;
+}
+
+void Regexp::ComputeByteClasses() {
+  bool boundary[257];
+  memset(boundary, 0, sizeof(boundary));
+  for (const auto &inst : insts_) {
+    if (inst.kind == Inst::BYTE_RANGE) {
+      boundary[inst.lo] = true;
+      boundary[inst.hi + 1] = true;
+    }
+  }
+  int cls = 0;
+  for (int b = 0; b < 256; b++) {
+    if (boundary[b] && b > 0) {
+      cls++;
+    }
+    byte_classes_[b] = cls;
+  }
+  num_byte_classes_ = cls + 1;
+}
+
+RegexpMatcher::RegexpMatcher(const Regexp &re)
+    :re_(re), begin_state_(-1), visited_(re.insts_.size(), 0),
+     visit_gen_(0) {
+  assert(re_.ok());
+  NewGeneration();
+  AddClosure(re_.start_, false, false, &restart_);
+  Reset();
+}
+
+bool RegexpMatcher::Match(boost::string_ref line) {
+  int state = begin_state_;
+  if (states_[state].match) {
+    return true;
+  }
+  for (const auto &c : line) {
+    if (states_.size() >= max_dfa_states) {
+      std::vector<int> insts = states_[state].insts;
+      Reset();
+      state = StateFor(&insts);
+    }
+    state = Transition(state, static_cast<std::uint8_t>(c));
+    if (states_[state].match) {
+      return true;
+    } else if (states_[state].insts.empty()) {
+      // only an anchored regexp can get stuck like this
+      return false;
+    }
+  }
+  return EndMatch(state, line.empty());
+}
+
+void RegexpMatcher::NewGeneration() {
+  if (++visit_gen_ == 0) {
+    std::fill(visited_.begin(), visited_.end(), 0);
+    visit_gen_ = 1;
+  }
+}
+
+void RegexpMatcher::AddClosure(int inst, bool at_begin, bool at_end,
+                               std::vector<int> *insts) {
+  stack_.push_back(inst);
+  while (!stack_.empty()) {
+    const int i = stack_.back();
+    stack_.pop_back();
+    if (visited_[i] == visit_gen_) {
+      continue;
+    }
+    visited_[i] = visit_gen_;
+    const Regexp::Inst &in = re_.insts_[i];
+    switch (in.kind) {
+      case Regexp::Inst::BYTE_RANGE:
+      case Regexp::Inst::MATCH:
+        insts->push_back(i);
+        break;
+      case Regexp::Inst::SPLIT:
+        stack_.push_back(in.out1);
+        stack_.push_back(in.out);
+        break;
+      case Regexp::Inst::BEGIN_LINE:
+        if (at_begin) {
+          stack_.push_back(in.out);
+        }
+        break;
+      case Regexp::Inst::END_LINE:
+        if (at_end) {
+          stack_.push_back(in.out);
+        } else {
+          insts->push_back(i);
+        }
+        break;
+      case Regexp::Inst::FAIL:
+        break;
+    }
+  }
+}
+
+int RegexpMatcher::StateFor(std::vector<int> *insts) {
+  std::sort(insts->begin(), insts->end());
+  auto it = state_ids_.find(*insts);
+  if (it != state_ids_.end()) {
+    return it->second;
+  }
+  State state;
+  state.match = false;
+  for (const auto &i : *insts) {
+    if (re_.insts_[i].kind == Regexp::Inst::MATCH) {
+      state.match = true;
+    }
+  }
+  state.end_match = -1;
+  state.next.resize(re_.num_byte_classes_, -1);
+  state.insts = *insts;
+  states_.push_back(std::move(state));
+  state_ids_.insert({*insts, states_.size() - 1});
+  return states_.size() - 1;
+}
+
+int RegexpMatcher::Transition(int state, std::uint8_t byte) {
+  const std::uint8_t cls = re_.byte_classes_[byte];
+  if (states_[state].next[cls] >= 0) {
+    return states_[state].next[cls];
+  }
+  std::vector<int> insts;
+  NewGeneration();
+  for (const auto &i : states_[state].insts) {
+    const Regexp::Inst &in = re_.insts_[i];
+    if (in.kind == Regexp::Inst::BYTE_RANGE && byte >= in.lo &&
+        byte <= in.hi) {
+      AddClosure(in.out, false, false, &insts);
+    }
+  }
+  for (const auto &i : restart_) {
+    AddClosure(i, false, false, &insts);
+  }
+  const int next = StateFor(&insts);
+  states_[state].next[cls] = next;
+  return next;
+}
+
+bool RegexpMatcher::EndMatch(int state, bool at_begin) {
+  if (!at_begin && states_[state].end_match >= 0) {
+    return states_[state].end_match;
+  }
+  std::vector<int> insts;
+  NewGeneration();
+  for (const auto &i : states_[state].insts) {
+    AddClosure(i, at_begin, true, &insts);
+  }
+  bool match = false;
+  for (const auto &i : insts) {
+    if (re_.insts_[i].kind == Regexp::Inst::MATCH) {
+      match = true;
+    }
+  }
+  if (!at_begin) {
+    states_[state].end_match = match;
+  }
+  return match;
+}
+
+void RegexpMatcher::Reset() {
+  states_.clear();
+  state_ids_.clear();
+  std::vector<int> insts;
+  NewGeneration();
+  AddClosure(re_.start_, true, false, &insts);
+  begin_state_ = StateFor(&insts);
+}
+}  // namespace codesearch
@@ -0,0 +1,193 @@
+// -*- C++ -*-
+// Copyright 2012, Evan Klitzke <evan@eklitzke.org>
+//
+// A small regular expression engine for searching the lines of the
+// index. Patterns are parsed into a tree (which NGramQuery analyzes to
+// find the ngrams that a matching line must have), and compiled into
+// an NFA over the bytes of the UTF-8 text, which RegexpMatcher runs as
+// a lazily built DFA. There's no backtracking, so matching a line takes
+// time linear in its length whatever the pattern is.
+//
+// The syntax is the common subset of the POSIX ERE, Perl and RE2
+// syntaxes: literals, ".", character classes (including negated
+// classes, ranges, "[:alpha:]" style classes and \d \s \w and their
+// negations), "^" and "$" (which match at the start and end of the
+// line), grouping with "(...)" or "(?:...)", alternation with "|", and
+// the repetition operators "*", "+", "?", "{n}", "{n,}" and "{n,m}".
+// Non-greedy repetitions are accepted, but since all that a line
+// search needs to know is whether a line matches, they're the same as
+// greedy ones.
+
+#ifndef SRC_REGEXP_H_
+#define SRC_REGEXP_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+namespace codesearch {
+
+// A node in the parse tree of a regular expression
+struct RegexpNode {
+  enum Op {
+    NO_MATCH,     // matches nothing
+    EMPTY_MATCH,  // matches the empty string
+    LITERAL,      // matches the UTF-8 string literal
+    CHAR_CLASS,   // matches one code point in ranges
+    BEGIN_LINE,   // matches the empty string at the start of the line
+    END_LINE,     // matches the empty string at the end of the line
+    CONCAT,       // matches each of subs in turn
+    ALTERNATE,    // matches any of subs
+    REPEAT        // matches subs[0] min to max times (or more, if max < 0)
+  };
+
+  explicit RegexpNode(Op o) :op(o), min(0), max(0) {}
+
+  Op op;
+  std::string literal;
+
+  // The sorted, non-overlapping and non-adjacent ranges of code points
+  // of a CHAR_CLASS
+  std::vector<std::pair<std::uint32_t, std::uint32_t> > ranges;
+
+  int min;
+  int max;
+  std::vector<std::unique_ptr<RegexpNode> > subs;
+};
+
+class Regexp {
+ public:
+  // Parse and compile a pattern. If the pattern isn't valid, ok()
+  // returns false and error() says why.
+  explicit Regexp(const std::string &pattern);
+
+  Regexp(const Regexp &other) = delete;
+  Regexp& operator=(const Regexp &other) = delete;
+
+  bool ok() const { return error_.empty(); }
+  const std::string& error() const { return error_; }
+  const std::string& pattern() const { return pattern_; }
+
+  // The parse tree; only valid if ok() is true
+  const RegexpNode& root() const { return *root_; }
+
+ private:
+  friend class RegexpMatcher;
+
+  // An instruction of the NFA. BYTE_RANGE instructions consume a byte
+  // between lo and hi, and the others don't consume anything.
+  struct Inst {
+    enum Kind { BYTE_RANGE, SPLIT, BEGIN_LINE, END_LINE, FAIL, MATCH };
+
+    Inst(Kind k, int o, int o1 = -1)
+        :kind(k), lo(0), hi(0), out(o), out1(o1) {}
+
+    Kind kind;
+    std::uint8_t lo;
+    std::uint8_t hi;
+    int out;
+    int out1;  // the other branch of a SPLIT
+  };
+
+  const std::string pattern_;
+  std::string error_;
+  std::unique_ptr<RegexpNode> root_;
+
+  std::vector<Inst> insts_;
+  int start_;
+
+  // The bytes that no instruction tells apart are put in the same
+  // class, so that the DFA only needs a transition for each class.
+  std::uint8_t byte_classes_[256];
+  int num_byte_classes_;
+
+  // Compile a node of the tree, so that it continues at next once it
+  // matches. Returns the instruction that the node starts at, or -1
+  // if the program has grown too large.
+  int Compile(const RegexpNode &node, int next);
+
+  // Compile a sequence of byte ranges that continues at next
+  int CompileBytes(const std::vector<std::pair<std::uint8_t, std::uint8_t> >
+                   &bytes, int next);
+
+  int AddInst(const Inst &inst);
+
+  void ComputeByteClasses();
+};
+
+// Append the UTF-8 encoding of a code point to out
+void AppendUtf8(std::uint32_t c, std::string *out);
+
+// A pattern that matches a string ignoring case, i.e. that has a
+// character class for each letter with the letters that fold to the
+// same letter (see case_fold.h), and the rest of the string quoted
+std::string CaseInsensitiveRegexp(const std::string &str);
+
+// Matches lines against a Regexp. The DFA is built as it's needed, so
+// a RegexpMatcher shouldn't be shared between threads, but any number
+// of matchers can use the same Regexp.
+class RegexpMatcher {
+ public:
+  explicit RegexpMatcher(const Regexp &re);
+
+  RegexpMatcher(const RegexpMatcher &other) = delete;
+  RegexpMatcher& operator=(const RegexpMatcher &other) = delete;
+
+  // Returns true if the regexp matches anywhere in the line
+  bool Match(boost::string_ref line);
+
+ private:
+  // A DFA state is the set of NFA instructions that the NFA could be
+  // at: the BYTE_RANGE, END_LINE and MATCH instructions reachable from
+  // where it is. Transitions are filled in as they're taken, and -1
+  // means they haven't been yet.
+  struct State {
+    std::vector<int> insts;
+    bool match;
+    int end_match;  // -1 if unknown, otherwise whether $ leads to a match
+    std::vector<int> next;
+  };
+
+  const Regexp &re_;
+  std::vector<State> states_;
+  std::map<std::vector<int>, int> state_ids_;
+
+  // The start state when at the start of the line, and the instructions
+  // that each later position adds, since the regexp may start matching
+  // anywhere.
+  int begin_state_;
+  std::vector<int> restart_;
+
+  // Scratch space for following the instructions that don't consume
+  // input
+  std::vector<unsigned> visited_;
+  unsigned visit_gen_;
+  std::vector<int> stack_;
+
+  // Add the instructions reachable from inst without consuming input
+  // to insts. BEGIN_LINE instructions are only followed if at_begin is
+  // set, and END_LINE instructions if at_end is.
+  void AddClosure(int inst, bool at_begin, bool at_end,
+                  std::vector<int> *insts);
+
+  void NewGeneration();
+
+  // Get the id of the state for a set of instructions, adding it if
+  // it's new.
+  int StateFor(std::vector<int> *insts);
+
+  int Transition(int state, std::uint8_t byte);
+
+  bool EndMatch(int state, bool at_begin);
+
+  // Forget the states that have been built, except for the start state
+  void Reset();
+};
+}
+
+#endif  // SRC_REGEXP_H_
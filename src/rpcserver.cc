@@ -6,6 +6,7 @@
 #include <boost/filesystem.hpp>
 #include <glog/logging.h>
 
+#include "./context.h"
 #include "./ngram_index_reader.h"
 #include "./index.pb.h"
 #include "./util.h"
@@ -130,14 +131,17 @@ void IndexReaderConnection::Search(std::size_t size) {
   SearchQueryResponse *resp;
 
   if (reader_.get() == nullptr) {
-    reader_.reset(new NGramIndexReader(server_->db_path_, server_->threads_));
+    reader_.reset(new NGramIndexReader(server_->db_path_, server_->threads_,
+                                       server_->recent_queries_));
   }
 
   if (request.has_search_query()) {
     const SearchQueryRequest &search_query = request.search_query();
     LOG(INFO) << this << " doing search query, request_num = " <<
         request.request_num() << ", query = \"" <<
-        search_query.query() << "\", offset = " <<
+        search_query.query() << "\", regexp = " <<
+        search_query.regexp() << ", case_insensitive = " <<
+        search_query.case_insensitive() << ", offset = " <<
         search_query.offset() << ", limit = " <<
         search_query.limit() << "\n";
 
@@ -145,12 +149,51 @@ void IndexReaderConnection::Search(std::size_t size) {
                           search_query.within_file_limit()
                           //search_query.offset()
                           );
-    reader_->Find(search_query.query(), &results);
-
     resp = response.mutable_search_response();
-    for (const auto &result : results.contextual_results()) {
+    if (search_query.regexp() && search_query.case_insensitive()) {
+      resp->set_error("case-insensitive regexps aren't supported");
+    } else if (search_query.regexp()) {
+      std::string error;
+      if (!reader_->FindRegexp(search_query.query(), &results, &error)) {
+        LOG(INFO) << this << " invalid regexp: " << error << "\n";
+        resp->set_error(error);
+      }
+    } else {
+      std::string error;
+      if (!reader_->FindQuery(search_query.query(),
+                              search_query.case_insensitive(), &results,
+                              &error)) {
+        LOG(INFO) << this << " invalid query: " << error << "\n";
+        resp->set_error(error);
+      }
+    }
+
+    const Context *ctx = Context::Acquire(server_->db_path_);
+    const PostingCache *cache = ctx->posting_cache();
+    if (cache != nullptr) {
+      LOG(INFO) << this << " posting cache has " << cache->hits() <<
+          " hits, " << cache->misses() << " misses, " <<
+          cache->evictions() << " evictions, using " << cache->bytes() <<
+          " bytes\n";
+    }
+    const BlockCache *block_cache = ctx->block_cache();
+    if (block_cache != nullptr) {
+      LOG(INFO) << this << " block cache has " << block_cache->hits() <<
+          " hits, " << block_cache->misses() << " misses, " <<
+          block_cache->evictions() << " evictions, using " <<
+          block_cache->bytes() << " bytes\n";
+    }
+
+    for (const auto &result : results.contextual_results(reader_.get())) {
       resp->add_results()->MergeFrom(result);
     }
+    const FileCache *file_cache = ctx->file_cache();
+    if (file_cache != nullptr) {
+      LOG(INFO) << this << " file cache has " << file_cache->hits() <<
+          " hits, " << file_cache->misses() << " misses, " <<
+          file_cache->evictions() << " evictions, using " <<
+          file_cache->bytes() << " bytes\n";
+    }
   } else {
     LOG(WARNING) << this << " don't know how to handle queries of that type\n";
     SelfDestruct();
@@ -18,10 +18,11 @@ class IndexReaderServer {
   IndexReaderServer(const std::string &db_path,
                     boost::asio::io_service* io_service,
                     const boost::asio::ip::tcp::endpoint &endpoint,
-                    std::size_t threads = 0)
+                    std::size_t threads = 0,
+                    std::size_t recent_queries = 0)
       :db_path_(db_path), io_service_(io_service),
        acceptor_(*io_service, endpoint), conn_(nullptr), conn_count_(0),
-       threads_(threads) {}
+       threads_(threads), recent_queries_(recent_queries) {}
   IndexReaderServer(const IndexReaderServer &other) = delete;
   IndexReaderServer& operator=(const IndexReaderServer &other) = delete;
 
@@ -40,6 +41,7 @@ class IndexReaderServer {
   IndexReaderConnection *conn_;
   std::size_t conn_count_;
   std::size_t threads_;
+  std::size_t recent_queries_;
 
   void StartAccept();
 
@@ -6,72 +6,200 @@
 #include <glog/logging.h>
 
 #include <algorithm>
+#include <exception>
 #include <iostream>
+#include <queue>
 
 #include "./context.h"
+#include "./file_cache.h"
 #include "./file_util.h"
+#include "./ngram_index_reader.h"
+
+namespace {
+// Lower an atomic value to val, if val is smaller
+template <typename T>
+void LowerTo(std::atomic<T> *atomic, T val) {
+  T current = atomic->load(std::memory_order_relaxed);
+  while (val < current &&
+         !atomic->compare_exchange_weak(current, val,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {}
+}
+}
 
 namespace codesearch {
 
-std::vector<SearchResultContext> SearchResults::contextual_results() {
-  std::lock_guard<std::mutex> guard(mut_);
-  std::vector<SearchResultContext> results;
+void SearchResults::LowerCutoff(std::uint64_t file_id,
+                                std::size_t shard_num) {
+  LowerTo(&cutoff_, file_id);
+  LowerTo(&shard_cutoff_, shard_num);
+}
 
-  const std::string &vestibule = GetContext()->vestibule();
+void SearchResults::Merge(const std::vector<const LocalResults*> &locals) {
+  typedef std::vector<const map_type::value_type*> Files;
 
-#if 0
-  std::size_t offset_counter = 0;
+  // The files of each of the results, in order
+  std::vector<Files> files(locals.size());
+  for (std::size_t i = 0; i < locals.size(); i++) {
+    for (const auto &kv : locals[i]->map()) {
+      files[i].push_back(&kv);
+    }
+#ifndef USE_ORDERED_MAP
+    std::sort(files[i].begin(), files[i].end(),
+              [](const map_type::value_type *a,
+                 const map_type::value_type *b) {
+                return a->first < b->first;
+              });
 #endif
+  }
 
-  for (const auto &kv : map_) {
-#if 0
-    if (offset_counter < offset_) {
-      offset_counter++;
-      continue;
+  // A heap of the next file of each of the results, smallest id first
+  typedef std::pair<std::size_t, std::size_t> Cursor;
+  auto greater = [&](const Cursor &a, const Cursor &b) {
+    return files[b.first][b.second]->first < files[a.first][a.second]->first;
+  };
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(greater)> heap(
+      greater);
+  for (std::size_t i = 0; i < files.size(); i++) {
+    if (!files[i].empty()) {
+      heap.push({i, 0});
     }
-#endif
-    SearchResultContext context;
-    context.set_filename(kv.first.filename());
-
-    // We have to get all of the lines out of the file... we're going
-    // to make a map of line_num -> (is_match, line_text) and then
-    // fill in the context map with that.
-    std::map<std::size_t, std::pair<bool, std::string> > context_lines;
-    std::string filename = vestibule + "/" + kv.first.filename();
-
-    // For each line in the matched lines for this file...
-    for (const auto &line : kv.second) {
-      std::map<std::size_t, std::string> inner_context;
-      try {
-        inner_context = GetFileContext(filename, line.line_number, line.offset);
-      } catch (FileError &e) {
-        std::cerr << kv.first.filename() << ": " << e.what() << std::endl;
-        throw;
+  }
+  bool too_large = false;
+  while (!heap.empty() && !too_large) {
+    const Cursor cursor = heap.top();
+    heap.pop();
+    const auto &kv = *files[cursor.first][cursor.second];
+    for (const auto &val : kv.second) {
+      if (insert(kv.first, val) == BoundedMapInsertionResult::KEY_TOO_LARGE) {
+        // None of the files after this one fit either
+        too_large = true;
+        break;
       }
-      for (const auto &context_kv : inner_context) {
-        bool is_matched = context_kv.first == line.line_number;
-        auto pos = context_lines.lower_bound(context_kv.first);
-        if (pos == context_lines.end() || pos->first != context_kv.first) {
-          // this line num / line is not in the context_lines map
-          context_lines.insert(pos, {context_kv.first,
-              {is_matched, context_kv.second}});
-        } else {
-          // the line num is in the map; just update is_matched field
-          pos->second.first = is_matched;
+    }
+    if (cursor.second + 1 < files[cursor.first].size()) {
+      heap.push({cursor.first, cursor.second + 1});
+    }
+  }
+
+  if (BoundedMap::IsFull()) {
+    LowerCutoff(max_key().file_id());
+  }
+}
+
+BoundedMapInsertionResult LocalResults::insert(const FileKey &key,
+                                               const FileResult &val) {
+  if (PastCutoff(key.file_id())) {
+    return BoundedMapInsertionResult::KEY_TOO_LARGE;
+  }
+  const BoundedMapInsertionResult status = BoundedMap::insert(key, val);
+  if (status == BoundedMapInsertionResult::INSERT_SUCCESSFUL && IsFull()) {
+    results_->LowerCutoff(max_key().file_id(), shard_num_);
+  }
+  return status;
+}
+
+std::vector<SearchResultContext> SearchResults::contextual_results(
+    NGramIndexReader *reader) {
+  std::lock_guard<std::mutex> guard(mut_);
+  std::vector<SearchResultContext> results(map_.size());
+
+  // The context of each file is read by a task of its own, which fills
+  // in its place in results, so they stay in the order of the files.
+  // An error in a task is thrown from here once they're all done.
+  std::vector<std::function<void()> > tasks;
+  std::vector<std::exception_ptr> errors(map_.size());
+  std::size_t i = 0;
+  for (const auto &kv : map_) {
+    SearchResultContext *context = &results[i];
+    std::exception_ptr *error = &errors[i];
+    tasks.push_back([&kv, context, error]() {
+        try {
+          FileContext(kv.first, kv.second, context);
+        } catch (...) {
+          *error = std::current_exception();
         }
-      }
+      });
+    i++;
+  }
+  if (reader != nullptr) {
+    reader->RunTasks(tasks);
+  } else {
+    for (const auto &task : tasks) {
+      task();
     }
+  }
+  for (const auto &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+  return std::move(results);
+}
 
-    // Great, now we're ready to fill out a SearchResult structure
-    for (const auto &line : context_lines) {
-      SearchResult *sr = context.add_lines();
-      sr->set_line_num(line.first);
-      sr->set_is_matched_line(line.second.first);
-      sr->set_line_text(line.second.second);
+void SearchResults::FileContext(const FileKey &key,
+                                const std::vector<FileResult> &lines,
+                                SearchResultContext *context) {
+  const std::string &vestibule = GetContext()->vestibule();
+  const ContentReader *contents = GetContext()->contents();
+
+  context->set_filename(key.filename());
+
+  // We have to get all of the lines out of the file... we're going
+  // to make a map of line_num -> (is_match, line_text) and then
+  // fill in the context map with that. The text points into the
+  // file's contents or its mapping, which are kept until the end.
+  std::map<std::size_t, std::pair<bool, boost::string_ref> > context_lines;
+
+  // If the index has the file's contents, they're decompressed once
+  // for all of its lines; otherwise the file is mapped once (or
+  // found in the file cache), rather than for each line
+  FileContents file_contents;
+  std::shared_ptr<const MappedFile> mapped_file;
+  const bool bundled = (contents != nullptr &&
+                        contents->Find(key.file_id(), &file_contents));
+  if (!bundled) {
+    try {
+      mapped_file = FileCache::Get(GetContext()->file_cache(),
+                                   key.file_id(),
+                                   vestibule + "/" + key.filename());
+    } catch (FileError &e) {
+      std::cerr << key.filename() << ": " << e.what() << std::endl;
+      throw;
+    }
+  }
+
+  // For each line in the matched lines for this file...
+  std::vector<ContextLine> inner_context;
+  for (const auto &line : lines) {
+    inner_context.clear();
+    if (bundled) {
+      file_contents.GetContext(line.line_number, line.offset,
+                               &inner_context);
+    } else {
+      mapped_file->GetContext(line.line_number, line.offset,
+                              &inner_context);
+    }
+    for (const auto &context_kv : inner_context) {
+      bool is_matched = context_kv.first == line.line_number;
+      auto pos = context_lines.lower_bound(context_kv.first);
+      if (pos == context_lines.end() || pos->first != context_kv.first) {
+        // this line num / line is not in the context_lines map
+        context_lines.insert(pos, {context_kv.first,
+            {is_matched, context_kv.second}});
+      } else {
+        // the line num is in the map; just update is_matched field
+        pos->second.first = is_matched;
+      }
     }
+  }
 
-    results.push_back(context);
+  // Great, now we're ready to fill out a SearchResult structure
+  for (const auto &line : context_lines) {
+    SearchResult *sr = context->add_lines();
+    sr->set_line_num(line.first);
+    sr->set_is_matched_line(line.second.first);
+    sr->set_line_text(line.second.second.data(), line.second.second.size());
   }
-  return std::move(results);
 }
 }
@@ -4,6 +4,8 @@
 #ifndef SRC_SEARCH_RESULTS_H_
 #define SRC_SEARCH_RESULTS_H_
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <mutex>
 #include <string>
@@ -62,6 +64,9 @@ template <> struct hash<codesearch::FileKey> {
 
 namespace codesearch {
 
+class LocalResults;
+class NGramIndexReader;
+
 struct FileResult {
   FileResult(std::size_t off, std::size_t line_num)
       :offset(off), line_number(line_num) {}
@@ -75,12 +80,92 @@ struct FileResult {
   }
 };
 
+// The results of a query: the files with the smallest ids that have
+// matching lines, and their first lines. The workers that search the
+// shards each collect their own results (see LocalResults), which are
+// merged in with Merge() once they're done, so they don't contend for
+// the lock of the map. While they run, the smallest of the largest
+// file ids of any results that are full is kept as the cutoff: files
+// with bigger ids can't be in the results, so the workers skip them.
+//
+// Files are added to the shards of the index in order, so the shard
+// that the cutoff file is in is kept too. None of the shards after it
+// can add anything, which lets the workers that are searching them
+// stop between the steps of a search (see PastShard()), rather than
+// only when they get to a line that matches.
 class SearchResults : public BoundedMap<FileKey, FileResult> {
  public:
   SearchResults(std::size_t a, std::size_t b)
-      :BoundedMap(a, b) {}
+      :BoundedMap(a, b), cutoff_(UINT64_MAX), shard_cutoff_(SIZE_MAX) {}
+
+  // Returns true if the results can't take any more files, other than
+  // ones with smaller ids than theirs
+  bool IsFull() const {
+    return cutoff() != UINT64_MAX || BoundedMap::IsFull();
+  }
+
+  // Files with bigger ids than this can't be in the results
+  std::uint64_t cutoff() const {
+    return cutoff_.load(std::memory_order_acquire);
+  }
+
+  // Returns true if nothing in a shard can be in the results, because
+  // a shard before it has filled them
+  bool PastShard(std::size_t shard_num) const {
+    return shard_num > shard_cutoff_.load(std::memory_order_acquire);
+  }
+
+  // Lower the cutoff to file_id, if it's smaller. If the shard that the
+  // file is in is known, the shard cutoff is lowered to it too.
+  void LowerCutoff(std::uint64_t file_id, std::size_t shard_num = SIZE_MAX);
+
+  // Merge the results that workers collected into these results. Each
+  // of them is in the order of the files, so this is a k-way merge,
+  // which stops at the first file that doesn't fit.
+  void Merge(const std::vector<const LocalResults*> &locals);
+
+  // Get the lines around the results, for each file in order. If
+  // reader isn't null, the files are read in parallel by its workers.
+  std::vector<SearchResultContext> contextual_results(
+      NGramIndexReader *reader = nullptr);
+
+ private:
+  // Get the lines around the results in one file
+  static void FileContext(const FileKey &key,
+                          const std::vector<FileResult> &lines,
+                          SearchResultContext *context);
+
+  std::atomic<std::uint64_t> cutoff_;
+  std::atomic<std::size_t> shard_cutoff_;
+};
+
+// The results that one worker collects for a query. Only the worker
+// uses them, so they aren't locked, and they're bounded like the
+// SearchResults that they'll be merged into: a file that doesn't fit
+// in them can't fit in those either.
+class LocalResults : public BoundedMap<FileKey, FileResult, NullMutex> {
+ public:
+  explicit LocalResults(SearchResults *results)
+      :BoundedMap(results->max_keys(), results->max_vals()),
+       results_(results), shard_num_(SIZE_MAX) {}
+
+  // Set the shard that the lines being inserted are from
+  void set_shard_num(std::size_t shard_num) { shard_num_ = shard_num; }
+
+  // Returns true if the file can't be in the results, because its id
+  // is past the cutoff
+  bool PastCutoff(std::uint64_t file_id) const {
+    return file_id > results_->cutoff();
+  }
+
+  // Insert a line, like BoundedMap::insert does. Once these results
+  // are full, the cutoff is lowered to their largest file id, which is
+  // in the shard that the line is from.
+  BoundedMapInsertionResult insert(const FileKey &key, const FileResult &val);
 
-  std::vector<SearchResultContext> contextual_results();
+ private:
+  SearchResults *results_;
+  std::size_t shard_num_;
 };
 
 }  // namespace codesearch
@@ -25,9 +25,10 @@ namespace codesearch {
 template <typename T>
 class SSTableReader {
  public:
-  SSTableReader() :mmap_addr_(nullptr), mmap_size_(0) {}
+  SSTableReader() :mmap_addr_(nullptr), mmap_size_(0), eytzinger_(nullptr) {}
 
-  explicit SSTableReader(const std::string &name) :name_(name) {
+  explicit SSTableReader(const std::string &name)
+      :name_(name), eytzinger_(nullptr) {
     std::pair<std::size_t, const char *> mmap_data = GetMmapForFile(name);
     mmap_size_ = mmap_data.first;
     mmap_addr_ = mmap_data.second;
@@ -42,8 +43,14 @@ class SSTableReader {
     std::string padding = GetWordPadding(hdr_size);
 
     assert(hdr_.index_offset() < 1024); // sanity check
+    std::size_t eytzinger_size = 0;
+    if (hdr_.has_eytzinger_offset()) {
+      eytzinger_ = mmap_addr_ + hdr_.eytzinger_offset();
+      eytzinger_size = hdr_.num_keys() * key_storage;
+      assert(hdr_.eytzinger_offset() == hdr_.data_offset() + hdr_.data_size());
+    }
     assert(mmap_size_ == sizeof(std::uint64_t) + hdr_size + padding.size() +
-           hdr_.index_size() + hdr_.data_size());
+           hdr_.index_size() + hdr_.data_size() + eytzinger_size);
 
     assert(hdr_.key_size() == key_size);
   }
@@ -55,7 +62,8 @@ class SSTableReader {
       :name_(other.name_),
        mmap_addr_(other.mmap_addr_),
        mmap_size_(other.mmap_size_),
-       hdr_(other.hdr_) {}
+       hdr_(other.hdr_),
+       eytzinger_(other.eytzinger_) {}
 
   SSTableReader& operator=(const SSTableReader &other) = delete;
 
@@ -85,8 +93,9 @@ class SSTableReader {
     inline const SSTableReader* reader() const { return reader_; }
     inline std::ptrdiff_t offset() const { return offset_; }
 
-    // Parse a ProtocolBuffer from the data section of the index
-    inline void parse_protobuf(google::protobuf::MessageLite *msg) const {
+    // Get the raw bytes of the value from the data section of the
+    // index, as a (pointer, size) pair
+    inline std::pair<const char *, std::uint32_t> value() const {
       std::ptrdiff_t index_offset = offset_ * key_storage;
 #ifdef ENABLE_SLOW_ASSERTS
       assert(index_offset >= 0 &&
@@ -106,8 +115,14 @@ class SSTableReader {
 #ifdef ENABLE_SLOW_ASSERTS
       assert(data_size > 0);
 #endif
+      return {val_data + sizeof(data_size), data_size};
+    }
+
+    // Parse a ProtocolBuffer from the data section of the index
+    inline void parse_protobuf(google::protobuf::MessageLite *msg) const {
+      std::pair<const char *, std::uint32_t> val = value();
       google::protobuf::io::ArrayInputStream array_stream(
-          val_data + sizeof(data_size), data_size);
+          val.first, val.second);
       msg->ParseFromZeroCopyStream(&array_stream);
     }
 
@@ -141,8 +156,41 @@ class SSTableReader {
   const iterator begin() const { return iterator(this, 0); }
   const iterator end() const { return iterator(this, hdr_.num_keys()); }
 
+  // Find the first key that isn't less than key. If the table has a
+  // copy of its keys in Eytzinger order, this searches that instead of
+  // the index.
   const iterator lower_bound(const T &key) const {
-    return std::lower_bound(begin(), end(), key);
+    if (eytzinger_ == nullptr) {
+      return std::lower_bound(begin(), end(), key);
+    }
+
+    // Go down the tree to the left of each node that isn't less than
+    // key, and to the right of each node that is, without branching on
+    // the comparisons. The 16 nodes that are four levels down from a
+    // node are next to each other, and are prefetched (as four cache
+    // lines) while the levels in between are searched.
+    const std::size_t num_keys = hdr_.num_keys();
+    std::size_t k = 1;
+    while (k <= num_keys) {
+      const char *descendants = eytzinger_ + (16 * k - 1) * key_storage;
+      __builtin_prefetch(descendants);
+      __builtin_prefetch(descendants + 64);
+      __builtin_prefetch(descendants + 128);
+      __builtin_prefetch(descendants + 192);
+      k = 2 * k + (KeyAt(eytzinger_ + (k - 1) * key_storage) < key);
+    }
+
+    // The path ends with a step to the left from the node we want
+    // (that's the last node that wasn't less than key), followed by
+    // steps to the right, so dropping those steps and that one step
+    // leaves the node. If there was no step to the left, every key is
+    // less than key.
+    k >>= __builtin_ffsll(~k);
+    if (k == 0) {
+      return end();
+    }
+    return iterator(this, ReadUint64(eytzinger_ + (k - 1) * key_storage +
+                                     key_size));
   }
 
   const iterator lower_bound(const iterator lower,
@@ -166,6 +214,9 @@ class SSTableReader {
   const std::string& name() const { return name_; }
   std::uint64_t num_keys() const { return hdr_.num_keys(); }
 
+  // True if the table has a copy of its keys in Eytzinger order
+  bool has_eytzinger() const { return eytzinger_ != nullptr; }
+
   std::string shard_name() const {
     std::string::size_type pos = name_.find_last_of('/');
     if (pos == std::string::npos || pos == name_.size() - 1) {
@@ -185,39 +236,39 @@ private:
   // the header read from the index
   SSTableHeader hdr_;
 
-  T ReadKey(std::ptrdiff_t index_offset) const;
-};
+  // the keys in Eytzinger order, or nullptr if the table doesn't have
+  // them
+  const char *eytzinger_;
 
-template<>
-inline std::uint64_t SSTableReader<std::uint64_t>::ReadKey(
-    std::ptrdiff_t index_offset) const {
+  inline T ReadKey(std::ptrdiff_t index_offset) const {
 #ifdef ENABLE_SLOW_ASSERTS
-  assert(index_offset >= 0 &&
-         index_offset < static_cast<std::ptrdiff_t>(hdr_.index_size()));
+    assert(index_offset >= 0 &&
+           index_offset < static_cast<std::ptrdiff_t>(hdr_.index_size()));
 #endif
-  return ReadUint64(mmap_addr_ + hdr_.index_offset() + index_offset);
+    return KeyAt(mmap_addr_ + hdr_.index_offset() + index_offset);
+  }
+
+  // Read the key that's stored at an address
+  T KeyAt(const char *addr) const;
+};
+
+template<>
+inline std::uint64_t SSTableReader<std::uint64_t>::KeyAt(
+    const char *addr) const {
+  return ReadUint64(addr);
 }
 
 #if 0
 template<>
-inline std::uint32_t SSTableReader<std::uint32_t>::ReadKey(
-    std::ptrdiff_t index_offset) const {
-#ifdef ENABLE_SLOW_ASSERTS
-  assert(index_offset >= 0 &&
-         index_offset < static_cast<std::ptrdiff_t>(hdr_.index_size()));
-#endif
-  return ReadUint32(mmap_addr_ + hdr_.index_offset() + index_offset);
+inline std::uint32_t SSTableReader<std::uint32_t>::KeyAt(
+    const char *addr) const {
+  return ReadUint32(addr);
 }
 #endif
 
 template<>
-inline NGram SSTableReader<NGram>::ReadKey(std::ptrdiff_t index_offset) const {
-#ifdef ENABLE_SLOW_ASSERTS
-  assert(index_offset >= 0 &&
-         index_offset < static_cast<std::ptrdiff_t>(hdr_.index_size()));
-#endif
-  return NGram(mmap_addr_ + hdr_.index_offset() + index_offset +
-               key_size - NGram::ngram_size);
+inline NGram SSTableReader<NGram>::KeyAt(const char *addr) const {
+  return NGram(addr + key_size - NGram::ngram_size);
 }
 }  // namespace codesearch
 #endif
@@ -6,6 +6,9 @@
 #include "./index.pb.h"
 
 #include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
 
 namespace {
 std::uint64_t GetOffset(std::ostream *os) {
@@ -17,8 +20,10 @@ std::uint64_t GetOffset(std::ostream *os) {
 
 namespace codesearch {
 SSTableWriter::SSTableWriter(const std::string &name,
-                             std::size_t key_size)
+                             std::size_t key_size,
+                             SSTableHeader_ValueFormat value_format)
     :name_(name),
+     value_format_(value_format),
      state_(WriterState::UNINITIALIZED),
      num_keys_(0) {
   std::size_t sizediff = key_size % sizeof(std::size_t);
@@ -102,7 +107,7 @@ void SSTableWriter::Add(const google::protobuf::Message &key,
   Add(key_string, value_string);
 }
 
-void SSTableWriter::Merge() {
+void SSTableWriter::Merge(bool eytzinger) {
   assert(state_ == WriterState::INITIALIZED);
   state_ = WriterState::MERGED;
 
@@ -130,8 +135,12 @@ void SSTableWriter::Merge() {
   header.set_max_value(last_key_);
   header.set_key_size(key_size_);
   header.set_num_keys(num_keys_);
+  header.set_value_format(value_format_);
   header.set_index_offset(0);  // must do this to get header size
   header.set_data_offset(0);  // must do this to get header size
+  if (eytzinger) {
+    header.set_eytzinger_offset(0);  // must do this to get header size
+  }
 
   std::uint64_t header_size = header.ByteSize();
   std::string header_size_str = Uint64ToString(header_size);
@@ -151,6 +160,11 @@ void SSTableWriter::Merge() {
   WriteMergeContents(&data, &out);
   assert(boost::filesystem::remove(name_ + ".data"));
 
+  if (eytzinger) {
+    header.set_eytzinger_offset(GetOffset(&out));
+    WriteEytzinger(&idx, &out);
+  }
+
   std::uint64_t new_header_size = header.ByteSize();
   assert(header_size == new_header_size);
   out.seekp(header_size_str.size(), std::ostream::beg);
@@ -158,6 +172,42 @@ void SSTableWriter::Merge() {
   assert(out.tellp() == header_end_offset);
 }
 
+void SSTableWriter::WriteEytzinger(std::ifstream *is, std::ofstream *os) {
+  // The keys are read back from the index, where each is followed by
+  // its offset
+  std::vector<std::string> keys;
+  keys.reserve(num_keys_);
+  is->clear();
+  is->seekg(0);
+  std::unique_ptr<char[]> buf(new char[key_size_ + sizeof(std::uint64_t)]);
+  for (std::uint64_t i = 0; i < num_keys_; i++) {
+    is->read(buf.get(), key_size_ + sizeof(std::uint64_t));
+    assert(!is->fail());
+    keys.emplace_back(buf.get(), key_size_);
+  }
+
+  // Node k of the tree (numbered from 1) has children 2k and 2k + 1,
+  // so visiting the nodes in order assigns them the keys in order.
+  std::vector<std::uint64_t> order(num_keys_ + 1);
+  std::uint64_t next = 0;
+  std::function<void(std::uint64_t)> visit = [&](std::uint64_t k) {
+    if (k <= num_keys_) {
+      visit(2 * k);
+      order[k] = next++;
+      visit(2 * k + 1);
+    }
+  };
+  visit(1);
+  assert(next == num_keys_);
+
+  for (std::uint64_t k = 1; k <= num_keys_; k++) {
+    os->write(keys[order[k]].data(), key_size_);
+    const std::string index = Uint64ToString(order[k]);
+    os->write(index.data(), index.size());
+    assert(!os->fail());
+  }
+}
+
 void SSTableWriter::WriteMergeContents(std::ifstream *is,
                                        std::ofstream *os) {
   is->seekg(0);
@@ -9,6 +9,8 @@
 #include <boost/filesystem.hpp>
 #include <google/protobuf/message.h>
 
+#include "./index.pb.h"
+
 static_assert(sizeof(std::uint64_t) == 8, "Something's whack with uint64_t");
 
 namespace codesearch {
@@ -22,7 +24,9 @@ enum class WriterState : std::uint8_t {
 class SSTableWriter {
  public:
   SSTableWriter(const std::string &name,
-                std::size_t key_size);
+                std::size_t key_size,
+                SSTableHeader_ValueFormat value_format =
+                SSTableHeader_ValueFormat_PROTOBUF);
 
   // Add a key/value to the database
   void Add(const std::string &key, const std::string &val);
@@ -31,8 +35,10 @@ class SSTableWriter {
   void Add(const google::protobuf::Message &key,
            const google::protobuf::Message &val);
 
-  // Merge the index and data files into a single, unified SSTable
-  void Merge();
+  // Merge the index and data files into a single, unified SSTable. If
+  // eytzinger is set, a copy of the keys in Eytzinger order is written
+  // after the data (see SSTableHeader).
+  void Merge(bool eytzinger = false);
 
   // Get the current size of the table, as if it were merged
   std::size_t Size() {
@@ -47,6 +53,9 @@ class SSTableWriter {
   // (key_size_, sizeof(std::uint64_t)) pairs.
   std::size_t key_size_;
 
+  // How the values are encoded; this is recorded in the header.
+  const SSTableHeader_ValueFormat value_format_;
+
   // The state of the index writer.
   WriterState state_;
 
@@ -82,6 +91,9 @@ class SSTableWriter {
   void AddValue(const std::string &val);
 
   void WriteMergeContents(std::ifstream *is, std::ofstream *os);
+
+  // Write the keys of the index file in Eytzinger order
+  void WriteEytzinger(std::ifstream *is, std::ofstream *os);
 };
 
 }  // namespace codesearch